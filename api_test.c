@@ -0,0 +1,237 @@
+/**
+ * 嵌入式接口的并发测试：一个写者线程按乱序插入行，每 TXN_ROWS 行一个事务，
+ * 同时几个读者线程通过同一个 Table 反复执行 select 和 select count(*)。
+ *
+ *   gcc -O2 -DDB_NO_MAIN db.c api_test.c -o api_test -lpthread
+ *   ./api_test [--cache-frames N] [--wal] [--file api_test.db]
+ *
+ * 每个读者检查：行数从不减少，总是 TXN_ROWS 的整数倍（看不到提交了一半的事务）；
+ * select 返回的 id 严格递增，用户名和邮箱与 id 一致（看不到写了一半的行）。
+ * 之后用 db_bind_id 插入并查找 2^63 及以上的 id。
+ * 全部通过时输出 ok，否则输出出错的地方并以非零状态退出。
+ */
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+
+#define TEST_ROWS 20000
+#define TXN_ROWS 10
+#define TEST_READERS 4
+#define MAX_REPORTED_FAILURES 10
+
+typedef struct {
+    Table* table;
+    bool done;
+    uint32_t failures;
+} Test;
+
+typedef struct {
+    Test* test;
+    uint32_t reader;
+    uint64_t last_count;  // 这个读者上一次看到的行数
+    uint64_t rows;        // 当前这次 select 已经返回的行数
+    uint64_t last_id;
+    uint64_t count;  // select count(*) 的结果
+} Reader;
+
+/**
+ * 记一次失败，只输出前 MAX_REPORTED_FAILURES 次。
+ */
+void fail(Test* test, const char* format, ...) {
+    if (__atomic_fetch_add(&test->failures, 1, __ATOMIC_RELAXED) < MAX_REPORTED_FAILURES) {
+        va_list arguments;
+        va_start(arguments, format);
+        vprintf(format, arguments);
+        va_end(arguments);
+        printf("\n");
+    }
+}
+
+bool check_row(const Row* row, void* context) {
+    Reader* reader = context;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    snprintf(username, sizeof(username), "user%" PRIu64, row->id);
+    snprintf(email, sizeof(email), "person%" PRIu64 "@example.com", row->id);
+    if (reader->rows > 0 && row->id <= reader->last_id) {
+        fail(reader->test, "reader %u: id %" PRIu64 " after id %" PRIu64, reader->reader,
+             row->id, reader->last_id);
+    }
+    if (strcmp(row->username, username) != 0 || strcmp(row->email, email) != 0) {
+        fail(reader->test, "reader %u: row %" PRIu64 " is '%s', '%s'", reader->reader, row->id,
+             row->username, row->email);
+    }
+    reader->last_id = row->id;
+    reader->rows++;
+    return true;
+}
+
+bool read_count(const DbBatch* batch, void* context) {
+    Reader* reader = context;
+    reader->count = batch->ids[0];
+    return true;
+}
+
+/**
+ * 核对一次读到的行数，返回是否已经读到全部的行。
+ */
+bool check_count(Reader* reader, uint64_t count) {
+    if (count < reader->last_count) {
+        fail(reader->test, "reader %u: count went from %" PRIu64 " down to %" PRIu64,
+             reader->reader, reader->last_count, count);
+    }
+    if (count % TXN_ROWS != 0) {
+        fail(reader->test, "reader %u: count %" PRIu64 " is not a multiple of %d", reader->reader,
+             count, TXN_ROWS);
+    }
+    reader->last_count = count;
+    return count == TEST_ROWS;
+}
+
+void* run_reader(void* argument) {
+    Reader* reader = argument;
+    PrepareResult result;
+    Statement* select = db_prepare(reader->test->table, "select", &result);
+    Statement* count = db_prepare(reader->test->table, "select count(*)", &result);
+    // 写者结束后再读一轮，确认最后能看到全部的行
+    bool finished = false;
+    while (!finished) {
+        finished = __atomic_load_n(&reader->test->done, __ATOMIC_ACQUIRE);
+        reader->rows = 0;
+        db_step(select, check_row, reader);
+        bool all = check_count(reader, reader->rows);
+        db_step_batch(count, read_count, reader);
+        all = check_count(reader, reader->count) && all;
+        if (finished && !all) {
+            fail(reader->test, "reader %u: saw %" PRIu64 " of %d rows after the writer finished",
+                 reader->reader, reader->last_count, TEST_ROWS);
+        }
+    }
+    db_finalize(select);
+    db_finalize(count);
+    return NULL;
+}
+
+void* run_writer(void* argument) {
+    Test* test = argument;
+    PrepareResult result;
+    Statement* begin = db_prepare(test->table, "begin", &result);
+    Statement* commit = db_prepare(test->table, "commit", &result);
+    Statement* insert = db_prepare(test->table, "insert ? ? ?", &result);
+    // 与表大小互质的步长把 1..TEST_ROWS 打乱，插入落在树的各处，叶节点不断分裂
+    uint64_t id = 0;
+    for (uint32_t i = 0; i < TEST_ROWS; i++) {
+        if (i % TXN_ROWS == 0) {
+            db_step(begin, NULL, NULL);
+        }
+        id = (id + 7919) % TEST_ROWS;
+        char username[COLUMN_USERNAME_SIZE + 1];
+        char email[COLUMN_EMAIL_SIZE + 1];
+        snprintf(username, sizeof(username), "user%" PRIu64, id + 1);
+        snprintf(email, sizeof(email), "person%" PRIu64 "@example.com", id + 1);
+        db_bind_id(insert, 1, id + 1);
+        db_bind_text(insert, 2, username);
+        db_bind_text(insert, 3, email);
+        if (db_step(insert, NULL, NULL) != EXECUTE_SUCCESS) {
+            fail(test, "writer: insert %" PRIu64 " failed", id + 1);
+        }
+        if (i % TXN_ROWS == TXN_ROWS - 1) {
+            db_step(commit, NULL, NULL);
+        }
+    }
+    db_finalize(begin);
+    db_finalize(commit);
+    db_finalize(insert);
+    __atomic_store_n(&test->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+bool copy_row(const Row* row, void* context) {
+    *(Row*)context = *row;
+    return true;
+}
+
+/**
+ * 2^63 及以上的 id 只能用 db_bind_id 绑定，db_bind_int 会把它们当作负数拒绝。
+ */
+void check_large_ids(Test* test) {
+    PrepareResult result;
+    Statement* insert = db_prepare(test->table, "insert ? ? ?", &result);
+    Statement* select = db_prepare(test->table, "select where id = ?", &result);
+    uint64_t ids[] = {(uint64_t)1 << 63, UINT64_MAX};
+    if (db_bind_int(insert, 1, (int64_t)ids[0]) != PREPARE_NEGATIVE_ID) {
+        fail(test, "db_bind_int accepted id %" PRIu64, ids[0]);
+    }
+    for (uint32_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++) {
+        char username[COLUMN_USERNAME_SIZE + 1];
+        char email[COLUMN_EMAIL_SIZE + 1];
+        snprintf(username, sizeof(username), "user%" PRIu64, ids[i]);
+        snprintf(email, sizeof(email), "person%" PRIu64 "@example.com", ids[i]);
+        db_bind_id(insert, 1, ids[i]);
+        db_bind_text(insert, 2, username);
+        db_bind_text(insert, 3, email);
+        if (db_step(insert, NULL, NULL) != EXECUTE_SUCCESS) {
+            fail(test, "insert %" PRIu64 " failed", ids[i]);
+        }
+        Row row = {0};
+        db_bind_id(select, 1, ids[i]);
+        db_step(select, copy_row, &row);
+        if (row.id != ids[i] || strcmp(row.username, username) != 0) {
+            fail(test, "select where id = %" PRIu64 " found id %" PRIu64, ids[i], row.id);
+        }
+    }
+    db_finalize(insert);
+    db_finalize(select);
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = "api_test.db";
+    DbOptions options = db_default_options();
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cache-frames") == 0 && i + 1 < argc) {
+            options.cache_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.wal = true;
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            printf("Usage: %s [--cache-frames N] [--wal] [--file path]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char wal_path[4096];
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+    remove(path);
+    remove(wal_path);
+    Test test = {.table = db_open_with_options(path, options)};
+    if (test.table == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    Reader readers[TEST_READERS];
+    pthread_t threads[TEST_READERS + 1];
+    for (uint32_t i = 0; i < TEST_READERS; i++) {
+        readers[i] = (Reader){.test = &test, .reader = i};
+        pthread_create(&threads[i], NULL, run_reader, &readers[i]);
+    }
+    pthread_create(&threads[TEST_READERS], NULL, run_writer, &test);
+    for (uint32_t i = 0; i <= TEST_READERS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    check_large_ids(&test);
+    db_close(test.table);
+    remove(path);
+    remove(wal_path);
+
+    if (test.failures > 0) {
+        printf("%u failures\n", test.failures);
+        exit(EXIT_FAILURE);
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+/**
+ * 基准测试驱动：直接链接存储引擎，对每一种表大小和缓冲池大小的组合运行 db_bench。
+ *
+ *   gcc -O2 -DDB_NO_MAIN db.c bench.c -o bench -lpthread
+ *   ./bench --rows 10000,1000000 --cache-frames 64,1024 --page-size 4096,65536 \
+ *           [--mmap] [--wal] [--file bench.db]
+ *
+ * 每个负载输出一行 JSON，字段见 db.c 中的 db_bench。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+
+#define BENCH_MAX_CONFIGS 16
+
+/**
+ * 解析逗号分隔的正整数列表，返回个数，格式错误时返回 0。
+ */
+uint32_t parse_list(char* string, uint32_t* values) {
+    uint32_t count = 0;
+    for (char* token = strtok(string, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (count == BENCH_MAX_CONFIGS || atoi(token) <= 0) {
+            return 0;
+        }
+        values[count++] = atoi(token);
+    }
+    return count;
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t rows[BENCH_MAX_CONFIGS] = {10000};
+    uint32_t num_rows = 1;
+    uint32_t cache_frames[BENCH_MAX_CONFIGS];
+    uint32_t num_cache_frames = 1;
+    uint32_t page_sizes[BENCH_MAX_CONFIGS];
+    uint32_t num_page_sizes = 1;
+    const char* path = "bench.db";
+    DbOptions options = db_default_options();
+    cache_frames[0] = options.cache_frames;
+    page_sizes[0] = options.page_size;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            num_rows = parse_list(argv[++i], rows);
+        } else if (strcmp(argv[i], "--cache-frames") == 0 && i + 1 < argc) {
+            num_cache_frames = parse_list(argv[++i], cache_frames);
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            num_page_sizes = parse_list(argv[++i], page_sizes);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.pager_mode = PAGER_MODE_MMAP;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.wal = true;
+        } else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else {
+            num_rows = 0;
+        }
+        if (num_rows == 0 || num_cache_frames == 0 || num_page_sizes == 0) {
+            printf("Usage: %s [--rows N,...] [--cache-frames N,...] [--page-size N,...] "
+                   "[--mmap] [--wal] [--file PATH]\n",
+                   argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_rows; i++) {
+        for (uint32_t j = 0; j < num_cache_frames; j++) {
+            for (uint32_t k = 0; k < num_page_sizes; k++) {
+                options.cache_frames = cache_frames[j];
+                options.page_size = page_sizes[k];
+                db_bench(path, rows[i], options);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,14 +1,30 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "db.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 /*******************************************************************
  * 枚举，宏定义，结构体，常量
  *******************************************************************/
@@ -18,47 +34,116 @@ typedef enum {
     META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
-typedef enum {
-    PREPARE_SUCCESS,
-    PREPARE_NEGATIVE_ID,
-    PREPARE_STRING_TOO_LONG,
-    PREPARE_SYNTAX_ERROR,
-    PREPARE_UNRECOGNIZED_STATEMENT
-} PrepareResult;
-
-typedef enum {
-    EXECUTE_SUCCESS,
-    EXECUTE_DUPLICATE_KEY
-} ExecuteResult;
-
 typedef enum {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_CREATE_INDEX
 } StatementType;
 
 typedef enum {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_FREE,  // 在空闲页面链表中，等待 get_unused_page_num 重新使用
+    NODE_INDEX_INTERNAL,
+    NODE_INDEX_LEAF,
+    NODE_META
 } NodeType;
 
+/**
+ * 标准输入按块读入 data，buffer 指向其中的当前一行，行尾的换行符改成 '\0'。
+ * data[start, end) 是读入后还没有交出去的部分。
+ */
 typedef struct {
     char* buffer;
-    size_t buffer_length;
     ssize_t input_length;
+    char* data;
+    size_t capacity;
+    size_t start;
+    size_t end;
 } InputBuffer;
 
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-typedef struct {
-    uint32_t id;
-    char username[COLUMN_USERNAME_SIZE + 1];
-    char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+typedef enum {
+    OUTPUT_MODE_TEXT,   // 每行打印成 (id, username, email)
+    OUTPUT_MODE_BINARY  // 见 binary_batch_callback
+} OutputMode;
 
+/**
+ * REPL 的 select 结果。二进制模式下先攒在 data 中，满了或一条语句结束时
+ * 用一次 write 写到标准输出。
+ */
 typedef struct {
+    OutputMode mode;
+    char* data;
+    uint32_t length;
+    uint32_t capacity;
+} OutputBuffer;
+
+typedef enum {
+    SELECT_ALL,
+    SELECT_EQUAL,
+    SELECT_GREATER,
+    SELECT_GREATER_EQUAL,
+    SELECT_LESS,
+    SELECT_LESS_EQUAL,
+    SELECT_BETWEEN,
+    SELECT_COLUMN_EQUAL  // where username = ... 或 where email = ...
+} SelectOp;
+
+// select 输出完整的行、只输出 id，或者对 id 做聚合
+typedef enum {
+    PROJECT_ROWS,
+    PROJECT_ID,
+    PROJECT_COUNT,
+    PROJECT_MIN,
+    PROJECT_MAX
+} Projection;
+
+// 可以建二级索引的列
+typedef enum {
+    INDEX_COLUMN_USERNAME,
+    INDEX_COLUMN_EMAIL
+} IndexColumn;
+
+#define NUM_INDEX_COLUMNS 2
+
+// 占位符的值填到语句的哪个位置
+typedef enum {
+    PARAM_ID,
+    PARAM_USERNAME,
+    PARAM_EMAIL,
+    PARAM_SELECT_OPERAND_0,
+    PARAM_SELECT_OPERAND_1,
+    PARAM_WHERE_VALUE
+} ParamTarget;
+
+#define STATEMENT_MAX_PARAMS 4
+
+struct Statement {
     StatementType type;
     Row row_to_insert;
-} Statement;
+    // insert values (...), (...) 的各行，单行 insert 为 NULL、只用 row_to_insert
+    Row* rows;
+    uint32_t num_rows;
+    // select/delete/update where id <op> ...，执行时才换算成键的范围，操作数可以是占位符
+    SelectOp select_op;
+    uint64_t select_operands[2];
+    Projection projection;
+    // create index on 的列，或 where 条件中与 where_value 比较的列
+    IndexColumn column;
+    char where_value[COLUMN_EMAIL_SIZE + 1];
+    // update set 要改的列，新值放在 row_to_insert 中
+    bool update_username;
+    bool update_email;
+
+    Table* table;  // db_prepare 编译的语句所属的表，REPL 的语句为 NULL
+    uint32_t num_params;
+    ParamTarget params[STATEMENT_MAX_PARAMS];
+    uint32_t bound_params;  // 已绑定参数的位图
+};
 
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
 
@@ -72,22 +157,331 @@ const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
 
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
-const uint32_t PAGE_SIZE = 4096;
-#define TABLE_MAX_PAGES 400
+/**
+ * 页面大小在创建数据库时选定，记录在文件头中，之后不能改变。
+ * 节点布局中与页面大小有关的量由 set_page_size 在打开数据库时计算，
+ * 所以一个进程中同时打开的数据库必须使用相同的页面大小。
+ * 大页面适合扫描，小页面适合点查。
+ */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+uint32_t PAGE_SIZE = DEFAULT_PAGE_SIZE;
 
 #define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+
+/**
+ * 缓冲池的帧数。页面数量不再受限，内存占用只取决于帧数。
+ */
+#define PAGER_DEFAULT_FRAMES 1024
+#define PAGER_MIN_FRAMES 64
+
+/**
+ * 回收的页面版本留在空闲链表中供下次保存映像复用。一次事务会为修改的每个页面
+ * 保存映像，链表最多保留与缓冲池帧数一样多的版本，但不少于这个数。
+ */
+#define PAGER_SPARE_VERSIONS 64
+
+/**
+ * mmap 模式预留的虚拟地址空间。文件在预留区内原地扩展映射，
+ * 已返回的页面指针在增长后依然有效。
+ */
+#define PAGER_MMAP_RESERVE ((size_t)1 << 40)
+#define PAGER_MMAP_MIN_GROWTH 64
+#define PAGER_MMAP_LATCHES_SIZE (PAGER_MMAP_RESERVE / PAGE_SIZE * sizeof(pthread_rwlock_t))
+
+/**
+ * 扫描时按父节点中记录的页号提前预读后面的叶节点，
+ * 冷数据的顺序扫描不必每个页面等一次 I/O。
+ */
+#define PAGER_DEFAULT_PREFETCH 32
+#define PAGER_MAX_PREFETCH 256
+
+/**
+ * 预写日志（WAL）。每次提交把事务修改过的页面映像追加到 <db>-wal，
+ * 再追加一条提交记录并 fsync。日志中的页面数超过阈值时做检查点：
+ * 把脏页写回数据库文件、fsync，然后清空日志。
+ */
+#define WAL_RECORD_PAGE 0x50574C57    // "WLWP"
+#define WAL_RECORD_COMMIT 0x43574C57  // "WLWC"
+#define WAL_CHECKPOINT_PAGES 1024
+
+/**
+ * 后台检查点线程每隔 CHECKPOINT_INTERVAL_MS 醒来一次，按页号顺序写回一部分已提交的脏页，
+ * 每秒最多写回 checkpoint_rate 页。脏页全部写回后 fsync 数据库文件并清空日志。
+ * I/O 因此平稳地分摊到运行期间，关闭时剩下要写的页面很少。
+ * 提交时日志超过 WAL_CHECKPOINT_PAGES 的同步检查点仍然保留，写入速度超过限速时兜底。
+ */
+#define CHECKPOINT_INTERVAL_MS 100
+#define CHECKPOINT_DEFAULT_RATE 2048
+
+typedef struct {
+    uint32_t type;
+    uint32_t page_num;  // 页面记录为页号；提交记录为提交后数据库的页数
+    uint32_t checksum;
+    uint32_t page_size;  // 恢复在读取文件头之前进行，页面映像的长度记在每条记录中
+} WalRecordHeader;
+
+typedef struct {
+    int file_descriptor;
+    char* path;
+
+    /**
+     * 组提交：追加在互斥锁内完成，fsync 在锁外进行。
+     * 等待持久化的提交者中只有一个负责 fsync，
+     * 它完成时一并覆盖此前追加的所有提交。
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t synced;
+    off_t append_offset;
+    off_t durable_offset;
+    bool sync_in_progress;
+
+    uint32_t pages_since_checkpoint;
+    uint64_t generation;  // 每清空一次加一，后台检查点据此判断日志是否变过
+    void* buffer;
+    size_t buffer_capacity;
+} Wal;
+
+/**
+ * io_uring 引擎。直接使用系统调用和共享内存环，不依赖 liburing。
+ * 单页读写仍然是一次 pread/pwrite；成批的写回和预读放进提交队列，
+ * 一次 io_uring_enter 提交，缓冲池按完成事件更新帧的状态。
+ */
+#define IO_URING_ENTRIES 256
+
+typedef enum {
+    IO_READ_FRAME,  // 预读到帧，低 32 位为帧下标
+    IO_WRITE_FRAME, // 写回帧，低 32 位为帧下标
+    IO_WRITE_MAP    // mmap 模式写回，低 32 位为页号
+} IoRequestType;
+
+typedef struct {
+    int ring_fd;
+    uint32_t entries;
+    uint32_t queued;     // 已放入提交队列，还没有提交
+    uint32_t in_flight;  // 已提交，还没有完成
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;  // 内核支持 IORING_FEAT_SINGLE_MMAP 时与 sq_ring 相同
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    struct io_uring_cqe* cqes;
+} IoUring;
+
+/**
+ * 并发：缓冲池的元数据（页表、帧的页号和状态、事务写集合）由 Pager.lock 保护；
+ * 页面内容由每页一个的读写锁存保护，读者加共享锁存，唯一的写者加排他锁存。
+ * 锁存只能加在已固定的页面上，随固定一起记录在本线程的固定栈中。
+ */
+typedef enum { LATCH_NONE, LATCH_SHARED, LATCH_EXCLUSIVE } LatchMode;
+
+typedef struct {
+    uint32_t page_num;  // 帧中缓存的页号，空帧为 INVALID_PAGE_NUM
+    void* data;
+    bool dirty;
+    bool referenced;  // CLOCK 算法的访问位
+    uint32_t pin_count;  // 只在持有 Pager.lock 时增加，释放固定时原子地减少
+    bool io_pending;  // 读取还没有完成；期间帧保持固定
+    pthread_rwlock_t latch;
+} Frame;
+
+typedef struct {
+    Frame* frame;              // mmap 模式下为 NULL
+    pthread_rwlock_t* latch;   // 没有加锁存时为 NULL
+} Pin;
+
+typedef struct {
+    Pin* pins;
+    uint32_t size;
+    uint32_t capacity;
+} PinStack;
+
+/**
+ * 多版本并发：写者在事务中第一次修改已提交的页面之前保存它的映像，
+ * 映像在序号为 end_seq 的事务提交时被覆盖。快照记录开始时已提交的事务数，
+ * 读取页面时取 end_seq 大于快照的最早映像，没有就读当前页面。
+ * 长时间的扫描因此看到一致的树，写者不必等它结束。
+ */
+typedef struct PageVersion {
+    uint32_t page_num;
+    uint64_t end_seq;
+    void* data;
+    struct PageVersion* older;  // 同一页面更早的版本
+    struct PageVersion* next;   // 事务的映像链表，或按 end_seq 排列的回收队列
+} PageVersion;
+
+// 不注册的快照，总是读当前页面。只给持有 write_lock 的事务读自己的修改
+#define SNAPSHOT_LATEST UINT64_MAX
+
+typedef enum {
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_EVICTIONS,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_FSYNCS,
+    STAT_LEAF_SPLITS,
+    STAT_INTERNAL_SPLITS,
+    STAT_ROW_CACHE_HITS,
+    STAT_ROW_CACHE_MISSES,
+    NUM_STATS
+} StatCounter;
+
+/**
+ * 运行时统计按线程分片：每个线程只写自己的分片，不加锁也不争用缓存行，
+ * 读取时把所有分片加起来。线程退出后分片保留，计数不会丢失。
+ */
+typedef struct StatsShard {
+    uint64_t counters[NUM_STATS];
+    uint64_t phase_count[DB_NUM_PHASES];
+    uint64_t phase_nanos[DB_NUM_PHASES];
+    uint64_t phase_histogram[DB_NUM_PHASES][DB_STATS_HISTOGRAM_BUCKETS];
+    pthread_t owner;
+    struct StatsShard* next;
+} __attribute__((aligned(64))) StatsShard;
 
 typedef struct {
     int file_descriptor;
-    uint32_t file_length;
+    off_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+    PagerMode mode;
+
+    pthread_mutex_t lock;
+    pthread_cond_t io_done;  // 同步读取完成时广播
+
+    // PAGER_MODE_MMAP：映射基址、已映射页数、脏页位图
+    void* map;
+    uint32_t mapped_pages;
+    uint8_t* dirty_map;
+    // 每页的锁存预留在一段不会移动的地址空间中，首次使用时初始化
+    pthread_rwlock_t* map_latches;
+    uint8_t* latch_map;
+
+    Frame** frames;  // 帧的地址在扩容时不变，固定栈可以直接指向帧
+    // 配置的 frame_limit 个帧及其页面一次性分配，页面数据按 PAGE_SIZE 对齐；
+    // 超出的临时帧单独分配，收回时释放
+    Frame* frame_slab;
+    void* data_slab;
+    uint32_t slab_frames;
+    uint32_t num_frames;
+    uint32_t frame_limit;  // 配置的帧数；全部帧被占用时临时超出，提交后收回
+    uint32_t clock_hand;
+
+    // 页号 -> 帧下标，按需扩容
+    uint32_t* page_table;
+    uint32_t page_table_capacity;
+
+    // 当前事务修改过的页面（写集合），提交时写入 WAL
+    uint32_t* txn_pages;
+    uint32_t txn_num_pages;
+    uint32_t txn_capacity;
+    uint8_t* txn_map;
+    uint32_t txn_map_size;
+
+    Wal* wal;  // 未启用 WAL 时为 NULL
+
+    uint32_t prefetch_pages;  // 扫描时预读的叶节点数，0 表示关闭
+    IoUring* ring;            // 未启用或内核不支持 io_uring 时为 NULL
+    bool compress;            // 文件头中有 FILE_HEADER_COMPRESSED
+
+    // 页面版本，在 Pager.lock 保护下维护
+    uint64_t commit_seq;       // 已提交的事务数，即最新快照的版本号
+    uint32_t committed_pages;  // 上次提交时的页面数，之后分配的页面没有旧版本
+    PageVersion** versions;    // 页号 -> 版本链，新的在前
+    uint32_t versions_capacity;
+    uint32_t num_versions;          // 读者不加锁读取，为 0 时跳过查找
+    PageVersion* txn_versions;      // 当前事务保存的映像
+    PageVersion* oldest_version;    // 已提交的版本按 end_seq 排队，从这一端回收
+    PageVersion* newest_version;
+    PageVersion* spare_versions;  // 可复用的版本，连同页面缓冲
+    uint32_t num_spare_versions;
+    uint64_t* snapshots;  // 活动快照的版本号
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+
+    // 运行时统计的分片链表，只在加入新分片和关闭时加 stats_lock
+    uint64_t stats_id;  // 区分不同的 Pager，线程据此判断缓存的分片是否属于这个 Pager
+    StatsShard* stats_shards;
+    pthread_mutex_t stats_lock;
 } Pager;
 
+/**
+ * 从根到叶的下降路径。pages[i] 是第 i 层经过的内部节点，
+ * slots[i] 是在该节点中选择的子节点下标（右子节点为 num_keys）。
+ * 拆分沿着这条路径向上传递，节点中不再维护父指针。
+ * 键范围放不进 32 位差值的节点改存完整的键，拆分总是对半分，
+ * 内部节点至少有几十个子节点，32 层远远用不完。
+ */
+#define BTREE_MAX_DEPTH 32
+
 typedef struct {
+    uint32_t depth;  // 内部节点的层数，根节点是叶节点时为 0
+    uint32_t pages[BTREE_MAX_DEPTH];
+    uint32_t slots[BTREE_MAX_DEPTH];
+    uint32_t leaf_page_num;
+
+    // 叶节点负责的键范围 (lower_bound, upper_bound]，由路径上的内部节点键决定
+    bool has_lower_bound;
+    uint64_t lower_bound;
+    bool has_upper_bound;
+    uint64_t upper_bound;
+} TreePath;
+
+typedef struct ScanPool ScanPool;
+typedef struct Checkpointer Checkpointer;
+typedef struct RowCache RowCache;
+
+struct Table {
     Pager* pager;
     uint32_t root_page_num;  // btree 由其根节点页号标识
-} Table;
+
+    /**
+     * 最近一次下降的路径。键落在同一个叶节点范围内时直接复用，
+     * 连续插入相近的键不必每次从根节点开始。任何拆分都会使其失效。
+     */
+    TreePath path_cache;
+    bool path_cache_valid;
+
+    // 写语句互斥执行，路径缓存只由持有它的写者使用
+    pthread_mutex_t write_lock;
+
+    uint32_t meta_page_num;  // 0 表示还没有元数据页，只由写者访问
+    /**
+     * 各列二级索引的根节点页号，0 表示没有索引。根节点的页号建好后不再改变。
+     * 建索引的事务提交后序号为 index_created 的快照才能使用它，更早的快照里还没有这个索引。
+     * 写者先写 index_created 再写根节点页号，读者反过来读。
+     */
+    uint32_t index_roots[NUM_INDEX_COLUMNS];
+    uint64_t index_created[NUM_INDEX_COLUMNS];
+
+    ScanPool* scan_pool;  // 并行扫描的线程池，未启用时为 NULL
+    Checkpointer* checkpointer;  // 后台检查点线程，未启用时为 NULL
+    RowCache* row_cache;         // 点查的热点行缓存，未启用时为 NULL
+};
+
+// 写者下降时按将要进行的修改判断哪些祖先可以放开
+typedef enum {
+    WRITE_INSERT,
+    WRITE_DELETE
+} WriteOp;
+
+/**
+ * 当前线程打开了事务的表。事务期间线程一直持有该表的 write_lock，
+ * 其中的语句不再各自加锁和提交。
+ */
+_Thread_local Table* txn_table;
 
 typedef struct {
     Table* table;
@@ -95,11 +489,20 @@ typedef struct {
     uint32_t page_num;
     uint32_t cell_num;
     bool end_of_table;  // Indicates a position one past the last element
+    uint64_t snapshot;  // 读者游标的快照；写者的游标总是在最新的页面上
+    TreePath path;      // 到当前叶节点的路径，cursor_advance 换页时一并更新
+
+    // 已经在 prefetch_parent 中预读到第 prefetch_until 个子节点
+    uint32_t prefetch_parent;
+    uint32_t prefetch_until;
 } Cursor;
 
 /**
  * Common Node Header Layout
  * 公共节点标头布局
+ * 父指针字段保留在布局中以兼容已有文件，但不再维护。根节点的这个字段
+ * 存放元数据页的页号，空闲页面在同一位置存放下一个空闲页面，0 表示链表结束。
+ * 读者从不读取这个字段，写者修改它不需要锁存。
  */
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);
 const uint32_t NODE_TYPE_OFFSET = 0;
@@ -119,31 +522,51 @@ const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET =
     LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET =
+    LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_KEY_BASE_SIZE = sizeof(uint64_t);
+const uint32_t LEAF_NODE_KEY_BASE_OFFSET =
+    LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_WIDE_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_WIDE_KEYS_OFFSET = LEAF_NODE_KEY_BASE_OFFSET + LEAF_NODE_KEY_BASE_SIZE;
 const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                        LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+                                       LEAF_NODE_NEXT_LEAF_SIZE +
+                                       LEAF_NODE_CONTENT_START_SIZE +
+                                       LEAF_NODE_KEY_BASE_SIZE +
+                                       LEAF_NODE_WIDE_KEYS_SIZE;
 
 /**
  * Leaf Node Body Layout
- * 叶节点主体布局
+ * 叶节点主体布局（分槽页面）
+ * 标头之后是按键排序的槽位目录，每个槽位记录键和负载的位置、长度；
+ * 负载从页尾向前紧密排列，content_start 指向最前面的负载。
+ * 负载为 [用户名长度][用户名][邮箱长度][邮箱]，id 就是键，不再重复存储。
+ * 键是 64 位的，槽位中只存它与标头中基准键的 32 位差值，见 key_deltas_rebase。
+ * 节点的键范围超过 32 位时标头中的 wide_keys 为 1，槽位改存完整的 64 位键，
+ * 键之后的字段随之后移。稀疏的键因此不会让节点只放得下几个键。
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET =
+const uint32_t LEAF_NODE_PAYLOAD_OFFSET_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_PAYLOAD_OFFSET_OFFSET =
     LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS =
-    LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-/**
- * Splitting a Leaf Node
- * 拆分叶节点
- */
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_PAYLOAD_SIZE_OFFSET =
+    LEAF_NODE_PAYLOAD_OFFSET_OFFSET + LEAF_NODE_PAYLOAD_OFFSET_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE =
+    LEAF_NODE_KEY_SIZE + LEAF_NODE_PAYLOAD_OFFSET_SIZE + LEAF_NODE_PAYLOAD_SIZE_SIZE;
+const uint32_t LEAF_NODE_WIDE_KEY_SIZE = sizeof(uint64_t);
+const uint32_t LEAF_NODE_WIDE_SLOT_SIZE =
+    LEAF_NODE_WIDE_KEY_SIZE + LEAF_NODE_PAYLOAD_OFFSET_SIZE + LEAF_NODE_PAYLOAD_SIZE_SIZE;
+const uint32_t LEAF_NODE_MIN_PAYLOAD_SIZE = 2;
+const uint32_t LEAF_NODE_MAX_PAYLOAD_SIZE = 2 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE;
+const uint32_t LEAF_NODE_MAX_CELL_SIZE = LEAF_NODE_SLOT_SIZE + LEAF_NODE_MAX_PAYLOAD_SIZE;
+// 以下随页面大小变化，见 set_page_size
+uint32_t LEAF_NODE_SPACE_FOR_CELLS;
+// 全部是空字符串时的单元格数上限
+uint32_t LEAF_NODE_MAX_CELLS;
 
 /**
  * Internal Node Header Layout
@@ -154,25 +577,138 @@ const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET =
     INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const uint32_t INTERNAL_NODE_KEY_BASE_SIZE = sizeof(uint64_t);
+const uint32_t INTERNAL_NODE_KEY_BASE_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const uint32_t INTERNAL_NODE_WIDE_KEYS_SIZE = sizeof(uint32_t);
+const uint32_t INTERNAL_NODE_WIDE_KEYS_OFFSET =
+    INTERNAL_NODE_KEY_BASE_OFFSET + INTERNAL_NODE_KEY_BASE_SIZE;
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                            INTERNAL_NODE_NUM_KEYS_SIZE +
-                                           INTERNAL_NODE_RIGHT_CHILD_SIZE;
+                                           INTERNAL_NODE_RIGHT_CHILD_SIZE +
+                                           INTERNAL_NODE_KEY_BASE_SIZE +
+                                           INTERNAL_NODE_WIDE_KEYS_SIZE;
 
 /**
  * Internal Node Body Layout
  * 内部节点主体布局
+ * 单元格为 [子节点][键与基准键的差值]，和叶节点一样用 32 位差值表示 64 位的键，
+ * wide_keys 为 1 时存完整的键，一页放得下的单元格少三分之一。
  */
 const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CELL_SIZE =
     INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-/* Keep this small for testing */
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+const uint32_t INTERNAL_NODE_WIDE_KEY_SIZE = sizeof(uint64_t);
+const uint32_t INTERNAL_NODE_WIDE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_WIDE_KEY_SIZE;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+uint32_t INTERNAL_NODE_WIDE_MAX_CELLS;
+
+/**
+ * 删除后低于这些下限的节点与兄弟节点合并，合并后放不下就重新平分。
+ * 下限取容量的三分之一，平分后的两个节点都远高于它，反复删除不会来回搬动。
+ */
+uint32_t LEAF_NODE_MIN_USED;
+uint32_t INTERNAL_NODE_MIN_KEYS;
+
+/**
+ * File Header Layout
+ * 文件头布局
+ * 页面 0 是文件头：魔数、页面大小、表的根节点页号和标志。魔数末尾是文件格式的版本。
+ * 打开已有的文件时先校验文件头，再按其中的页面大小读取其余页面。
+ */
+#define FILE_HEADER_MAGIC "sqlite-scratch 3"
+const uint32_t FILE_HEADER_MAGIC_SIZE = 16;
+const uint32_t FILE_HEADER_MAGIC_OFFSET = 0;
+const uint32_t FILE_HEADER_PAGE_SIZE_OFFSET = FILE_HEADER_MAGIC_OFFSET + FILE_HEADER_MAGIC_SIZE;
+const uint32_t FILE_HEADER_ROOT_PAGE_OFFSET = FILE_HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_HEADER_FLAGS_OFFSET = FILE_HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t);
+const uint32_t FILE_HEADER_SIZE = FILE_HEADER_FLAGS_OFFSET + sizeof(uint32_t);
+// 页面写回时压缩，见 page_compress。没有这个标志的旧文件中这一项是 0
+#define FILE_HEADER_COMPRESSED 1
+
+/**
+ * Meta Page Layout
+ * 元数据页布局
+ * 第一次需要时才分配：记录空闲页面链表的表头和各列二级索引的根节点，0 表示没有。
+ * 和根节点的父指针字段一样，读者从不读取它，写者修改它不需要锁存。
+ */
+const uint32_t META_FREE_HEAD_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t META_INDEX_ROOTS_OFFSET = META_FREE_HEAD_OFFSET + sizeof(uint32_t);
+
+/**
+ * Index Node Layout
+ * 二级索引节点布局
+ * 索引是键为变长字节串的 B+ 树，键为 (列值, id)：先按字节比较列值，
+ * 较短的前缀在前，列值相同时按 id 排序，所以重复的列值也是不同的键。
+ * 标头之后是槽位目录，每个槽位记录单元格的偏移和长度，单元格从页尾向前排列。
+ * 叶节点的单元格为 [id][列值]；内部节点的单元格为 [子节点][id][分隔键]，
+ * 子节点中的键都小于分隔键，link 是右子节点。分隔键只保留区分左右两边所需的
+ * 最短前缀，内部节点因此能放下更多子节点。叶节点之间没有链表，读完一个叶节点
+ * 按路径上的上界重新下降，删空的叶节点因此可以直接从父节点中摘下。
+ */
+const uint32_t INDEX_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INDEX_NODE_LINK_OFFSET = INDEX_NODE_NUM_CELLS_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_CONTENT_START_OFFSET = INDEX_NODE_LINK_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_HEADER_SIZE = INDEX_NODE_CONTENT_START_OFFSET + sizeof(uint16_t);
+const uint32_t INDEX_NODE_SLOT_SIZE = 2 * sizeof(uint16_t);
+const uint32_t INDEX_LEAF_CELL_HEADER_SIZE = sizeof(uint64_t);
+const uint32_t INDEX_INTERNAL_CELL_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+const uint32_t INDEX_NODE_MAX_CELL_SIZE =
+    INDEX_NODE_SLOT_SIZE + INDEX_INTERNAL_CELL_HEADER_SIZE + COLUMN_EMAIL_SIZE;
+uint32_t INDEX_NODE_SPACE_FOR_CELLS;
+// 列值全部为空时的单元格数上限
+uint32_t INDEX_NODE_MAX_CELLS;
 
 /*******************************************************************
  * 后端 B 树
  *******************************************************************/
 
+bool page_size_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+void set_page_size(uint32_t page_size) {
+    PAGE_SIZE = page_size;
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+    LEAF_NODE_MAX_CELLS =
+        LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + LEAF_NODE_MIN_PAYLOAD_SIZE);
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+    INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+    INTERNAL_NODE_WIDE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_WIDE_CELL_SIZE;
+    LEAF_NODE_MIN_USED = LEAF_NODE_SPACE_FOR_CELLS / 3;
+    INTERNAL_NODE_MIN_KEYS = INTERNAL_NODE_MAX_CELLS / 3;
+    INDEX_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INDEX_NODE_HEADER_SIZE;
+    INDEX_NODE_MAX_CELLS =
+        INDEX_NODE_SPACE_FOR_CELLS / (INDEX_NODE_SLOT_SIZE + INDEX_LEAF_CELL_HEADER_SIZE);
+}
+
+/**
+ * 64 KB 页面中空节点的 content_start 是 65536，写入 16 位字段时截断为 0，读取时还原。
+ */
+uint32_t decode_content_start(uint16_t value) {
+    return value == 0 ? PAGE_SIZE : value;
+}
+
+char* file_header_magic(void* header) {
+    return header + FILE_HEADER_MAGIC_OFFSET;
+}
+
+uint32_t* file_header_page_size(void* header) {
+    return header + FILE_HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t* file_header_root_page(void* header) {
+    return header + FILE_HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t* file_header_flags(void* header) {
+    return header + FILE_HEADER_FLAGS_OFFSET;
+}
+
 NodeType get_node_type(void* node) {
     uint8_t value = *((uint8_t*)(node + NODE_TYPE_OFFSET));
     return (NodeType)value;
@@ -193,7 +729,19 @@ void set_node_root(void* node, bool is_root) {
     *((uint8_t*)(node + IS_ROOT_OFFSET)) = value;
 }
 
-uint32_t* node_parent(void* node) {
+uint32_t* root_node_meta_page(void* root) {
+    return root + PARENT_POINTER_OFFSET;
+}
+
+uint32_t* meta_free_head(void* meta) {
+    return meta + META_FREE_HEAD_OFFSET;
+}
+
+uint32_t* meta_index_root(void* meta, IndexColumn column) {
+    return meta + META_INDEX_ROOTS_OFFSET + column * sizeof(uint32_t);
+}
+
+uint32_t* free_page_next(void* node) {
     return node + PARENT_POINTER_OFFSET;
 }
 
@@ -205,16 +753,75 @@ uint32_t* leaf_node_next_leaf(void* node) {
     return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+uint16_t* leaf_node_content_start(void* node) {
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint64_t* leaf_node_key_base(void* node) {
+    return node + LEAF_NODE_KEY_BASE_OFFSET;
+}
+
+uint32_t* leaf_node_wide_keys(void* node) {
+    return node + LEAF_NODE_WIDE_KEYS_OFFSET;
+}
+
+uint32_t leaf_node_slot_size(void* node) {
+    return *leaf_node_wide_keys(node) ? LEAF_NODE_WIDE_SLOT_SIZE : LEAF_NODE_SLOT_SIZE;
+}
+
+void* leaf_node_slot(void* node, uint32_t cell_num) {
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * leaf_node_slot_size(node);
+}
+
+// 第一个槽位中的键，之后的键按槽位大小的步长排列
+void* leaf_node_keys(void* node) {
+    return node + LEAF_NODE_HEADER_SIZE + LEAF_NODE_KEY_OFFSET;
+}
+
+uint64_t leaf_node_key(void* node, uint32_t cell_num) {
+    void* slot = leaf_node_slot(node, cell_num);
+    if (*leaf_node_wide_keys(node)) {
+        uint64_t key;
+        memcpy(&key, slot + LEAF_NODE_KEY_OFFSET, sizeof(uint64_t));
+        return key;
+    }
+    return *leaf_node_key_base(node) + *(uint32_t*)(slot + LEAF_NODE_KEY_OFFSET);
+}
+
+/**
+ * 调用者保证 key 放得进节点的键宽度，见 leaf_node_fit_key。
+ */
+void leaf_node_set_key(void* node, uint32_t cell_num, uint64_t key) {
+    void* slot = leaf_node_slot(node, cell_num);
+    if (*leaf_node_wide_keys(node)) {
+        memcpy(slot + LEAF_NODE_KEY_OFFSET, &key, sizeof(uint64_t));
+    } else {
+        *(uint32_t*)(slot + LEAF_NODE_KEY_OFFSET) = key - *leaf_node_key_base(node);
+    }
+}
+
+// 负载的位置和长度在槽位的最后，键变宽时随之后移
+uint16_t* leaf_node_payload_offset(void* node, uint32_t cell_num) {
+    return leaf_node_slot(node, cell_num) + leaf_node_slot_size(node) - LEAF_NODE_SLOT_SIZE +
+           LEAF_NODE_PAYLOAD_OFFSET_OFFSET;
 }
 
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num);
+uint16_t* leaf_node_payload_size(void* node, uint32_t cell_num) {
+    return leaf_node_slot(node, cell_num) + leaf_node_slot_size(node) - LEAF_NODE_SLOT_SIZE +
+           LEAF_NODE_PAYLOAD_SIZE_OFFSET;
 }
 
 void* leaf_node_value(void* node, uint32_t cell_num) {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return node + *leaf_node_payload_offset(node, cell_num);
+}
+
+uint32_t leaf_node_free_space(void* node) {
+    return decode_content_start(*leaf_node_content_start(node)) - LEAF_NODE_HEADER_SIZE -
+           *leaf_node_num_cells(node) * leaf_node_slot_size(node);
+}
+
+uint32_t leaf_node_used_space(void* node) {
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
 }
 
 uint32_t* internal_node_num_keys(void* node) {
@@ -225,8 +832,26 @@ uint32_t* internal_node_right_child(void* node) {
     return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
+uint64_t* internal_node_key_base(void* node) {
+    return node + INTERNAL_NODE_KEY_BASE_OFFSET;
+}
+
+uint32_t* internal_node_wide_keys(void* node) {
+    return node + INTERNAL_NODE_WIDE_KEYS_OFFSET;
+}
+
+uint32_t internal_node_cell_size(void* node) {
+    return *internal_node_wide_keys(node) ? INTERNAL_NODE_WIDE_CELL_SIZE
+                                          : INTERNAL_NODE_CELL_SIZE;
+}
+
+uint32_t internal_node_max_cells(void* node) {
+    return *internal_node_wide_keys(node) ? INTERNAL_NODE_WIDE_MAX_CELLS
+                                          : INTERNAL_NODE_MAX_CELLS;
+}
+
 uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * internal_node_cell_size(node);
 }
 
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
@@ -251,8 +876,31 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
     }
 }
 
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+// 第一个单元格中的键，之后的键按单元格大小的步长排列
+void* internal_node_keys(void* node) {
+    return node + INTERNAL_NODE_HEADER_SIZE + INTERNAL_NODE_CHILD_SIZE;
+}
+
+uint64_t internal_node_key(void* node, uint32_t key_num) {
+    void* cell = internal_node_cell(node, key_num);
+    if (*internal_node_wide_keys(node)) {
+        uint64_t key;
+        memcpy(&key, cell + INTERNAL_NODE_CHILD_SIZE, sizeof(uint64_t));
+        return key;
+    }
+    return *internal_node_key_base(node) + *(uint32_t*)(cell + INTERNAL_NODE_CHILD_SIZE);
+}
+
+/**
+ * 调用者保证 key 放得进节点的键宽度，见 internal_node_fit_keys。
+ */
+void internal_node_set_key(void* node, uint32_t key_num, uint64_t key) {
+    void* cell = internal_node_cell(node, key_num);
+    if (*internal_node_wide_keys(node)) {
+        memcpy(cell + INTERNAL_NODE_CHILD_SIZE, &key, sizeof(uint64_t));
+    } else {
+        *(uint32_t*)(cell + INTERNAL_NODE_CHILD_SIZE) = key - *internal_node_key_base(node);
+    }
 }
 
 void initialize_leaf_node(void* node) {
@@ -260,6 +908,9 @@ void initialize_leaf_node(void* node) {
     set_node_root(node, false);
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0;  // 0 represents no sibling
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_key_base(node) = 0;
+    *leaf_node_wide_keys(node) = 0;
 }
 
 void initialize_internal_node(void* node) {
@@ -272,419 +923,6367 @@ void initialize_internal_node(void* node) {
     end up with 0 as the node's right child, which makes the node a parent of the root
     */
     *internal_node_right_child(node) = INVALID_PAGE_NUM;
+    *internal_node_key_base(node) = 0;
+    *internal_node_wide_keys(node) = 0;
 }
 
-/*******************************************************************
- * 后端 Pager
- *******************************************************************/
-
-Pager* pager_open(const char* filename) {
-    int fd = open(filename,
-                  O_RDWR |      // Read/Write mode
-                      O_CREAT,  // Create file if it does not exist
-                  S_IWUSR |     // User write permission
-                      S_IRUSR   // User read permission
-    );
+/**
+ * 键在 [min, max] 内的节点选用的基准键，调用者保证 max - min 放得进 32 位。
+ * 两边留出差不多相同的余量，之后插入稍小或稍大的键多半不用改基准键；
+ * 键都小于 2^31 时基准键是 0，差值就是键本身。
+ */
+uint64_t node_key_base(uint64_t min, uint64_t max) {
+    uint64_t slack = (UINT32_MAX - (max - min)) / 2;
+    return min > slack ? min - slack : 0;
+}
 
-    if (fd == -1) {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
-    }
+/**
+ * 叶节点单元格的读写。页面里只有槽位和负载，
+ * 拆分、重新分配都通过 LeafCell 描述的单元格列表进行。
+ */
+typedef struct {
+    uint64_t key;
+    void* payload;
+    uint32_t size;
+} LeafCell;
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+uint32_t row_payload_size(Row* row) {
+    return 2 + strlen(row->username) + strlen(row->email);
+}
 
-    Pager* pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+// 这一行作为单元格在叶节点中占用的空间，含槽位
+uint32_t leaf_node_cell_size(Row* row) {
+    return LEAF_NODE_SLOT_SIZE + row_payload_size(row);
+}
 
-    if (file_length % PAGE_SIZE != 0) {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");
-        exit(EXIT_FAILURE);
-    }
+uint32_t encode_row(Row* source, void* destination) {
+    uint8_t* bytes = destination;
+    uint32_t username_length = strlen(source->username);
+    uint32_t email_length = strlen(source->email);
+    bytes[0] = username_length;
+    memcpy(bytes + 1, source->username, username_length);
+    bytes[1 + username_length] = email_length;
+    memcpy(bytes + 2 + username_length, source->email, email_length);
+    return 2 + username_length + email_length;
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        pager->pages[i] = NULL;
-    }
+void leaf_node_read_row(void* node, uint32_t cell_num, Row* destination) {
+    uint8_t* bytes = leaf_node_value(node, cell_num);
+    uint32_t username_length = bytes[0];
+    uint32_t email_length = bytes[1 + username_length];
+    destination->id = leaf_node_key(node, cell_num);
+    memcpy(destination->username, bytes + 1, username_length);
+    destination->username[username_length] = '\0';
+    memcpy(destination->email, bytes + 2 + username_length, email_length);
+    destination->email[email_length] = '\0';
+}
 
-    return pager;
+LeafCell leaf_node_get_cell(void* node, uint32_t cell_num) {
+    LeafCell cell;
+    cell.key = leaf_node_key(node, cell_num);
+    cell.payload = leaf_node_value(node, cell_num);
+    cell.size = *leaf_node_payload_size(node, cell_num);
+    return cell;
 }
 
-void* get_page(Pager* pager, uint32_t page_num) {
-    if (page_num > TABLE_MAX_PAGES) {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-               TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+/**
+ * 调用者保证 leaf_node_free_space 足够容纳槽位和负载，键放得进节点的键宽度。
+ */
+void leaf_node_insert_cell(void* node, uint32_t cell_num, LeafCell cell) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (cell_num < num_cells) {
+        // 为新的槽位腾出位置，负载不需要移动
+        memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+                (num_cells - cell_num) * leaf_node_slot_size(node));
     }
+    uint16_t offset = decode_content_start(*leaf_node_content_start(node)) - cell.size;
+    memcpy(node + offset, cell.payload, cell.size);
+    *leaf_node_content_start(node) = offset;
+
+    leaf_node_set_key(node, cell_num, cell.key);
+    *leaf_node_payload_offset(node, cell_num) = offset;
+    *leaf_node_payload_size(node, cell_num) = cell.size;
+    *leaf_node_num_cells(node) = num_cells + 1;
+}
 
-    if (pager->pages[page_num] == NULL) {
-        // Cache miss. Allocate memory and load from file.
-        // 缓存未命中。分配内存并从文件加载。
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-
-        // We might save a partial page at the end of the file
-        // 可能在文件的末尾保存不足一个页面的数据
-        if (pager->file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages) {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        pager->pages[page_num] = page;
-
-        if (page_num >= pager->num_pages) {
-            pager->num_pages = page_num + 1;
+/**
+ * 删除一个单元格。比它靠前的负载后移填上空洞，页面始终保持紧凑。
+ */
+void leaf_node_remove_cell(void* node, uint32_t cell_num) {
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint16_t offset = *leaf_node_payload_offset(node, cell_num);
+    uint16_t size = *leaf_node_payload_size(node, cell_num);
+    uint32_t content_start = decode_content_start(*leaf_node_content_start(node));
+
+    memmove(node + content_start + size, node + content_start, offset - content_start);
+    memmove(leaf_node_slot(node, cell_num), leaf_node_slot(node, cell_num + 1),
+            (num_cells - cell_num - 1) * leaf_node_slot_size(node));
+    num_cells--;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (*leaf_node_payload_offset(node, i) < offset) {
+            *leaf_node_payload_offset(node, i) += size;
         }
     }
+    *leaf_node_content_start(node) = content_start + size;
+    *leaf_node_num_cells(node) = num_cells;
+}
 
-    return pager->pages[page_num];
+// 有序的 cells 放进一个叶节点时的槽位大小：键范围超过 32 位时存完整的键
+uint32_t leaf_cells_slot_size(LeafCell* cells, uint32_t count) {
+    return count > 0 && cells[count - 1].key - cells[0].key > UINT32_MAX
+               ? LEAF_NODE_WIDE_SLOT_SIZE
+               : LEAF_NODE_SLOT_SIZE;
 }
 
-uint32_t get_node_max_key(Pager* pager, void* node) {
-    if (get_node_type(node) == NODE_LEAF) {
-        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+// 有序的 cells 放进一个叶节点占用的字节数，含槽位
+uint32_t leaf_cells_size(LeafCell* cells, uint32_t count) {
+    uint32_t size = count * leaf_cells_slot_size(cells, count);
+    for (uint32_t i = 0; i < count; i++) {
+        size += cells[i].size;
     }
-    void* right_child = get_page(pager, *internal_node_right_child(node));
-    return get_node_max_key(pager, right_child);
+    return size;
 }
 
-void pager_flush(Pager* pager, uint32_t page_num) {
-    if (pager->pages[page_num] == NULL) {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
+/**
+ * 用有序的 cells 重写叶节点，调用者保证 leaf_cells_size 不超过 LEAF_NODE_SPACE_FOR_CELLS。
+ */
+void leaf_node_set_cells(void* node, LeafCell* cells, uint32_t count) {
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_wide_keys(node) = leaf_cells_slot_size(cells, count) == LEAF_NODE_WIDE_SLOT_SIZE;
+    if (count > 0) {
+        *leaf_node_key_base(node) =
+            *leaf_node_wide_keys(node) ? 0 : node_key_base(cells[0].key, cells[count - 1].key);
     }
-
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-    if (offset == -1) {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+    for (uint32_t i = 0; i < count; i++) {
+        leaf_node_insert_cell(node, i, cells[i]);
     }
+}
 
-    ssize_t bytes_written =
-        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+/**
+ * 按字节数把 count 个有序单元格大致对半分开，返回左边的个数。
+ * 按全部单元格的槽位大小计算，分开后键范围变小的一边只会更小。
+ */
+uint32_t leaf_cells_split(LeafCell* cells, uint32_t count) {
+    uint32_t slot_size = leaf_cells_slot_size(cells, count);
+    uint32_t total_size = leaf_cells_size(cells, count);
+    uint32_t left_count = 0;
+    uint32_t left_size = 0;
+    while (left_count + 1 < count &&
+           left_size + slot_size + cells[left_count].size <= total_size / 2) {
+        left_size += slot_size + cells[left_count].size;
+        left_count++;
+    }
+    return left_count == 0 ? 1 : left_count;
+}
 
-    if (bytes_written == -1) {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+/**
+ * 与 leaf_cells_split 相同，但两边各自放不进一个叶节点时返回 0。
+ */
+uint32_t leaf_cells_split_to_fit(LeafCell* cells, uint32_t count) {
+    uint32_t left_count = leaf_cells_split(cells, count);
+    if (leaf_cells_size(cells, left_count) > LEAF_NODE_SPACE_FOR_CELLS ||
+        leaf_cells_size(cells + left_count, count - left_count) > LEAF_NODE_SPACE_FOR_CELLS) {
+        return 0;
     }
+    return left_count;
+}
+
+/**
+ * 把 count 个有序单元格大致对半分给左右两个叶节点，返回左边的个数。
+ * cells 中的负载不能指向 left 或 right 本身。
+ */
+uint32_t leaf_node_distribute(void* left, void* right, LeafCell* cells, uint32_t count) {
+    uint32_t left_count = leaf_cells_split(cells, count);
+    leaf_node_set_cells(left, cells, left_count);
+    leaf_node_set_cells(right, cells + left_count, count - left_count);
+    return left_count;
 }
 
 /*******************************************************************
- * 数据库文件的打开和关闭
+ * 后端 运行时统计
  *******************************************************************/
 
-Table* db_open(const char* filename) {
-    Pager* pager = pager_open(filename);
+// 每个 Pager 的 stats_id 都不同，0 表示线程还没有缓存分片
+uint64_t next_stats_id = 1;
 
-    Table* table = malloc(sizeof(Table));
+_Thread_local uint64_t stats_shard_owner;
+_Thread_local StatsShard* stats_shard_cache;
+
+void stats_init(Pager* pager) {
+    pager->stats_id = __atomic_fetch_add(&next_stats_id, 1, __ATOMIC_RELAXED);
+    pager->stats_shards = NULL;
+    pthread_mutex_init(&pager->stats_lock, NULL);
+}
+
+void stats_free(Pager* pager) {
+    while (pager->stats_shards != NULL) {
+        StatsShard* shard = pager->stats_shards;
+        pager->stats_shards = shard->next;
+        free(shard);
+    }
+    pthread_mutex_destroy(&pager->stats_lock);
+}
+
+/**
+ * 返回当前线程在 pager 上的分片。线程连续使用同一个 Pager 时直接取缓存，
+ * 只有第一次或换了 Pager 时才加锁查找。
+ */
+StatsShard* stats_shard(Pager* pager) {
+    if (stats_shard_owner == pager->stats_id) {
+        return stats_shard_cache;
+    }
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&pager->stats_lock);
+    StatsShard* shard = pager->stats_shards;
+    while (shard != NULL && !pthread_equal(shard->owner, self)) {
+        shard = shard->next;
+    }
+    if (shard == NULL) {
+        shard = aligned_alloc(64, sizeof(StatsShard));
+        memset(shard, 0, sizeof(StatsShard));
+        shard->owner = self;
+        shard->next = pager->stats_shards;
+        pager->stats_shards = shard;
+    }
+    pthread_mutex_unlock(&pager->stats_lock);
+    stats_shard_owner = pager->stats_id;
+    stats_shard_cache = shard;
+    return shard;
+}
+
+/**
+ * 分片只有所属线程写，读者可能同时读取，所以用原子的读和写而不是原子加法。
+ */
+void stats_bump(uint64_t* counter, uint64_t amount) {
+    __atomic_store_n(counter, *counter + amount, __ATOMIC_RELAXED);
+}
+
+void stats_add(Pager* pager, StatCounter counter, uint64_t amount) {
+    stats_bump(&stats_shard(pager)->counters[counter], amount);
+}
+
+uint64_t stats_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * 记录一次阶段耗时。直方图按微秒取对数分桶：
+ * 桶 0 不到 1 微秒，桶 i 是 [2^(i-1), 2^i) 微秒，最后一个桶包括所有更长的。
+ */
+void stats_record_phase(Pager* pager, DbPhase phase, uint64_t nanos) {
+    StatsShard* shard = stats_shard(pager);
+    uint64_t micros = nanos / 1000;
+    uint32_t bucket = micros == 0 ? 0 : 64 - __builtin_clzll(micros);
+    if (bucket >= DB_STATS_HISTOGRAM_BUCKETS) {
+        bucket = DB_STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    stats_bump(&shard->phase_count[phase], 1);
+    stats_bump(&shard->phase_nanos[phase], nanos);
+    stats_bump(&shard->phase_histogram[phase][bucket], 1);
+}
+
+/*******************************************************************
+ * 后端 WAL
+ *******************************************************************/
+
+uint32_t wal_checksum(const WalRecordHeader* header, const void* data) {
+    // FNV-1a，覆盖记录头（校验和字段视为 0）和页面数据
+    WalRecordHeader copy = *header;
+    copy.checksum = 0;
+    uint32_t hash = 2166136261u;
+    const uint8_t* bytes = (const uint8_t*)&copy;
+    for (uint32_t i = 0; i < sizeof(copy); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    if (data != NULL) {
+        bytes = data;
+        for (uint32_t i = 0; i < header->page_size; i++) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+char* wal_path_for(const char* filename) {
+    char* path = malloc(strlen(filename) + sizeof("-wal"));
+    strcpy(path, filename);
+    strcat(path, "-wal");
+    return path;
+}
+
+/**
+ * 读取位于 offset 的一条记录，校验失败或记录不完整时返回 false。
+ * 日志末尾未写完的事务就是这样被丢弃的。
+ */
+bool wal_read_record(int fd, off_t offset, WalRecordHeader* header, void* data) {
+    if (pread(fd, header, sizeof(*header), offset) != sizeof(*header)) {
+        return false;
+    }
+    if (!page_size_valid(header->page_size)) {
+        return false;
+    }
+    if (header->type == WAL_RECORD_PAGE) {
+        if (pread(fd, data, header->page_size, offset + sizeof(*header)) !=
+            header->page_size) {
+            return false;
+        }
+        return header->checksum == wal_checksum(header, data);
+    }
+    if (header->type == WAL_RECORD_COMMIT) {
+        return header->checksum == wal_checksum(header, NULL);
+    }
+    return false;
+}
+
+/**
+ * 崩溃恢复：把最后一条有效提交记录之前的所有页面映像重做到数据库文件。
+ * 必须在 pager_open 读取文件长度之前调用。
+ */
+void wal_recover(int db_fd, const char* wal_path) {
+    int fd = open(wal_path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+
+    WalRecordHeader header;
+    void* data = malloc(MAX_PAGE_SIZE);
+
+    // 第一遍：找到最后一个完整的提交
+    off_t offset = 0;
+    off_t committed_end = 0;
+    uint32_t committed_num_pages = 0;
+    uint32_t committed_page_size = 0;
+    while (wal_read_record(fd, offset, &header, data)) {
+        offset += sizeof(header);
+        if (header.type == WAL_RECORD_PAGE) {
+            offset += header.page_size;
+        } else {
+            committed_end = offset;
+            committed_num_pages = header.page_num;
+            committed_page_size = header.page_size;
+        }
+    }
+
+    // 第二遍：按顺序重做，同一页面较晚的映像覆盖较早的
+    offset = 0;
+    while (offset < committed_end) {
+        wal_read_record(fd, offset, &header, data);
+        offset += sizeof(header);
+        if (header.type == WAL_RECORD_PAGE) {
+            off_t page_offset = (off_t)header.page_num * header.page_size;
+            if (pwrite(db_fd, data, header.page_size, page_offset) != header.page_size) {
+                printf("Error replaying write-ahead log: %d\n", errno);
+                exit(EXIT_FAILURE);
+            }
+            offset += header.page_size;
+        }
+    }
+
+    if (committed_end > 0) {
+        if (ftruncate(db_fd, (off_t)committed_num_pages * committed_page_size) == -1 ||
+            fsync(db_fd) == -1) {
+            printf("Error replaying write-ahead log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(data);
+    close(fd);
+    unlink(wal_path);
+}
+
+Wal* wal_open(const char* wal_path) {
+    int fd = open(wal_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1) {
+        printf("Unable to open write-ahead log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Wal* wal = malloc(sizeof(Wal));
+    wal->file_descriptor = fd;
+    wal->path = strdup(wal_path);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    wal->append_offset = 0;
+    wal->durable_offset = 0;
+    wal->sync_in_progress = false;
+    wal->pages_since_checkpoint = 0;
+    wal->generation = 0;
+    wal->buffer_capacity = 16 * (sizeof(WalRecordHeader) + PAGE_SIZE);
+    wal->buffer = malloc(wal->buffer_capacity);
+    return wal;
+}
+
+/**
+ * 把一个事务的全部记录一次性追加到日志，返回提交记录末尾的偏移量。
+ * 调用者随后用 wal_wait_durable 等待它落盘。
+ */
+off_t wal_append(Wal* wal, const void* records, size_t length) {
+    pthread_mutex_lock(&wal->mutex);
+    ssize_t bytes_written =
+        pwrite(wal->file_descriptor, records, length, wal->append_offset);
+    if (bytes_written != (ssize_t)length) {
+        printf("Error writing write-ahead log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal->append_offset += length;
+    off_t commit_offset = wal->append_offset;
+    pthread_mutex_unlock(&wal->mutex);
+    return commit_offset;
+}
+
+/**
+ * 返回本线程做了几次 fsync，等别人完成的不算。
+ */
+uint32_t wal_wait_durable(Wal* wal, off_t commit_offset) {
+    uint32_t syncs = 0;
+    pthread_mutex_lock(&wal->mutex);
+    while (wal->durable_offset < commit_offset) {
+        if (wal->sync_in_progress) {
+            // 已有提交者在 fsync，等它完成后再看是否已覆盖本次提交
+            pthread_cond_wait(&wal->synced, &wal->mutex);
+            continue;
+        }
+        wal->sync_in_progress = true;
+        off_t sync_offset = wal->append_offset;
+        pthread_mutex_unlock(&wal->mutex);
+
+        if (fdatasync(wal->file_descriptor) == -1) {
+            printf("Error syncing write-ahead log: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        syncs++;
+
+        pthread_mutex_lock(&wal->mutex);
+        wal->durable_offset = sync_offset;
+        wal->sync_in_progress = false;
+        pthread_cond_broadcast(&wal->synced);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return syncs;
+}
+
+void wal_truncate(Wal* wal) {
+    if (ftruncate(wal->file_descriptor, 0) == -1) {
+        printf("Error truncating write-ahead log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    wal->append_offset = 0;
+    wal->durable_offset = 0;
+    wal->pages_since_checkpoint = 0;
+    wal->generation++;
+}
+
+/**
+ * 检查点之后调用：数据库文件已包含日志中的全部内容。
+ */
+void wal_reset(Wal* wal) {
+    pthread_mutex_lock(&wal->mutex);
+    wal_truncate(wal);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void wal_position(Wal* wal, uint64_t* generation, off_t* offset) {
+    pthread_mutex_lock(&wal->mutex);
+    *generation = wal->generation;
+    *offset = wal->append_offset;
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+/**
+ * 日志仍停在 wal_position 读到的位置时清空它，返回是否清空。
+ * 后台检查点 fsync 数据库文件时不挡住提交，期间有新的提交就留到下一次。
+ */
+bool wal_reset_at(Wal* wal, uint64_t generation, off_t offset) {
+    pthread_mutex_lock(&wal->mutex);
+    bool unchanged = wal->generation == generation && wal->append_offset == offset;
+    if (unchanged) {
+        wal_truncate(wal);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+    return unchanged;
+}
+
+void wal_close(Wal* wal) {
+    close(wal->file_descriptor);
+    unlink(wal->path);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->path);
+    free(wal->buffer);
+    free(wal);
+}
+
+/*******************************************************************
+ * 后端 io_uring
+ *******************************************************************/
+
+int sys_io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int sys_io_uring_enter(int ring_fd, uint32_t to_submit, uint32_t min_complete,
+                       uint32_t flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * 创建提交队列和完成队列并映射到用户空间，失败时返回 NULL。
+ */
+IoUring* io_uring_open(uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = sys_io_uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        return NULL;
+    }
+
+    IoUring* ring = malloc(sizeof(IoUring));
+    ring->ring_fd = ring_fd;
+    ring->entries = params.sq_entries;
+    ring->queued = 0;
+    ring->in_flight = 0;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        printf("Error mapping io_uring: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (single_mmap) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            printf("Error mapping io_uring: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        printf("Error mapping io_uring: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    ring->sq_head = ring->sq_ring + params.sq_off.head;
+    ring->sq_tail = ring->sq_ring + params.sq_off.tail;
+    ring->sq_mask = ring->sq_ring + params.sq_off.ring_mask;
+    ring->sq_array = ring->sq_ring + params.sq_off.array;
+    ring->cq_head = ring->cq_ring + params.cq_off.head;
+    ring->cq_tail = ring->cq_ring + params.cq_off.tail;
+    ring->cq_mask = ring->cq_ring + params.cq_off.ring_mask;
+    ring->cqes = ring->cq_ring + params.cq_off.cqes;
+    return ring;
+}
+
+void io_uring_close(IoUring* ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+    free(ring);
+}
+
+/**
+ * 在提交队列中放入一个请求。队列加上未完成的请求已满时返回 false，
+ * 调用者先等待一些完成事件。完成队列是提交队列的两倍，不会溢出。
+ */
+bool io_uring_queue(IoUring* ring, uint8_t opcode, int fd, void* buffer, uint32_t length,
+                    off_t offset, uint64_t user_data) {
+    if (ring->queued + ring->in_flight >= ring->entries) {
+        return false;
+    }
+    uint32_t tail = *ring->sq_tail;
+    uint32_t index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    // 内核读取 tail 之前必须看到完整的 sqe
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return true;
+}
+
+/**
+ * 提交所有排队的请求，并等待至少 min_complete 个完成事件。
+ */
+void io_uring_submit(IoUring* ring, uint32_t min_complete) {
+    while (ring->queued > 0 || min_complete > 0) {
+        int submitted = sys_io_uring_enter(ring->ring_fd, ring->queued, min_complete,
+                                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("Error submitting io_uring requests: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        ring->queued -= submitted;
+        ring->in_flight += submitted;
+        if (ring->queued == 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * 取出一个完成事件，没有时返回 false。
+ */
+bool io_uring_reap(IoUring* ring, struct io_uring_cqe* cqe) {
+    uint32_t head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    ring->in_flight--;
+    return true;
+}
+
+/*******************************************************************
+ * 后端 页面压缩
+ *******************************************************************/
+
+/**
+ * 压缩的数据库在写回时压缩页面，读入缓冲池时解压，内存中的节点布局不变。
+ * 压缩后的页面仍然放在原来的位置上：开头是标记和压缩后的长度，后面是压缩数据，
+ * 槽位中用不到的整块用 FALLOCATE_FL_PUNCH_HOLE 打洞还给文件系统。
+ * 页面位置不变，不需要页面映射表；WAL 和恢复照常处理未压缩的页面，
+ * 读取时按开头的标记区分。压缩后省不下一个文件系统块的页面原样写入，
+ * 所以页面大小至少要是两个块才有效果。
+ *
+ * 压缩格式仿照 LZ4 的块格式：每个序列以一个标记字节开始，高 4 位是字面量长度，
+ * 低 4 位是匹配长度减 4，到 15 时后面的字节继续累加，255 表示还有下一个字节；
+ * 然后是字面量和 2 字节小端的匹配偏移。最后一个序列只有字面量。
+ */
+#define PAGE_COMPRESSED_MARKER 0xC5  // 不是任何 NodeType，也不是文件头魔数的开头
+#define PAGE_COMPRESSED_HEADER_SIZE 8
+#define PAGE_HOLE_SIZE 4096
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_HASH_BITS 12
+
+uint32_t compress_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return value;
+}
+
+/**
+ * 写一个序列的长度中放不进标记的部分。空间不够时返回 NULL。
+ */
+uint8_t* compress_write_length(uint8_t* p, uint8_t* end, uint32_t length) {
+    for (; length >= 255; length -= 255) {
+        if (p == end) {
+            return NULL;
+        }
+        *p++ = 255;
+    }
+    if (p == end) {
+        return NULL;
+    }
+    *p++ = length;
+    return p;
+}
+
+/**
+ * 写一个序列：literal_length 个字面量，之后是匹配，match_length 为 0 表示最后一个序列。
+ */
+uint8_t* compress_write_sequence(uint8_t* p, uint8_t* end, const uint8_t* literals,
+                                 uint32_t literal_length, uint32_t offset,
+                                 uint32_t match_length) {
+    if (p == end) {
+        return NULL;
+    }
+    uint32_t match_code = match_length > 0 ? match_length - COMPRESS_MIN_MATCH : 0;
+    uint8_t* token = p++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4 |
+             (match_code < 15 ? match_code : 15);
+    if (literal_length >= 15 && (p = compress_write_length(p, end, literal_length - 15)) == NULL) {
+        return NULL;
+    }
+    if ((uint32_t)(end - p) < literal_length) {
+        return NULL;
+    }
+    memcpy(p, literals, literal_length);
+    p += literal_length;
+    if (match_length == 0) {
+        return p;
+    }
+    if (end - p < 2) {
+        return NULL;
+    }
+    *p++ = offset;
+    *p++ = offset >> 8;
+    if (match_code >= 15 && (p = compress_write_length(p, end, match_code - 15)) == NULL) {
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * 把 length 字节压缩到 destination，返回压缩后的长度，超过 capacity 时返回 0。
+ * 用 4 字节的哈希表找前面最近一次出现的相同 4 字节，贪心地向后延伸匹配。
+ */
+uint32_t page_compress(const uint8_t* source, uint32_t length, uint8_t* destination,
+                       uint32_t capacity) {
+    uint32_t table[1 << COMPRESS_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    uint8_t* p = destination;
+    uint8_t* end = destination + capacity;
+    uint32_t anchor = 0;
+    uint32_t i = 0;
+    while (i + COMPRESS_MIN_MATCH <= length) {
+        uint32_t sequence = compress_read32(source + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = i;
+        if (candidate == UINT32_MAX || i - candidate > UINT16_MAX ||
+            compress_read32(source + candidate) != sequence) {
+            i++;
+            continue;
+        }
+        uint32_t match_length = COMPRESS_MIN_MATCH;
+        while (i + match_length < length &&
+               source[candidate + match_length] == source[i + match_length]) {
+            match_length++;
+        }
+        p = compress_write_sequence(p, end, source + anchor, i - anchor, i - candidate,
+                                    match_length);
+        if (p == NULL) {
+            return 0;
+        }
+        i += match_length;
+        anchor = i;
+    }
+    p = compress_write_sequence(p, end, source + anchor, length - anchor, 0, 0);
+    return p != NULL ? p - destination : 0;
+}
+
+bool decompress_read_length(const uint8_t** p, const uint8_t* end, uint32_t* length) {
+    uint8_t byte;
+    do {
+        if (*p == end) {
+            return false;
+        }
+        byte = *(*p)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/**
+ * 解压 page_compress 的输出，结果正好是 length 字节时返回 true，否则数据已损坏。
+ */
+bool page_decompress(const uint8_t* source, uint32_t source_length, uint8_t* destination,
+                     uint32_t length) {
+    const uint8_t* p = source;
+    const uint8_t* end = source + source_length;
+    uint32_t written = 0;
+    while (p < end) {
+        uint8_t token = *p++;
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !decompress_read_length(&p, end, &literal_length)) {
+            return false;
+        }
+        if (literal_length > (uint32_t)(end - p) || literal_length > length - written) {
+            return false;
+        }
+        memcpy(destination + written, p, literal_length);
+        p += literal_length;
+        written += literal_length;
+        if (p == end) {
+            break;
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        uint32_t offset = p[0] | p[1] << 8;
+        p += 2;
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !decompress_read_length(&p, end, &match_length)) {
+            return false;
+        }
+        match_length += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > written || match_length > length - written) {
+            return false;
+        }
+        // 匹配可以与自己重叠，逐字节复制
+        for (uint32_t j = 0; j < match_length; j++) {
+            destination[written + j] = destination[written - offset + j];
+        }
+        written += match_length;
+    }
+    return written == length;
+}
+
+/**
+ * 压缩和解压用的临时缓冲区，每个线程一个，第一次用到时分配。
+ */
+_Thread_local uint8_t* compress_buffer;
+
+uint8_t* compress_scratch() {
+    if (compress_buffer == NULL) {
+        compress_buffer = malloc(MAX_PAGE_SIZE);
+    }
+    return compress_buffer;
+}
+
+/**
+ * 写回一个页面，压缩的数据库中先尝试压缩。返回写入的字节数。
+ * 文件头必须能在知道是否压缩之前读出来，页面 0 总是原样写入。
+ */
+ssize_t pager_write_page(Pager* pager, const void* data, uint32_t page_num) {
+    int fd = pager->file_descriptor;
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    if (!pager->compress || page_num == 0) {
+        return pwrite(fd, data, PAGE_SIZE, offset);
+    }
+
+    // 压缩后至少要省下一个块，4096 字节的页面省不下，总是原样写入
+    int64_t capacity = (int64_t)PAGE_SIZE - PAGE_HOLE_SIZE - PAGE_COMPRESSED_HEADER_SIZE;
+    if (capacity <= 0) {
+        return pwrite(fd, data, PAGE_SIZE, offset);
+    }
+    uint8_t* compressed = compress_scratch();
+    uint32_t length = page_compress(data, PAGE_SIZE, compressed + PAGE_COMPRESSED_HEADER_SIZE,
+                                    capacity);
+    if (length == 0 || length + PAGE_COMPRESSED_HEADER_SIZE > PAGE_SIZE - PAGE_HOLE_SIZE) {
+        return pwrite(fd, data, PAGE_SIZE, offset);
+    }
+    memset(compressed, 0, PAGE_COMPRESSED_HEADER_SIZE);
+    compressed[0] = PAGE_COMPRESSED_MARKER;
+    memcpy(compressed + sizeof(uint32_t), &length, sizeof(uint32_t));
+    length += PAGE_COMPRESSED_HEADER_SIZE;
+    ssize_t bytes_written = pwrite(fd, compressed, length, offset);
+    if (bytes_written != length) {
+        return -1;
+    }
+
+    // 文件长度仍然是整页，末尾的页面只写了一部分时把文件扩展到页面末尾
+    off_t page_end = offset + PAGE_SIZE;
+    if (page_end > pager->file_length && ftruncate(fd, page_end) == -1) {
+        return -1;
+    }
+    // 文件系统不支持打洞时只是省不下空间
+    off_t hole = offset + (length + PAGE_HOLE_SIZE - 1) / PAGE_HOLE_SIZE * PAGE_HOLE_SIZE;
+    syscall(SYS_fallocate, fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole,
+            page_end - hole);
+    return bytes_written;
+}
+
+/**
+ * 读入缓冲池的页面是压缩过的就原地解压。
+ */
+void pager_decompress_page(Pager* pager, uint32_t page_num, uint8_t* data) {
+    if (!pager->compress || page_num == 0 || data[0] != PAGE_COMPRESSED_MARKER) {
+        return;
+    }
+    uint32_t length;
+    memcpy(&length, data + sizeof(uint32_t), sizeof(uint32_t));
+    uint8_t* compressed = compress_scratch();
+    if (length > PAGE_SIZE - PAGE_COMPRESSED_HEADER_SIZE) {
+        printf("Invalid compressed page %d. Corrupt file.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(compressed, data + PAGE_COMPRESSED_HEADER_SIZE, length);
+    if (!page_decompress(compressed, length, data, PAGE_SIZE)) {
+        printf("Invalid compressed page %d. Corrupt file.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*******************************************************************
+ * 后端 Pager
+ *******************************************************************/
+
+void pager_mmap_grow(Pager* pager, uint32_t page_num);
+
+void* pager_alloc_page_buffer() {
+    void* data;
+    if (posix_memalign(&data, PAGE_SIZE, PAGE_SIZE) != 0) {
+        printf("Error allocating page buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/**
+ * 分配 num_frames 个帧的整块内存。大块分配由内核按需提供物理页，
+ * 未用到的帧不占内存。
+ */
+void pager_alloc_slab(Pager* pager, uint32_t num_frames) {
+    pager->slab_frames = num_frames;
+    pager->frame_slab = NULL;
+    pager->data_slab = NULL;
+    if (num_frames == 0) {
+        return;
+    }
+    pager->frame_slab = malloc(sizeof(Frame) * num_frames);
+    if (posix_memalign(&pager->data_slab, PAGE_SIZE, (size_t)PAGE_SIZE * num_frames) != 0) {
+        printf("Error allocating buffer pool\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void pager_resize_frames(Pager* pager, uint32_t num_frames) {
+    pager->frames = realloc(pager->frames, sizeof(Frame*) * num_frames);
+    for (uint32_t i = pager->num_frames; i < num_frames; i++) {
+        Frame* frame;
+        if (i < pager->slab_frames) {
+            frame = &pager->frame_slab[i];
+            frame->data = (uint8_t*)pager->data_slab + (size_t)i * PAGE_SIZE;
+        } else {
+            frame = malloc(sizeof(Frame));
+            frame->data = pager_alloc_page_buffer();
+        }
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->dirty = false;
+        frame->referenced = false;
+        frame->pin_count = 0;
+        frame->io_pending = false;
+        pthread_rwlock_init(&frame->latch, NULL);
+        pager->frames[i] = frame;
+    }
+    pager->num_frames = num_frames;
+}
+
+// 已打开的数据库数，为 0 时下一个打开的数据库可以使用不同的页面大小
+pthread_mutex_t page_size_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t open_databases = 0;
+
+/**
+ * 新文件使用 options 中的页面大小和压缩选项，已有的文件使用文件头中记录的。
+ */
+uint32_t pager_file_page_size(int fd, off_t file_length, DbOptions options, bool* compress) {
+    if (file_length == 0) {
+        uint32_t page_size = options.page_size != 0 ? options.page_size : DEFAULT_PAGE_SIZE;
+        if (!page_size_valid(page_size)) {
+            printf("Page size must be a power of two from %d to %d.\n", MIN_PAGE_SIZE,
+                   MAX_PAGE_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        *compress = options.compress;
+        return page_size;
+    }
+
+    uint8_t header[FILE_HEADER_SIZE];
+    if (pread(fd, header, FILE_HEADER_SIZE, 0) != FILE_HEADER_SIZE ||
+        memcmp(file_header_magic(header), FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE) != 0) {
+        printf("File is not a database. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+    uint32_t page_size = *file_header_page_size(header);
+    if (!page_size_valid(page_size)) {
+        printf("Invalid page size %d in file header. Corrupt file.\n", page_size);
+        exit(EXIT_FAILURE);
+    }
+    *compress = (*file_header_flags(header) & FILE_HEADER_COMPRESSED) != 0;
+    return page_size;
+}
+
+Pager* pager_open(const char* filename, DbOptions options) {
+    int fd = open(filename,
+                  O_RDWR |      // Read/Write mode
+                      O_CREAT,  // Create file if it does not exist
+                  S_IWUSR |     // User write permission
+                      S_IRUSR   // User read permission
+    );
+
+    if (fd == -1) {
+        printf("Unable to open file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // 上次没有正常关闭时，先用日志把数据库文件恢复到最后一次提交
+    char* wal_path = wal_path_for(filename);
+    wal_recover(fd, wal_path);
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    bool compress;
+    uint32_t page_size = pager_file_page_size(fd, file_length, options, &compress);
+    if (compress && options.pager_mode == PAGER_MODE_MMAP) {
+        printf("Compressed databases cannot be opened in mmap mode.\n");
+        exit(EXIT_FAILURE);
+    }
+    // 页面大小和由它算出的节点布局是整个进程共用的，打开着数据库时不能换
+    pthread_mutex_lock(&page_size_lock);
+    if (open_databases > 0 && page_size != PAGE_SIZE) {
+        pthread_mutex_unlock(&page_size_lock);
+        printf("Page size %d differs from the page size %d of the open databases.\n", page_size,
+               PAGE_SIZE);
+        close(fd);
+        free(wal_path);
+        return NULL;
+    }
+    set_page_size(page_size);
+    open_databases++;
+    pthread_mutex_unlock(&page_size_lock);
+
+    Pager* pager = malloc(sizeof(Pager));
+    stats_init(pager);
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+
+    if (file_length % PAGE_SIZE != 0) {
+        printf("Db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_cond_init(&pager->io_done, NULL);
+
+    pager->mode = options.pager_mode;
+    pager->map = NULL;
+    pager->mapped_pages = 0;
+    pager->dirty_map = NULL;
+    pager->map_latches = NULL;
+    pager->latch_map = NULL;
+
+    uint32_t num_frames = options.cache_frames;
+    if (pager->mode == PAGER_MODE_MMAP) {
+        // 先预留地址空间，再把文件映射进去
+        pager->map = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pager->map == MAP_FAILED) {
+            printf("Error reserving address space: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->map_latches = mmap(NULL, PAGER_MMAP_LATCHES_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pager->map_latches == MAP_FAILED) {
+            printf("Error reserving address space: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (pager->num_pages > 0) {
+            pager_mmap_grow(pager, pager->num_pages - 1);
+        }
+        num_frames = 0;
+    } else if (num_frames < PAGER_MIN_FRAMES) {
+        num_frames = PAGER_MIN_FRAMES;
+    }
+    pager->num_frames = 0;
+    pager->frame_limit = num_frames;
+    pager->frames = NULL;
+    pager_alloc_slab(pager, num_frames);
+    pager_resize_frames(pager, num_frames);
+    pager->clock_hand = 0;
+
+    pager->page_table_capacity = pager->num_pages > 64 ? pager->num_pages : 64;
+    pager->page_table = malloc(sizeof(uint32_t) * pager->page_table_capacity);
+    for (uint32_t i = 0; i < pager->page_table_capacity; i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+
+    pager->txn_capacity = 64;
+    pager->txn_num_pages = 0;
+    pager->txn_pages = malloc(sizeof(uint32_t) * pager->txn_capacity);
+    pager->txn_map_size = 0;
+    pager->txn_map = NULL;
+
+    pager->wal = options.wal ? wal_open(wal_path) : NULL;
+    free(wal_path);
+
+    pager->compress = compress;
+    pager->prefetch_pages = options.prefetch_pages;
+    if (pager->prefetch_pages > PAGER_MAX_PREFETCH) {
+        pager->prefetch_pages = PAGER_MAX_PREFETCH;
+    }
+    // 内核不支持或被禁止时退回同步 I/O；压缩的页面要在读写前后同步处理，也不使用 io_uring
+    pager->ring = options.io_uring && !compress ? io_uring_open(IO_URING_ENTRIES) : NULL;
+
+    pager->commit_seq = 0;
+    pager->committed_pages = pager->num_pages;
+    pager->versions = NULL;
+    pager->versions_capacity = 0;
+    pager->num_versions = 0;
+    pager->txn_versions = NULL;
+    pager->oldest_version = NULL;
+    pager->newest_version = NULL;
+    pager->spare_versions = NULL;
+    pager->num_spare_versions = 0;
+    pager->snapshots_capacity = 16;
+    pager->num_snapshots = 0;
+    pager->snapshots = malloc(sizeof(uint64_t) * pager->snapshots_capacity);
+
+    return pager;
+}
+
+uint32_t pager_lookup_frame(Pager* pager, uint32_t page_num) {
+    if (page_num >= pager->page_table_capacity) {
+        return INVALID_FRAME;
+    }
+    return pager->page_table[page_num];
+}
+
+void pager_grow_page_table(Pager* pager, uint32_t page_num) {
+    uint32_t old_capacity = pager->page_table_capacity;
+    uint32_t new_capacity = old_capacity;
+    while (new_capacity <= page_num) {
+        new_capacity *= 2;
+    }
+    pager->page_table = realloc(pager->page_table, sizeof(uint32_t) * new_capacity);
+    for (uint32_t i = old_capacity; i < new_capacity; i++) {
+        pager->page_table[i] = INVALID_FRAME;
+    }
+    pager->page_table_capacity = new_capacity;
+}
+
+/**
+ * 扩展 mmap 模式的映射，使其覆盖 page_num。
+ * 文件用 ftruncate 预先加长，新区间以 MAP_FIXED 接在原映射之后，
+ * 所以映射基址不会移动（mremap 可能移动映射，使已有的页面指针失效）。
+ * 映射是 MAP_PRIVATE 的：修改只在 pager_flush 时写回文件。
+ */
+void pager_mmap_grow(Pager* pager, uint32_t page_num) {
+    uint32_t new_mapped_pages = pager->mapped_pages * 2;
+    if (new_mapped_pages < PAGER_MMAP_MIN_GROWTH) {
+        new_mapped_pages = PAGER_MMAP_MIN_GROWTH;
+    }
+    if (new_mapped_pages <= page_num) {
+        new_mapped_pages = page_num + 1;
+    }
+    if ((size_t)new_mapped_pages * PAGE_SIZE > PAGER_MMAP_RESERVE) {
+        printf("Tried to map page number beyond reserved address space. %d\n",
+               page_num);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t old_length = (off_t)pager->mapped_pages * PAGE_SIZE;
+    off_t new_length = (off_t)new_mapped_pages * PAGE_SIZE;
+    if (new_length > pager->file_length) {
+        if (ftruncate(pager->file_descriptor, new_length) == -1) {
+            printf("Error extending file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->file_length = new_length;
+    }
+
+    void* addr = mmap(pager->map + old_length, new_length - old_length,
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                      pager->file_descriptor, old_length);
+    if (addr == MAP_FAILED) {
+        printf("Error mapping file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t old_bitmap_size = (pager->mapped_pages + 7) / 8;
+    uint32_t new_bitmap_size = (new_mapped_pages + 7) / 8;
+    pager->dirty_map = realloc(pager->dirty_map, new_bitmap_size);
+    memset(pager->dirty_map + old_bitmap_size, 0, new_bitmap_size - old_bitmap_size);
+    pager->latch_map = realloc(pager->latch_map, new_bitmap_size);
+    memset(pager->latch_map + old_bitmap_size, 0, new_bitmap_size - old_bitmap_size);
+
+    pager->mapped_pages = new_mapped_pages;
+}
+
+void pager_mmap_written(Pager* pager, uint32_t page_num) {
+    pager->dirty_map[page_num / 8] &= ~(1 << (page_num % 8));
+
+    // 丢弃私有副本，下次访问重新从页缓存映射（内容与刚写入的一致）
+    madvise(pager->map + (size_t)page_num * PAGE_SIZE, PAGE_SIZE, MADV_DONTNEED);
+}
+
+void pager_mmap_flush(Pager* pager, uint32_t page_num) {
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    void* page = pager->map + offset;
+
+    ssize_t bytes_written = pwrite(pager->file_descriptor, page, PAGE_SIZE, offset);
+    if (bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(pager, STAT_BYTES_WRITTEN, bytes_written);
+    pager_mmap_written(pager, page_num);
+}
+
+void pager_frame_written(Pager* pager, Frame* frame) {
+    frame->dirty = false;
+    if ((off_t)(frame->page_num + 1) * PAGE_SIZE > pager->file_length) {
+        pager->file_length = (off_t)(frame->page_num + 1) * PAGE_SIZE;
+    }
+}
+
+void pager_flush(Pager* pager, uint32_t page_num) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        pager_mmap_flush(pager, page_num);
+        return;
+    }
+
+    uint32_t frame_index = pager_lookup_frame(pager, page_num);
+    if (frame_index == INVALID_FRAME) {
+        printf("Tried to flush page %d which is not in the buffer pool\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Frame* frame = pager->frames[frame_index];
+
+    ssize_t bytes_written = pager_write_page(pager, frame->data, page_num);
+
+    if (bytes_written == -1) {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    stats_add(pager, STAT_BYTES_WRITTEN, bytes_written);
+
+    pager_frame_written(pager, frame);
+}
+
+void pager_io_complete(Pager* pager, struct io_uring_cqe* cqe) {
+    IoRequestType type = cqe->user_data >> 32;
+    uint32_t index = (uint32_t)cqe->user_data;
+    if (cqe->res < 0) {
+        printf("Error in io_uring request: %d\n", -cqe->res);
+        exit(EXIT_FAILURE);
+    }
+    switch (type) {
+        case IO_READ_FRAME: {
+            // 读到文件末尾时剩下的部分保持为 0
+            Frame* frame = pager->frames[index];
+            stats_add(pager, STAT_BYTES_READ, cqe->res);
+            frame->io_pending = false;
+            __atomic_fetch_sub(&frame->pin_count, 1, __ATOMIC_RELEASE);
+            pthread_cond_broadcast(&pager->io_done);
+            break;
+        }
+        case IO_WRITE_FRAME:
+            if (cqe->res < 0 || (uint32_t)cqe->res != PAGE_SIZE) {
+                printf("Short write: %d\n", cqe->res);
+                exit(EXIT_FAILURE);
+            }
+            stats_add(pager, STAT_BYTES_WRITTEN, cqe->res);
+            pager_frame_written(pager, pager->frames[index]);
+            break;
+        case IO_WRITE_MAP:
+            if (cqe->res < 0 || (uint32_t)cqe->res != PAGE_SIZE) {
+                printf("Short write: %d\n", cqe->res);
+                exit(EXIT_FAILURE);
+            }
+            stats_add(pager, STAT_BYTES_WRITTEN, cqe->res);
+            pager_mmap_written(pager, index);
+            break;
+    }
+}
+
+/**
+ * 提交排队的请求，等待至少 min_complete 个完成，并处理所有已完成的请求。
+ */
+void pager_io_wait(Pager* pager, uint32_t min_complete) {
+    IoUring* ring = pager->ring;
+    if (min_complete > ring->queued + ring->in_flight) {
+        min_complete = ring->queued + ring->in_flight;
+    }
+    io_uring_submit(ring, min_complete);
+    struct io_uring_cqe cqe;
+    while (io_uring_reap(ring, &cqe)) {
+        pager_io_complete(pager, &cqe);
+    }
+}
+
+void pager_io_queue(Pager* pager, uint8_t opcode, void* buffer, uint32_t page_num,
+                    IoRequestType type, uint32_t index) {
+    uint64_t user_data = ((uint64_t)type << 32) | index;
+    while (!io_uring_queue(pager->ring, opcode, pager->file_descriptor, buffer, PAGE_SIZE,
+                           (off_t)page_num * PAGE_SIZE, user_data)) {
+        pager_io_wait(pager, 1);
+    }
+}
+
+void pager_io_drain(Pager* pager) {
+    while (pager->ring != NULL && pager->ring->queued + pager->ring->in_flight > 0) {
+        pager_io_wait(pager, pager->ring->queued + pager->ring->in_flight);
+    }
+}
+
+bool pager_page_in_txn(Pager* pager, uint32_t page_num) {
+    if (page_num / 8 >= pager->txn_map_size) {
+        return false;
+    }
+    return pager->txn_map[page_num / 8] & (1 << (page_num % 8));
+}
+
+/**
+ * 把页面加入写集合，页面原来不在其中时返回 true。
+ */
+bool pager_add_txn_page(Pager* pager, uint32_t page_num) {
+    if (pager_page_in_txn(pager, page_num)) {
+        return false;
+    }
+    if (page_num / 8 >= pager->txn_map_size) {
+        uint32_t new_size = pager->txn_map_size > 0 ? pager->txn_map_size : 64;
+        while (new_size <= page_num / 8) {
+            new_size *= 2;
+        }
+        pager->txn_map = realloc(pager->txn_map, new_size);
+        memset(pager->txn_map + pager->txn_map_size, 0, new_size - pager->txn_map_size);
+        pager->txn_map_size = new_size;
+    }
+    pager->txn_map[page_num / 8] |= 1 << (page_num % 8);
+
+    if (pager->txn_num_pages >= pager->txn_capacity) {
+        pager->txn_capacity *= 2;
+        pager->txn_pages =
+            realloc(pager->txn_pages, sizeof(uint32_t) * pager->txn_capacity);
+    }
+    pager->txn_pages[pager->txn_num_pages++] = page_num;
+    return true;
+}
+
+/**
+ * CLOCK 置换：跳过被固定的帧，清除访问位，选中第一个未被访问的帧。
+ * 转两圈仍找不到说明所有帧都被固定或属于未提交的事务，
+ * 这时临时多分配一帧，提交后由 pager_trim_frames 收回。
+ */
+uint32_t pager_clock_sweep(Pager* pager, bool allow_dirty) {
+    for (uint32_t step = 0; step < 2 * pager->num_frames; step++) {
+        uint32_t frame_index = pager->clock_hand;
+        Frame* frame = pager->frames[frame_index];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->page_num == INVALID_PAGE_NUM) {
+            return frame_index;
+        }
+        if (__atomic_load_n(&frame->pin_count, __ATOMIC_ACQUIRE) > 0) {
+            continue;
+        }
+        if (pager->wal != NULL && pager_page_in_txn(pager, frame->page_num)) {
+            // 未提交的修改不能写入数据库文件
+            continue;
+        }
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+        if (frame->dirty && !allow_dirty) {
+            continue;
+        }
+        return frame_index;
+    }
+    return INVALID_FRAME;
+}
+
+uint32_t pager_find_victim(Pager* pager) {
+    uint32_t frame_index = pager_clock_sweep(pager, true);
+    if (frame_index != INVALID_FRAME) {
+        return frame_index;
+    }
+
+    frame_index = pager->num_frames;
+    pager_resize_frames(pager, pager->num_frames + 1);
+    return frame_index;
+}
+
+void pager_trim_frames(Pager* pager) {
+    while (pager->num_frames > pager->frame_limit) {
+        Frame* frame = pager->frames[pager->num_frames - 1];
+        if (__atomic_load_n(&frame->pin_count, __ATOMIC_ACQUIRE) > 0) {
+            break;
+        }
+        if (frame->page_num != INVALID_PAGE_NUM) {
+            if (frame->dirty) {
+                pager_flush(pager, frame->page_num);
+            }
+            pager->page_table[frame->page_num] = INVALID_FRAME;
+        }
+        // frame_limit 以上的帧都是单独分配的临时帧
+        free(frame->data);
+        pthread_rwlock_destroy(&frame->latch);
+        free(frame);
+        pager->num_frames--;
+    }
+    if (pager->clock_hand >= pager->num_frames) {
+        pager->clock_hand = 0;
+    }
+}
+
+/**
+ * 每个线程有自己的固定栈。get_page 返回的指针在释放固定之前一直有效。
+ * 调用者先用 pager_pin_mark 记下位置，用完后 pager_release_pins 回到该位置。
+ */
+_Thread_local PinStack pin_stack;
+
+void pager_push_pin(Frame* frame, pthread_rwlock_t* latch) {
+    if (pin_stack.size >= pin_stack.capacity) {
+        pin_stack.capacity = pin_stack.capacity > 0 ? pin_stack.capacity * 2 : 64;
+        pin_stack.pins = realloc(pin_stack.pins, sizeof(Pin) * pin_stack.capacity);
+    }
+    pin_stack.pins[pin_stack.size].frame = frame;
+    pin_stack.pins[pin_stack.size].latch = latch;
+    pin_stack.size++;
+}
+
+uint32_t pager_pin_mark(Pager* pager) {
+    return pin_stack.size;
+}
+
+/**
+ * 放开 [from, to) 之间的固定所持有的锁存，固定本身留到 pager_release_pins。
+ * 下降时用它实现锁存耦合：拿到子节点的锁存后放开上层的。
+ */
+void pager_release_latches(Pager* pager, uint32_t from, uint32_t to) {
+    for (uint32_t i = from; i < to; i++) {
+        Pin* pin = &pin_stack.pins[i];
+        if (pin->latch != NULL) {
+            pthread_rwlock_unlock(pin->latch);
+            pin->latch = NULL;
+        }
+    }
+}
+
+void pager_release_pins(Pager* pager, uint32_t mark) {
+    pager_release_latches(pager, mark, pin_stack.size);
+    while (pin_stack.size > mark) {
+        Frame* frame = pin_stack.pins[--pin_stack.size].frame;
+        if (frame != NULL) {
+            __atomic_fetch_sub(&frame->pin_count, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/**
+ * 持有 Pager.lock 时调用，返回已固定的帧。需要读文件时暂时放开锁，
+ * 读取期间帧标记为 io_pending，其他要这个页面的线程等它完成。
+ */
+Frame* pager_load_frame(Pager* pager, uint32_t page_num) {
+    uint32_t frame_index;
+    while ((frame_index = pager_lookup_frame(pager, page_num)) != INVALID_FRAME) {
+        Frame* frame = pager->frames[frame_index];
+        if (!frame->io_pending) {
+            frame->referenced = true;
+            __atomic_fetch_add(&frame->pin_count, 1, __ATOMIC_RELAXED);
+            stats_add(pager, STAT_CACHE_HITS, 1);
+            return frame;
+        }
+        // 读取已经发出，等它完成后重新查找
+        if (pager->ring != NULL && pager->ring->queued + pager->ring->in_flight > 0) {
+            pager_io_wait(pager, 1);
+        } else {
+            pthread_cond_wait(&pager->io_done, &pager->lock);
+        }
+    }
+
+    // Cache miss. Pick a victim frame and load from file.
+    // 缓存未命中。选出一个牺牲帧，写回脏页后从文件加载。
+    stats_add(pager, STAT_CACHE_MISSES, 1);
+    frame_index = pager_find_victim(pager);
+    Frame* frame = pager->frames[frame_index];
+
+    if (frame->page_num != INVALID_PAGE_NUM) {
+        stats_add(pager, STAT_EVICTIONS, 1);
+        if (frame->dirty) {
+            pager_flush(pager, frame->page_num);
+        }
+        pager->page_table[frame->page_num] = INVALID_FRAME;
+    }
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+
+    // We might save a partial page at the end of the file
+    // 可能在文件的末尾保存不足一个页面的数据
+    if (pager->file_length % PAGE_SIZE) {
+        num_pages += 1;
+    }
+
+    if (page_num >= pager->page_table_capacity) {
+        pager_grow_page_table(pager, page_num);
+    }
+    frame->page_num = page_num;
+    pager->page_table[page_num] = frame_index;
+    if (page_num >= pager->num_pages) {
+        pager->num_pages = page_num + 1;
+    }
+
+    memset(frame->data, 0, PAGE_SIZE);
+    frame->dirty = false;
+    frame->referenced = true;
+    __atomic_fetch_add(&frame->pin_count, 1, __ATOMIC_RELAXED);
+    if (page_num < num_pages) {
+        frame->io_pending = true;
+        pthread_mutex_unlock(&pager->lock);
+        ssize_t bytes_read = pread(pager->file_descriptor, frame->data, PAGE_SIZE,
+                                   (off_t)page_num * PAGE_SIZE);
+        if (bytes_read == -1) {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(pager, STAT_BYTES_READ, bytes_read);
+        pager_decompress_page(pager, page_num, frame->data);
+        pthread_mutex_lock(&pager->lock);
+        frame->io_pending = false;
+        pthread_cond_broadcast(&pager->io_done);
+    } else {
+        // 文件中还没有的新页面，必须在将来写回
+        frame->dirty = true;
+    }
+    return frame;
+}
+
+/**
+ * 固定页面并按 mode 加锁存。锁存在放开 Pager.lock 之后才去等待，
+ * 等锁存的线程不会挡住其他线程访问缓冲池。
+ */
+void* get_page_latched(Pager* pager, uint32_t page_num, LatchMode mode) {
+    Frame* frame = NULL;
+    void* data;
+    pthread_rwlock_t* latch;
+
+    pthread_mutex_lock(&pager->lock);
+    if (pager->mode == PAGER_MODE_MMAP) {
+        // 零拷贝：直接返回映射中的地址，无需固定
+        if (page_num >= pager->mapped_pages) {
+            pager_mmap_grow(pager, page_num);
+        }
+        if (page_num >= pager->num_pages) {
+            pager->num_pages = page_num + 1;
+        }
+        data = pager->map + (size_t)page_num * PAGE_SIZE;
+        latch = &pager->map_latches[page_num];
+        if (mode != LATCH_NONE && !(pager->latch_map[page_num / 8] & (1 << (page_num % 8)))) {
+            pthread_rwlock_init(latch, NULL);
+            pager->latch_map[page_num / 8] |= 1 << (page_num % 8);
+        }
+    } else {
+        frame = pager_load_frame(pager, page_num);
+        data = frame->data;
+        latch = &frame->latch;
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    if (mode == LATCH_NONE) {
+        latch = NULL;
+    } else if (mode == LATCH_SHARED) {
+        pthread_rwlock_rdlock(latch);
+    } else {
+        pthread_rwlock_wrlock(latch);
+    }
+    if (frame != NULL || latch != NULL) {
+        pager_push_pin(frame, latch);
+    }
+    return data;
+}
+
+void* get_page(Pager* pager, uint32_t page_num) {
+    return get_page_latched(pager, page_num, LATCH_NONE);
+}
+
+void pager_advise(Pager* pager, uint32_t first_page_num, uint32_t count) {
+    // 只是提示，失败时照常按需读取
+    off_t offset = (off_t)first_page_num * PAGE_SIZE;
+    size_t length = (size_t)count * PAGE_SIZE;
+    if (pager->mode == PAGER_MODE_MMAP) {
+        madvise(pager->map + offset, length, MADV_WILLNEED);
+    } else {
+        posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * 用 io_uring 把页面直接读进缓冲池。只使用干净的空闲帧，不为预读写回脏页，
+ * 同时在途的预读不超过帧数的四分之一，以免挤掉正在使用的页面。
+ */
+void pager_prefetch_frames(Pager* pager, uint32_t* page_nums, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_num = page_nums[i];
+        if ((off_t)page_num * PAGE_SIZE >= pager->file_length ||
+            pager_lookup_frame(pager, page_num) != INVALID_FRAME) {
+            continue;
+        }
+        if (pager->ring->queued + pager->ring->in_flight >= pager->num_frames / 4) {
+            break;
+        }
+        uint32_t frame_index = pager_clock_sweep(pager, false);
+        if (frame_index == INVALID_FRAME) {
+            break;
+        }
+        Frame* frame = pager->frames[frame_index];
+        if (frame->page_num != INVALID_PAGE_NUM) {
+            pager->page_table[frame->page_num] = INVALID_FRAME;
+        }
+        memset(frame->data, 0, PAGE_SIZE);
+        if (page_num >= pager->page_table_capacity) {
+            pager_grow_page_table(pager, page_num);
+        }
+        frame->page_num = page_num;
+        pager->page_table[page_num] = frame_index;
+        frame->dirty = false;
+        frame->referenced = true;  // 被用到之前至少熬过一轮 CLOCK
+        frame->io_pending = true;
+        __atomic_fetch_add(&frame->pin_count, 1, __ATOMIC_RELAXED);
+        pager_io_queue(pager, IORING_OP_READ, frame->data, page_num, IO_READ_FRAME,
+                       frame_index);
+    }
+    // 只提交不等待，完成事件在 get_page 需要时处理
+    io_uring_submit(pager->ring, 0);
+}
+
+/**
+ * 让内核在后台把这些页面读入页缓存。已在缓冲池中或文件里还没有的页面跳过，
+ * 页号相邻的合并成一次调用。
+ */
+void pager_prefetch(Pager* pager, uint32_t* page_nums, uint32_t count) {
+    pthread_mutex_lock(&pager->lock);
+    if (pager->ring != NULL && pager->mode == PAGER_MODE_BUFFERED) {
+        pager_prefetch_frames(pager, page_nums, count);
+        pthread_mutex_unlock(&pager->lock);
+        return;
+    }
+
+    uint32_t run_start = 0;
+    uint32_t run_length = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page_num = page_nums[i];
+        bool skip = (off_t)page_num * PAGE_SIZE >= pager->file_length ||
+                    (pager->mode == PAGER_MODE_BUFFERED &&
+                     pager_lookup_frame(pager, page_num) != INVALID_FRAME);
+        if (!skip && run_length > 0 && page_num == run_start + run_length) {
+            run_length++;
+            continue;
+        }
+        if (run_length > 0) {
+            pager_advise(pager, run_start, run_length);
+            run_length = 0;
+        }
+        if (!skip) {
+            run_start = page_num;
+            run_length = 1;
+        }
+    }
+    if (run_length > 0) {
+        pager_advise(pager, run_start, run_length);
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+void* pager_page_data(Pager* pager, uint32_t page_num);
+void pager_save_version(Pager* pager, uint32_t page_num);
+
+/**
+ * 修改页面内容之前调用，被置换或关闭数据库时写回。
+ * 页面必须仍被固定在缓冲池中；已提交的页面还必须持有排他锁存，
+ * 这里会保存它修改前的映像。
+ */
+void mark_page_dirty(Pager* pager, uint32_t page_num) {
+    pthread_mutex_lock(&pager->lock);
+    if (pager_add_txn_page(pager, page_num) && page_num < pager->committed_pages) {
+        pager_save_version(pager, page_num);
+    }
+
+    if (pager->mode == PAGER_MODE_MMAP) {
+        pager->dirty_map[page_num / 8] |= 1 << (page_num % 8);
+    } else {
+        uint32_t frame_index = pager_lookup_frame(pager, page_num);
+        if (frame_index == INVALID_FRAME) {
+            printf("Tried to dirty page %d which is not in the buffer pool\n", page_num);
+            exit(EXIT_FAILURE);
+        }
+        pager->frames[frame_index]->dirty = true;
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/**
+ * 持有 Pager.lock 时取得页面的内容而不固定它，页面必须已经在缓冲池中。
+ */
+void* pager_page_data(Pager* pager, uint32_t page_num) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        return pager->map + (size_t)page_num * PAGE_SIZE;
+    }
+    uint32_t frame_index = pager_lookup_frame(pager, page_num);
+    if (frame_index == INVALID_FRAME) {
+        printf("Tried to read page %d which is not in the buffer pool\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    return pager->frames[frame_index]->data;
+}
+
+/**
+ * 持有 Pager.lock 时调用。把页面当前的内容保存为当前事务覆盖的版本。
+ */
+void pager_save_version(Pager* pager, uint32_t page_num) {
+    if (page_num >= pager->versions_capacity) {
+        uint32_t new_capacity = pager->versions_capacity > 0 ? pager->versions_capacity : 64;
+        while (new_capacity <= page_num) {
+            new_capacity *= 2;
+        }
+        pager->versions = realloc(pager->versions, sizeof(PageVersion*) * new_capacity);
+        memset(pager->versions + pager->versions_capacity, 0,
+               sizeof(PageVersion*) * (new_capacity - pager->versions_capacity));
+        pager->versions_capacity = new_capacity;
+    }
+
+    PageVersion* version = pager->spare_versions;
+    if (version != NULL) {
+        pager->spare_versions = version->next;
+        pager->num_spare_versions--;
+    } else {
+        version = malloc(sizeof(PageVersion));
+        version->data = malloc(PAGE_SIZE);
+    }
+    version->page_num = page_num;
+    version->end_seq = pager->commit_seq + 1;
+    memcpy(version->data, pager_page_data(pager, page_num), PAGE_SIZE);
+    version->older = pager->versions[page_num];
+    pager->versions[page_num] = version;
+    version->next = pager->txn_versions;
+    pager->txn_versions = version;
+    __atomic_add_fetch(&pager->num_versions, 1, __ATOMIC_RELEASE);
+}
+
+void pager_free_version(Pager* pager, PageVersion* version) {
+    uint32_t max_spare =
+        pager->frame_limit > PAGER_SPARE_VERSIONS ? pager->frame_limit : PAGER_SPARE_VERSIONS;
+    if (pager->num_spare_versions < max_spare) {
+        version->next = pager->spare_versions;
+        pager->spare_versions = version;
+        pager->num_spare_versions++;
+    } else {
+        free(version->data);
+        free(version);
+    }
+    __atomic_sub_fetch(&pager->num_versions, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * 持有 Pager.lock 时调用。返回快照应读取的页面版本，应读当前页面时返回 NULL。
+ */
+PageVersion* pager_find_version(Pager* pager, uint32_t page_num, uint64_t snapshot) {
+    if (page_num >= pager->versions_capacity) {
+        return NULL;
+    }
+    PageVersion* found = NULL;
+    for (PageVersion* version = pager->versions[page_num];
+         version != NULL && version->end_seq > snapshot; version = version->older) {
+        found = version;
+    }
+    return found;
+}
+
+/**
+ * 回收所有活动快照都不再需要的版本。队列按 end_seq 排列，
+ * 队首的版本也是它所在页面版本链的末尾。
+ */
+void pager_collect_versions(Pager* pager) {
+    uint64_t oldest_snapshot = UINT64_MAX;
+    for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+        if (pager->snapshots[i] < oldest_snapshot) {
+            oldest_snapshot = pager->snapshots[i];
+        }
+    }
+    while (pager->oldest_version != NULL && pager->oldest_version->end_seq <= oldest_snapshot) {
+        PageVersion* version = pager->oldest_version;
+        pager->oldest_version = version->next;
+        if (pager->oldest_version == NULL) {
+            pager->newest_version = NULL;
+        }
+        PageVersion** link = &pager->versions[version->page_num];
+        while (*link != version) {
+            link = &(*link)->older;
+        }
+        *link = NULL;
+        pager_free_version(pager, version);
+    }
+}
+
+/**
+ * 事务提交后处理它保存的映像。页面的上一个版本被覆盖之后开始的快照
+ * 只能从这个映像读到提交前的内容；没有这样的活动快照时映像立即丢弃。
+ */
+void pager_retire_txn_versions(Pager* pager) {
+    uint64_t newest_snapshot = 0;
+    for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+        if (pager->snapshots[i] > newest_snapshot) {
+            newest_snapshot = pager->snapshots[i];
+        }
+    }
+
+    PageVersion* version = pager->txn_versions;
+    while (version != NULL) {
+        PageVersion* next = version->next;
+        uint64_t previous_end = version->older != NULL ? version->older->end_seq : 0;
+        if (pager->num_snapshots > 0 && newest_snapshot >= previous_end) {
+            version->next = NULL;
+            if (pager->newest_version == NULL) {
+                pager->oldest_version = version;
+            } else {
+                pager->newest_version->next = version;
+            }
+            pager->newest_version = version;
+        } else {
+            // 事务的映像总在页面版本链的最前面
+            pager->versions[version->page_num] = version->older;
+            pager_free_version(pager, version);
+        }
+        version = next;
+    }
+    pager->txn_versions = NULL;
+}
+
+/**
+ * 开始一个快照，返回它的版本号：此前提交的事务可见，之后的不可见。
+ */
+uint64_t pager_snapshot_begin(Pager* pager) {
+    pthread_mutex_lock(&pager->lock);
+    if (pager->num_snapshots >= pager->snapshots_capacity) {
+        pager->snapshots_capacity *= 2;
+        pager->snapshots =
+            realloc(pager->snapshots, sizeof(uint64_t) * pager->snapshots_capacity);
+    }
+    uint64_t snapshot = pager->commit_seq;
+    pager->snapshots[pager->num_snapshots++] = snapshot;
+    pthread_mutex_unlock(&pager->lock);
+    return snapshot;
+}
+
+void pager_snapshot_end(Pager* pager, uint64_t snapshot) {
+    pthread_mutex_lock(&pager->lock);
+    for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+        if (pager->snapshots[i] == snapshot) {
+            pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+            break;
+        }
+    }
+    pager_collect_versions(pager);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/**
+ * 按快照读取页面，返回的内容在调用者释放固定之前有效。
+ * 有快照之后才被覆盖的版本时直接读那个不可变的映像，不必等写者；
+ * 否则对当前页面加共享锁存，写者此后在修改前会先保存映像，
+ * 所以加上锁存后要再查一次。
+ */
+void* get_page_snapshot(Pager* pager, uint32_t page_num, uint64_t snapshot) {
+    PageVersion* version = NULL;
+    if (__atomic_load_n(&pager->num_versions, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&pager->lock);
+        version = pager_find_version(pager, page_num, snapshot);
+        pthread_mutex_unlock(&pager->lock);
+        if (version != NULL) {
+            return version->data;
+        }
+    }
+
+    void* page = get_page_latched(pager, page_num, LATCH_SHARED);
+    if (__atomic_load_n(&pager->num_versions, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&pager->lock);
+        version = pager_find_version(pager, page_num, snapshot);
+        pthread_mutex_unlock(&pager->lock);
+    }
+    if (version == NULL) {
+        return page;
+    }
+    uint32_t pin = pager_pin_mark(pager) - 1;
+    pager_release_latches(pager, pin, pin + 1);
+    return version->data;
+}
+
+/**
+ * 写回所有脏页。启用 io_uring 时全部写请求成批提交，再一起等待完成。
+ */
+void pager_flush_all(Pager* pager) {
+    if (pager->ring == NULL) {
+        for (uint32_t i = 0; i < pager->num_frames; i++) {
+            Frame* frame = pager->frames[i];
+            if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+                pager_flush(pager, frame->page_num);
+            }
+        }
+        if (pager->mode == PAGER_MODE_MMAP) {
+            for (uint32_t i = 0; i < pager->num_pages; i++) {
+                if (pager->dirty_map[i / 8] & (1 << (i % 8))) {
+                    pager_flush(pager, i);
+                }
+            }
+        }
+        return;
+    }
+
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        Frame* frame = pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty) {
+            pager_io_queue(pager, IORING_OP_WRITE, frame->data, frame->page_num,
+                           IO_WRITE_FRAME, i);
+        }
+    }
+    if (pager->mode == PAGER_MODE_MMAP) {
+        for (uint32_t i = 0; i < pager->num_pages; i++) {
+            if (pager->dirty_map[i / 8] & (1 << (i % 8))) {
+                pager_io_queue(pager, IORING_OP_WRITE, pager->map + (size_t)i * PAGE_SIZE, i,
+                               IO_WRITE_MAP, i);
+            }
+        }
+    }
+    pager_io_drain(pager);
+}
+
+/**
+ * 把所有脏页写回数据库文件并 fsync，之后日志可以清空。持有 Pager.lock 时调用。
+ */
+void pager_checkpoint(Pager* pager) {
+    pager_flush_all(pager);
+
+    if (pager->wal != NULL) {
+        if (fsync(pager->file_descriptor) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(pager, STAT_FSYNCS, 1);
+        wal_reset(pager->wal);
+    }
+}
+
+/**
+ * 结束当前事务。启用 WAL 时，写集合中每个页面的映像和一条提交记录
+ * 一起追加到日志，并在返回前持久化。
+ */
+void pager_commit(Pager* pager) {
+    Wal* wal = pager->wal;
+
+    pthread_mutex_lock(&pager->lock);
+    if (wal != NULL && pager->txn_num_pages > 0) {
+        size_t record_size = sizeof(WalRecordHeader) + PAGE_SIZE;
+        size_t length = record_size * pager->txn_num_pages + sizeof(WalRecordHeader);
+        if (length > wal->buffer_capacity) {
+            while (wal->buffer_capacity < length) {
+                wal->buffer_capacity *= 2;
+            }
+            wal->buffer = realloc(wal->buffer, wal->buffer_capacity);
+        }
+
+        // 写集合中的页面不会被置换，一定还在缓冲池中
+        void* cursor = wal->buffer;
+        for (uint32_t i = 0; i < pager->txn_num_pages; i++) {
+            WalRecordHeader* header = cursor;
+            void* data = cursor + sizeof(WalRecordHeader);
+            memcpy(data, pager_page_data(pager, pager->txn_pages[i]), PAGE_SIZE);
+            header->type = WAL_RECORD_PAGE;
+            header->page_num = pager->txn_pages[i];
+            header->page_size = PAGE_SIZE;
+            header->checksum = wal_checksum(header, data);
+            cursor += record_size;
+        }
+
+        WalRecordHeader* commit = cursor;
+        commit->type = WAL_RECORD_COMMIT;
+        commit->page_num = pager->num_pages;
+        commit->page_size = PAGE_SIZE;
+        commit->checksum = wal_checksum(commit, NULL);
+
+        // 等待日志持久化时放开缓冲池，读者照常访问
+        wal->pages_since_checkpoint += pager->txn_num_pages;
+        pthread_mutex_unlock(&pager->lock);
+        off_t commit_offset = wal_append(wal, wal->buffer, length);
+        uint32_t syncs = wal_wait_durable(wal, commit_offset);
+        stats_add(pager, STAT_BYTES_WRITTEN, length);
+        stats_add(pager, STAT_FSYNCS, syncs);
+        pthread_mutex_lock(&pager->lock);
+    }
+
+    if (pager->txn_num_pages > 0) {
+        pager->commit_seq++;
+        pager_retire_txn_versions(pager);
+    }
+    pager->committed_pages = pager->num_pages;
+
+    for (uint32_t i = 0; i < pager->txn_num_pages; i++) {
+        uint32_t page_num = pager->txn_pages[i];
+        pager->txn_map[page_num / 8] &= ~(1 << (page_num % 8));
+    }
+    pager->txn_num_pages = 0;
+
+    if (wal != NULL && wal->pages_since_checkpoint >= WAL_CHECKPOINT_PAGES) {
+        pager_checkpoint(pager);
+    }
+    pager_trim_frames(pager);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+uint64_t get_node_max_key(Pager* pager, void* node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    uint32_t mark = pager_pin_mark(pager);
+    void* right_child = get_page(pager, *internal_node_right_child(node));
+    uint64_t max_key = get_node_max_key(pager, right_child);
+    pager_release_pins(pager, mark);
+    return max_key;
+}
+
+/*******************************************************************
+ * 后端 后台检查点
+ *******************************************************************/
+
+struct Checkpointer {
+    Table* table;
+    uint32_t pages_per_tick;
+    uint32_t next_page_num;  // 按页号循环写回，下一轮从这里继续
+    uint32_t* pages;
+    uint32_t pages_capacity;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // 关闭时唤醒，不必等到下一轮
+    bool shutdown;
+};
+
+int compare_page_nums(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+/**
+ * 持有 Pager.lock 时调用。
+ */
+bool pager_page_dirty(Pager* pager, uint32_t page_num) {
+    if (pager->mode == PAGER_MODE_MMAP) {
+        return pager->dirty_map[page_num / 8] & (1 << (page_num % 8));
+    }
+    uint32_t frame_index = pager_lookup_frame(pager, page_num);
+    return frame_index != INVALID_FRAME && pager->frames[frame_index]->dirty;
+}
+
+/**
+ * 持有 Pager.lock 时调用，把所有脏页的页号按顺序放进 checkpointer->pages。
+ */
+uint32_t checkpointer_collect(Checkpointer* checkpointer, Pager* pager) {
+    uint32_t count = 0;
+    uint32_t limit = pager->mode == PAGER_MODE_MMAP ? pager->num_pages : pager->num_frames;
+    for (uint32_t i = 0; i < limit; i++) {
+        uint32_t page_num = i;
+        if (pager->mode != PAGER_MODE_MMAP) {
+            page_num = pager->frames[i]->page_num;
+            if (page_num == INVALID_PAGE_NUM) {
+                continue;
+            }
+        }
+        if (!pager_page_dirty(pager, page_num)) {
+            continue;
+        }
+        if (count >= checkpointer->pages_capacity) {
+            checkpointer->pages_capacity =
+                checkpointer->pages_capacity > 0 ? checkpointer->pages_capacity * 2 : 64;
+            checkpointer->pages =
+                realloc(checkpointer->pages, sizeof(uint32_t) * checkpointer->pages_capacity);
+        }
+        checkpointer->pages[count++] = page_num;
+    }
+    qsort(checkpointer->pages, count, sizeof(uint32_t), compare_page_nums);
+    return count;
+}
+
+/**
+ * 写回至多 pages_per_tick 个脏页。持有 write_lock 期间没有写者，
+ * 脏页都是已提交的，也不会在写回时被修改；每写一页放开一次 Pager.lock，读者不必等整批。
+ * 脏页全部写回后在锁外 fsync，再清空日志。
+ */
+void checkpointer_tick(Checkpointer* checkpointer) {
+    Table* table = checkpointer->table;
+    Pager* pager = table->pager;
+    // 事务期间写者一直持有 write_lock，这一轮跳过，不等它提交
+    if (pthread_mutex_trylock(&table->write_lock) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t count = checkpointer_collect(checkpointer, pager);
+    uint32_t start = 0;
+    while (start < count && checkpointer->pages[start] < checkpointer->next_page_num) {
+        start++;
+    }
+    uint32_t written = 0;
+    uint32_t visited = 0;
+    for (; visited < count && written < checkpointer->pages_per_tick; visited++) {
+        uint32_t page_num = checkpointer->pages[(start + visited) % count];
+        // 可能已经在置换时写回了
+        if (pager_page_dirty(pager, page_num)) {
+            pager_flush(pager, page_num);
+            written++;
+        }
+        checkpointer->next_page_num = page_num + 1;
+        pthread_mutex_unlock(&pager->lock);
+        pthread_mutex_lock(&pager->lock);
+    }
+
+    Wal* wal = pager->wal;
+    uint64_t generation;
+    off_t offset = 0;
+    if (visited == count && wal != NULL) {
+        wal_position(wal, &generation, &offset);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    pthread_mutex_unlock(&table->write_lock);
+
+    if (offset > 0) {
+        if (fsync(pager->file_descriptor) == -1) {
+            printf("Error syncing db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        stats_add(pager, STAT_FSYNCS, 1);
+        pthread_mutex_lock(&pager->lock);
+        wal_reset_at(wal, generation, offset);
+        pthread_mutex_unlock(&pager->lock);
+    }
+}
+
+void* checkpointer_main(void* argument) {
+    Checkpointer* checkpointer = argument;
+    pthread_mutex_lock(&checkpointer->lock);
+    while (!checkpointer->shutdown) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CHECKPOINT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&checkpointer->wake, &checkpointer->lock, &deadline);
+        if (checkpointer->shutdown) {
+            break;
+        }
+        pthread_mutex_unlock(&checkpointer->lock);
+        checkpointer_tick(checkpointer);
+        pthread_mutex_lock(&checkpointer->lock);
+    }
+    pthread_mutex_unlock(&checkpointer->lock);
+    return NULL;
+}
+
+/**
+ * rate 为每秒最多写回的页数。
+ */
+Checkpointer* checkpointer_open(Table* table, uint32_t rate) {
+    Checkpointer* checkpointer = malloc(sizeof(Checkpointer));
+    checkpointer->table = table;
+    checkpointer->pages_per_tick = rate * CHECKPOINT_INTERVAL_MS / 1000;
+    if (checkpointer->pages_per_tick == 0) {
+        checkpointer->pages_per_tick = 1;
+    }
+    checkpointer->next_page_num = 0;
+    checkpointer->pages = NULL;
+    checkpointer->pages_capacity = 0;
+    pthread_mutex_init(&checkpointer->lock, NULL);
+    pthread_cond_init(&checkpointer->wake, NULL);
+    checkpointer->shutdown = false;
+    pthread_create(&checkpointer->thread, NULL, checkpointer_main, checkpointer);
+    return checkpointer;
+}
+
+void checkpointer_close(Checkpointer* checkpointer) {
+    pthread_mutex_lock(&checkpointer->lock);
+    checkpointer->shutdown = true;
+    pthread_cond_signal(&checkpointer->wake);
+    pthread_mutex_unlock(&checkpointer->lock);
+    pthread_join(checkpointer->thread, NULL);
+    pthread_mutex_destroy(&checkpointer->lock);
+    pthread_cond_destroy(&checkpointer->wake);
+    free(checkpointer->pages);
+    free(checkpointer);
+}
+
+/*******************************************************************
+ * 数据库文件的打开和关闭
+ *******************************************************************/
+
+DbOptions db_default_options() {
+    DbOptions options;
+    options.cache_frames = PAGER_DEFAULT_FRAMES;
+    options.pager_mode = PAGER_MODE_BUFFERED;
+    options.wal = false;
+    options.prefetch_pages = PAGER_DEFAULT_PREFETCH;
+    options.io_uring = false;
+    options.scan_threads = 0;
+    options.page_size = DEFAULT_PAGE_SIZE;
+    options.checkpoint_rate = CHECKPOINT_DEFAULT_RATE;
+    options.compress = false;
+    options.row_cache_rows = 0;
+    return options;
+}
+
+ScanPool* scan_pool_open(uint32_t num_threads);
+void scan_pool_close(ScanPool* pool);
+RowCache* row_cache_open(uint32_t num_rows);
+void row_cache_close(RowCache* cache);
+
+Table* db_open_with_options(const char* filename, DbOptions options) {
+    Pager* pager = pager_open(filename, options);
+    if (pager == NULL) {
+        return NULL;
+    }
+
+    Table* table = malloc(sizeof(Table));
     table->pager = pager;
-    table->root_page_num = 0;
+    table->path_cache_valid = false;
+    pthread_mutex_init(&table->write_lock, NULL);
+    table->scan_pool = options.scan_threads > 1 ? scan_pool_open(options.scan_threads) : NULL;
+
+    if (pager->num_pages == 0) {
+        // 新的数据库文件：页面 0 写入文件头，页面 1 初始化为根叶节点
+        uint32_t mark = pager_pin_mark(pager);
+        void* header = get_page(pager, 0);
+        memset(header, 0, PAGE_SIZE);
+        memcpy(file_header_magic(header), FILE_HEADER_MAGIC, FILE_HEADER_MAGIC_SIZE);
+        *file_header_page_size(header) = PAGE_SIZE;
+        *file_header_root_page(header) = 1;
+        *file_header_flags(header) = pager->compress ? FILE_HEADER_COMPRESSED : 0;
+        mark_page_dirty(pager, 0);
+        void* root_node = get_page(pager, 1);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        mark_page_dirty(pager, 1);
+        pager_release_pins(pager, mark);
+        pager_commit(pager);
+    }
+
+    // 已有的索引都是已提交的，任何快照都能用
+    uint32_t mark = pager_pin_mark(pager);
+    table->root_page_num = *file_header_root_page(get_page(pager, 0));
+    void* root = get_page(pager, table->root_page_num);
+    table->meta_page_num = *root_node_meta_page(root);
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        table->index_roots[i] = 0;
+        table->index_created[i] = 0;
+    }
+    if (table->meta_page_num != 0) {
+        void* meta = get_page(pager, table->meta_page_num);
+        for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+            table->index_roots[i] = *meta_index_root(meta, i);
+        }
+    }
+    pager_release_pins(pager, mark);
+
+    // 新数据库的根节点已经提交，检查点线程开始时树已完整。
+    // 没有日志时脏页里可能有写到一半的事务，写回去会撕裂树，只在开启日志时启动
+    table->checkpointer = options.wal && options.checkpoint_rate > 0
+                              ? checkpointer_open(table, options.checkpoint_rate)
+                              : NULL;
+    table->row_cache = options.row_cache_rows > 0 ? row_cache_open(options.row_cache_rows) : NULL;
+    return table;
+}
+
+Table* db_open(const char* filename) {
+    return db_open_with_options(filename, db_default_options());
+}
+
+void db_close(Table* table) {
+    Pager* pager = table->pager;
+    if (table->scan_pool != NULL) {
+        scan_pool_close(table->scan_pool);
+    }
+    // 剩下的脏页由下面的检查点写回，检查点线程大多已经写完了
+    if (table->checkpointer != NULL) {
+        checkpointer_close(table->checkpointer);
+    }
+    if (table->row_cache != NULL) {
+        row_cache_close(table->row_cache);
+    }
+
+    // 没有回滚，关闭时提交仍然打开的事务
+    if (txn_table == table) {
+        pager_commit(pager);
+        txn_table = NULL;
+        pthread_mutex_unlock(&table->write_lock);
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    pager_checkpoint(pager);
+    pthread_mutex_unlock(&pager->lock);
+
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+        pthread_rwlock_destroy(&pager->frames[i]->latch);
+        if (i >= pager->slab_frames) {
+            free(pager->frames[i]->data);
+            free(pager->frames[i]);
+        }
+    }
+    free(pager->frame_slab);
+    free(pager->data_slab);
+
+    if (pager->mode == PAGER_MODE_MMAP) {
+        munmap(pager->map, PAGER_MMAP_RESERVE);
+        munmap(pager->map_latches, PAGER_MMAP_LATCHES_SIZE);
+        // 去掉预先扩展但未使用的页面
+        if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) == -1) {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        free(pager->dirty_map);
+        free(pager->latch_map);
+    }
+
+    if (pager->wal != NULL) {
+        wal_close(pager->wal);
+    }
+    if (pager->ring != NULL) {
+        io_uring_close(pager->ring);
+    }
+
+    int result = close(pager->file_descriptor);
+    if (result == -1) {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+    free(pager->frames);
+    free(pager->page_table);
+    free(pager->txn_pages);
+    free(pager->txn_map);
+    // 关闭时已经没有活动快照，版本都已回收
+    free(pager->versions);
+    while (pager->spare_versions != NULL) {
+        PageVersion* version = pager->spare_versions;
+        pager->spare_versions = version->next;
+        free(version->data);
+        free(version);
+    }
+    free(pager->snapshots);
+    stats_free(pager);
+    pthread_mutex_destroy(&pager->lock);
+    pthread_cond_destroy(&pager->io_done);
+    free(pager);
+    pthread_mutex_destroy(&table->write_lock);
+    free(table);
+
+    pthread_mutex_lock(&page_size_lock);
+    open_databases--;
+    pthread_mutex_unlock(&page_size_lock);
+}
+
+/*******************************************************************
+ * 游标
+ *******************************************************************/
+
+/**
+ * 叶节点槽位和内部节点单元格都是 8 字节，键按 8 字节步长连续排列。
+ * key_lower_bound 返回第一个不小于 key 的下标：先做无分支二分查找，
+ * 把范围缩小到 KEY_SEARCH_WINDOW 个键，再用 SIMD 每次比较 4 个键，
+ * 统计其中小于 key 的个数。一次读入 4 个完整的 8 字节单元，内部节点的键在
+ * 单元的后半，最后一个键之后可能就是页尾，所以最后 4 个键总是留给标量循环。
+ */
+#define KEY_STRIDE 8
+#define KEY_SEARCH_WINDOW 16
+
+uint32_t key_at(const uint8_t* keys, uint32_t index) {
+    return *(uint32_t*)(keys + (size_t)index * KEY_STRIDE);
+}
+
+uint32_t key_count_less(const uint8_t* keys, uint32_t count, uint32_t key) {
+    uint32_t less = 0;
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    // SSE2 只有有符号比较，翻转符号位后等价于无符号比较
+    const __m128i bias = _mm_set1_epi32((int32_t)0x80000000u);
+    const __m128i target = _mm_xor_si128(_mm_set1_epi32((int32_t)key), bias);
+    for (; i + 4 < count; i += 4) {
+        const uint8_t* p = keys + (size_t)i * KEY_STRIDE;
+        __m128 low = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)p));
+        __m128 high = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(p + 16)));
+        // 每个 16 字节取第 0、2 个 32 位字，得到 4 个连续的键
+        __m128i k = _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i lt = _mm_cmplt_epi32(_mm_xor_si128(k, bias), target);
+        less += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+#elif defined(__ARM_NEON)
+    const uint32x4_t target = vdupq_n_u32(key);
+    for (; i + 4 < count; i += 4) {
+        // vld2 按步长 2 拆分，val[0] 就是 4 个键
+        uint32x4x2_t k = vld2q_u32((const uint32_t*)(keys + (size_t)i * KEY_STRIDE));
+        uint32x4_t lt = vshrq_n_u32(vcltq_u32(k.val[0], target), 31);
+        less += vaddvq_u32(lt);
+    }
+#endif
+    for (; i < count; i++) {
+        less += key_at(keys, i) < key;
+    }
+    return less;
+}
+
+uint32_t key_lower_bound(const void* keys, uint32_t count, uint32_t key) {
+    uint32_t first = 0;
+    uint32_t length = count;
+    // 结果始终在 [first, first + length] 内
+    while (length > KEY_SEARCH_WINDOW) {
+        uint32_t half = length / 2;
+        first = key_at(keys, first + half) < key ? first + half : first;
+        length -= half;
+    }
+    return first + key_count_less((const uint8_t*)keys + (size_t)first * KEY_STRIDE,
+                                  length, key);
+}
+
+/**
+ * 节点中的键存为与基准键 base 的 32 位差值。查找前把 64 位的 key 换算成差值，
+ * 落在差值范围之外时结果就是开头或末尾，范围之内仍然用 key_lower_bound 做 SIMD 比较。
+ */
+uint32_t delta_lower_bound(const void* deltas, uint32_t count, uint64_t base, uint64_t key) {
+    if (key < base) {
+        return 0;
+    }
+    if (key - base > UINT32_MAX) {
+        return count;
+    }
+    return key_lower_bound(deltas, count, (uint32_t)(key - base));
+}
+
+/**
+ * 存完整键的节点中叶节点槽位和内部节点单元格都是 12 字节。这种节点只在键很稀疏时出现，
+ * 用标量的无分支二分查找。
+ */
+#define WIDE_KEY_STRIDE 12
+
+uint64_t wide_key_at(const uint8_t* keys, uint32_t index) {
+    uint64_t key;
+    memcpy(&key, keys + (size_t)index * WIDE_KEY_STRIDE, sizeof(uint64_t));
+    return key;
+}
+
+uint32_t wide_key_lower_bound(const void* keys, uint32_t count, uint64_t key) {
+    if (count == 0) {
+        return 0;
+    }
+    uint32_t first = 0;
+    uint32_t length = count;
+    // 结果始终在 [first, first + length] 内
+    while (length > 1) {
+        uint32_t half = length / 2;
+        first = wide_key_at(keys, first + half) < key ? first + half : first;
+        length -= half;
+    }
+    return first + (wide_key_at(keys, first) < key);
+}
+
+uint32_t leaf_node_lower_bound(void* node, uint32_t count, uint64_t key) {
+    if (*leaf_node_wide_keys(node)) {
+        return wide_key_lower_bound(leaf_node_keys(node), count, key);
+    }
+    return delta_lower_bound(leaf_node_keys(node), count, *leaf_node_key_base(node), key);
+}
+
+/**
+ * 把 [low, high] 扩大到也包含节点（叶节点或内部节点）中的键。
+ */
+void node_key_range_widen(void* node, uint64_t* low, uint64_t* high) {
+    bool leaf = get_node_type(node) == NODE_LEAF;
+    uint32_t count = leaf ? *leaf_node_num_cells(node) : *internal_node_num_keys(node);
+    if (count == 0) {
+        return;
+    }
+    uint64_t min = leaf ? leaf_node_key(node, 0) : internal_node_key(node, 0);
+    uint64_t max = leaf ? leaf_node_key(node, count - 1) : internal_node_key(node, count - 1);
+    *low = min < *low ? min : *low;
+    *high = max > *high ? max : *high;
+}
+
+/**
+ * 节点再加入 [low, high] 内的键之后是否要存完整的键。已经存完整键的节点保持不变，
+ * 直到拆分、合并重写它。
+ */
+bool node_needs_wide_keys(void* node, uint64_t low, uint64_t high) {
+    bool wide = get_node_type(node) == NODE_LEAF ? *leaf_node_wide_keys(node)
+                                                 : *internal_node_wide_keys(node);
+    if (wide) {
+        return true;
+    }
+    node_key_range_widen(node, &low, &high);
+    return high - low > UINT32_MAX;
+}
+
+/**
+ * 换一个基准键，让差值表示的 count 个键都落在 [low, high] 内、[low, high] 也放得进 32 位。
+ * 调用者保证 [low, high] 包含已有的键。代价与键数成正比，只在键超出原来的范围时发生。
+ */
+void key_deltas_rebase(void* deltas, uint32_t count, uint64_t* base, uint64_t low,
+                       uint64_t high) {
+    if (low >= *base && high - *base <= UINT32_MAX) {
+        return;
+    }
+    uint64_t new_base = node_key_base(low, high);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t* delta = (uint32_t*)((uint8_t*)deltas + (size_t)i * KEY_STRIDE);
+        *delta = *base + *delta - new_base;
+    }
+    *base = new_base;
+}
+
+/**
+ * 把叶节点的槽位改为存完整的键。槽位从后往前逐个后移，
+ * 写入的位置总在还没有读取的槽位之后。调用者保证页面中有足够的空间。
+ */
+void leaf_node_widen_keys(void* node) {
+    uint64_t base = *leaf_node_key_base(node);
+    for (uint32_t i = *leaf_node_num_cells(node); i-- > 0;) {
+        uint8_t* slot = node + LEAF_NODE_HEADER_SIZE + i * LEAF_NODE_SLOT_SIZE;
+        uint8_t* wide_slot = node + LEAF_NODE_HEADER_SIZE + i * LEAF_NODE_WIDE_SLOT_SIZE;
+        uint64_t key = base + *(uint32_t*)(slot + LEAF_NODE_KEY_OFFSET);
+        memmove(wide_slot + LEAF_NODE_WIDE_KEY_SIZE, slot + LEAF_NODE_KEY_SIZE,
+                LEAF_NODE_SLOT_SIZE - LEAF_NODE_KEY_SIZE);
+        memcpy(wide_slot + LEAF_NODE_KEY_OFFSET, &key, sizeof(uint64_t));
+    }
+    *leaf_node_key_base(node) = 0;
+    *leaf_node_wide_keys(node) = 1;
+}
+
+void internal_node_widen_keys(void* node) {
+    uint64_t base = *internal_node_key_base(node);
+    for (uint32_t i = *internal_node_num_keys(node); i-- > 0;) {
+        uint8_t* cell = node + INTERNAL_NODE_HEADER_SIZE + i * INTERNAL_NODE_CELL_SIZE;
+        uint8_t* wide_cell = node + INTERNAL_NODE_HEADER_SIZE + i * INTERNAL_NODE_WIDE_CELL_SIZE;
+        uint64_t key = base + *(uint32_t*)(cell + INTERNAL_NODE_CHILD_SIZE);
+        memmove(wide_cell, cell, INTERNAL_NODE_CHILD_SIZE);
+        memcpy(wide_cell + INTERNAL_NODE_CHILD_SIZE, &key, sizeof(uint64_t));
+    }
+    *internal_node_key_base(node) = 0;
+    *internal_node_wide_keys(node) = 1;
+}
+
+/**
+ * 插入键为 key、大小为 cell_size 的单元格之后叶节点占用的字节数。cell_size 按
+ * 差值的槽位计算；插入后要存完整的键时，已有的槽位也一起变大。
+ */
+uint32_t leaf_node_used_space_after(void* node, uint64_t key, uint32_t cell_size) {
+    uint32_t slot_size =
+        node_needs_wide_keys(node, key, key) ? LEAF_NODE_WIDE_SLOT_SIZE : LEAF_NODE_SLOT_SIZE;
+    uint32_t payload_size = PAGE_SIZE - decode_content_start(*leaf_node_content_start(node));
+    return payload_size + (*leaf_node_num_cells(node) + 1) * slot_size + cell_size -
+           LEAF_NODE_SLOT_SIZE;
+}
+
+/**
+ * 让叶节点能存下键 key：必要时换一个基准键，差值放不下时改存完整的键。
+ * 调用者已经用 leaf_node_used_space_after 确认放得下，并把页面标记为脏页。
+ */
+void leaf_node_fit_key(void* node, uint64_t key) {
+    if (*leaf_node_wide_keys(node)) {
+        return;
+    }
+    uint64_t low = key;
+    uint64_t high = key;
+    node_key_range_widen(node, &low, &high);
+    if (high - low > UINT32_MAX) {
+        leaf_node_widen_keys(node);
+        return;
+    }
+    key_deltas_rebase(leaf_node_keys(node), *leaf_node_num_cells(node),
+                      leaf_node_key_base(node), low, high);
+}
+
+/**
+ * 内部节点再加入 added 个在 [low, high] 内的键之后是否放得下。
+ */
+bool internal_node_can_fit(void* node, uint32_t added, uint64_t low, uint64_t high) {
+    uint32_t max_cells = node_needs_wide_keys(node, low, high) ? INTERNAL_NODE_WIDE_MAX_CELLS
+                                                               : INTERNAL_NODE_MAX_CELLS;
+    return *internal_node_num_keys(node) + added <= max_cells;
+}
+
+/**
+ * 内部节点的版本，调用者已经用 internal_node_can_fit 确认放得下。
+ */
+void internal_node_fit_keys(void* node, uint64_t low, uint64_t high) {
+    if (*internal_node_wide_keys(node)) {
+        return;
+    }
+    node_key_range_widen(node, &low, &high);
+    if (high - low > UINT32_MAX) {
+        internal_node_widen_keys(node);
+        return;
+    }
+    key_deltas_rebase(internal_node_keys(node), *internal_node_num_keys(node),
+                      internal_node_key_base(node), low, high);
+}
+
+/**
+ * 游标由调用者提供，通常就在栈上，执行语句时不必分配内存。
+ */
+void leaf_node_find(Table* table, uint32_t page_num, void* node, uint64_t key,
+                    Cursor* cursor) {
+    // 获取叶节点中已有的单元格数量
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->end_of_table = false;
+    cursor->snapshot = 0;
+    cursor->prefetch_parent = INVALID_PAGE_NUM;
+
+    // 找到键时指向它，否则指向插入位置
+    cursor->cell_num = leaf_node_lower_bound(node, num_cells, key);
+}
+
+uint32_t internal_node_find_child(void* node, uint64_t key) {
+    /**
+     * 返回应包含给定键的子节点的索引。
+     */
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    /* 子节点数量比键数量多 1，所有键都小于 key 时为右子节点 */
+    if (*internal_node_wide_keys(node)) {
+        return wide_key_lower_bound(internal_node_keys(node), num_keys, key);
+    }
+    return delta_lower_bound(internal_node_keys(node), num_keys, *internal_node_key_base(node),
+                             key);
+}
+
+void tree_path_init(TreePath* path) {
+    path->depth = 0;
+    path->has_lower_bound = false;
+    path->has_upper_bound = false;
+}
+
+/**
+ * 在路径末尾记录内部节点 node 这一层，收紧叶节点的键范围，返回应包含 key 的子节点。
+ */
+uint32_t tree_path_descend(TreePath* path, uint32_t page_num, void* node, uint64_t key) {
+    if (path->depth >= BTREE_MAX_DEPTH) {
+        printf("Tree deeper than %d levels\n", BTREE_MAX_DEPTH);
+        exit(EXIT_FAILURE);
+    }
+    uint32_t child_index = internal_node_find_child(node, key);
+    // 越往下的键越接近，直接覆盖上层的边界
+    if (child_index > 0) {
+        path->has_lower_bound = true;
+        path->lower_bound = internal_node_key(node, child_index - 1);
+    }
+    if (child_index < *internal_node_num_keys(node)) {
+        path->has_upper_bound = true;
+        path->upper_bound = internal_node_key(node, child_index);
+    }
+    path->pages[path->depth] = page_num;
+    path->slots[path->depth] = child_index;
+    path->depth++;
+    return *internal_node_child(node, child_index);
+}
+
+/**
+ * 插入键为 key、大小为 cell_size 的单元格之后节点是否一定不会拆分。
+ * 写者下降时，这种节点之上的祖先都不会被修改。path 给出 node 的键范围。
+ * 键范围超过 32 位的节点改存完整的键，放得下的单元格变少。内部节点收到的分隔键
+ * 都在下降要进入的子节点的键范围内，范围的两端是相邻的键，在节点边上时是
+ * node 本身的范围；在树的边上范围没有端点，按存完整的键估计。
+ */
+bool node_is_safe_for_insert(void* node, uint32_t cell_size, uint64_t key, TreePath* path) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return leaf_node_used_space_after(node, key, cell_size) <= LEAF_NODE_SPACE_FOR_CELLS;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint64_t low = 0;
+    uint64_t high = UINT64_MAX;
+    if (child_index > 0) {
+        low = internal_node_key(node, child_index - 1);
+    } else if (path->has_lower_bound) {
+        low = path->lower_bound;
+    }
+    if (child_index < num_keys) {
+        high = internal_node_key(node, child_index);
+    } else if (path->has_upper_bound) {
+        high = path->upper_bound;
+    }
+    return internal_node_can_fit(node, 1, low, high);
+}
+
+/**
+ * 删除一个单元格（叶节点）或一个子节点（内部节点）之后是否一定不低于下限、不需要合并。
+ */
+bool node_is_safe_for_delete(void* node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return leaf_node_used_space(node) >=
+               LEAF_NODE_MIN_USED + leaf_node_slot_size(node) + LEAF_NODE_MAX_PAYLOAD_SIZE;
+    }
+    return *internal_node_num_keys(node) > INTERNAL_NODE_MIN_KEYS;
+}
+
+bool node_is_safe_for_write(void* node, WriteOp op, uint32_t cell_size, uint64_t key,
+                            TreePath* path) {
+    return op == WRITE_INSERT ? node_is_safe_for_insert(node, cell_size, key, path)
+                              : node_is_safe_for_delete(node);
+}
+
+/**
+ * 写者从 page_num 开始迭代下降到叶节点，沿途记录路径和叶节点的键范围。
+ * 路径上的节点加排他锁存，遇到插入后不会拆分的节点就放开它上面的祖先。
+ * 返回时叶节点和拆分可能修改的祖先仍持有锁存，随调用者释放固定一起放开。
+ */
+void internal_node_find(Table* table, uint32_t page_num, uint64_t key, WriteOp op,
+                        uint32_t cell_size, Cursor* cursor) {
+    Pager* pager = table->pager;
+    TreePath path;
+    tree_path_init(&path);
+
+    uint32_t latched_from = pager_pin_mark(pager);
+    void* node = get_page_latched(pager, page_num, LATCH_EXCLUSIVE);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        page_num = tree_path_descend(&path, page_num, node, key);
+        uint32_t child_pin = pager_pin_mark(pager);
+        node = get_page_latched(pager, page_num, LATCH_EXCLUSIVE);
+        if (node_is_safe_for_write(node, op, cell_size, key, &path)) {
+            pager_release_latches(pager, latched_from, child_pin);
+            latched_from = child_pin;
+        }
+    }
+    path.leaf_page_num = page_num;
+
+    leaf_node_find(table, page_num, node, key, cursor);
+    cursor->path = path;
+}
+
+bool tree_path_covers(TreePath* path, uint64_t key) {
+    if (path->has_lower_bound && key <= path->lower_bound) {
+        return false;
+    }
+    if (path->has_upper_bound && key > path->upper_bound) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 叶节点是否在树的最右侧：路径上每一层都走了右子节点，叶节点的键没有上界。
+ */
+bool cursor_on_right_edge(Cursor* cursor) {
+    return !cursor->path.has_upper_bound;
+}
+
+/**
+ * 返回给定键的位置。
+ * 如果键不存在，则返回应插入的位置
+ * 供持有 write_lock 的写者使用：叶节点和插入 cell_size 大小的单元格时
+ * 拆分要修改的祖先加着排他锁存返回，调用者修改完成后释放固定时一起放开。
+ * 连续递增的键总落在缓存的最右叶节点中，直到它放不下为止都不必下降。
+ * op 为 WRITE_DELETE 时改为锁住删除后合并要修改的祖先，cell_size 不用。
+ */
+void table_find_for_write(Table* table, uint64_t key, WriteOp op, uint32_t cell_size,
+                          Cursor* cursor) {
+    Pager* pager = table->pager;
+
+    if (table->path_cache_valid && tree_path_covers(&table->path_cache, key)) {
+        // 仍在上次的叶节点范围内，跳过下降。叶节点可能拆分时祖先也要加锁存，只能从根下降
+        uint32_t mark = pager_pin_mark(pager);
+        uint32_t leaf_page_num = table->path_cache.leaf_page_num;
+        void* leaf = get_page_latched(pager, leaf_page_num, LATCH_EXCLUSIVE);
+        if (node_is_safe_for_write(leaf, op, cell_size, key, &table->path_cache)) {
+            leaf_node_find(table, leaf_page_num, leaf, key, cursor);
+            cursor->path = table->path_cache;
+            return;
+        }
+        pager_release_pins(pager, mark);
+    }
+
+    // 根节点是叶节点时循环不执行，路径长度为 0
+    internal_node_find(table, table->root_page_num, key, op, cell_size, cursor);
+    table->path_cache = cursor->path;
+    table->path_cache_valid = true;
+}
+
+void table_find(Table* table, uint64_t key, uint32_t cell_size, Cursor* cursor) {
+    table_find_for_write(table, key, WRITE_INSERT, cell_size, cursor);
+}
+
+/**
+ * 读者在快照中查找键，返回的游标不持有锁存。下降时耦合共享锁存，
+ * 读到的是快照时的树，游标的位置在之后的插入和拆分中保持有效。
+ */
+void snapshot_find(Table* table, uint64_t key, uint64_t snapshot, Cursor* cursor) {
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    TreePath path;
+    tree_path_init(&path);
+
+    uint32_t page_num = table->root_page_num;
+    uint32_t node_pin = pager_pin_mark(pager);
+    void* node = get_page_snapshot(pager, page_num, snapshot);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        page_num = tree_path_descend(&path, page_num, node, key);
+        uint32_t child_pin = pager_pin_mark(pager);
+        node = get_page_snapshot(pager, page_num, snapshot);
+        pager_release_latches(pager, node_pin, child_pin);
+        node_pin = child_pin;
+    }
+    path.leaf_page_num = page_num;
+
+    leaf_node_find(table, page_num, node, key, cursor);
+    cursor->path = path;
+    cursor->snapshot = snapshot;
+    pager_release_pins(pager, mark);
+}
+
+/**
+ * 游标沿链表进入新的叶节点后，用它的第一个键重新下降得到路径。
+ * 内部节点通常都在缓冲池中，这比维护跨父节点的路径简单。
+ */
+void cursor_update_path(Cursor* cursor) {
+    Table* table = cursor->table;
+    uint32_t mark = pager_pin_mark(table->pager);
+    void* node = get_page_snapshot(table->pager, cursor->page_num, cursor->snapshot);
+    bool has_cells = *leaf_node_num_cells(node) > 0;
+    uint64_t first_key = has_cells ? leaf_node_key(node, 0) : 0;
+    // 下降要从根节点加锁存，先放开叶节点，否则可能与写者互相等待
+    pager_release_pins(table->pager, mark);
+
+    if (has_cells) {
+        Cursor found;
+        snapshot_find(table, first_key, cursor->snapshot, &found);
+        cursor->path = found.path;
+    }
+}
+
+/**
+ * 从父节点中取出当前叶节点之后的 prefetch_pages 个兄弟节点并预读。
+ * 已预读的部分用掉一半后才补充下一批，每个页面只提示一次。
+ */
+void cursor_prefetch(Cursor* cursor) {
+    Pager* pager = cursor->table->pager;
+    TreePath* path = &cursor->path;
+    if (pager->prefetch_pages == 0 || path->depth == 0 || cursor->end_of_table) {
+        return;
+    }
+    uint32_t parent_page_num = path->pages[path->depth - 1];
+    uint32_t slot = path->slots[path->depth - 1];
+    uint32_t first = slot + 1;
+    if (cursor->prefetch_parent == parent_page_num) {
+        if (cursor->prefetch_until > slot + pager->prefetch_pages / 2) {
+            return;
+        }
+        if (cursor->prefetch_until + 1 > first) {
+            first = cursor->prefetch_until + 1;
+        }
+    }
+
+    uint32_t mark = pager_pin_mark(pager);
+    void* parent = get_page_snapshot(pager, parent_page_num, cursor->snapshot);
+    uint32_t last = slot + pager->prefetch_pages;
+    if (last > *internal_node_num_keys(parent)) {
+        last = *internal_node_num_keys(parent);
+    }
+    uint32_t page_nums[PAGER_MAX_PREFETCH];
+    uint32_t count = 0;
+    for (uint32_t i = first; i <= last; i++) {
+        page_nums[count++] = *internal_node_child(parent, i);
+    }
+    pager_release_pins(pager, mark);
+
+    pager_prefetch(pager, page_nums, count);
+    cursor->prefetch_parent = parent_page_num;
+    cursor->prefetch_until = last;
+}
+
+/**
+ * 游标已经越过当前叶节点的末尾时移到下一个叶节点的开头，没有下一个时到达末尾。
+ * 返回游标是否换了叶节点。
+ */
+bool cursor_next_leaf(Cursor* cursor) {
+    uint32_t mark = pager_pin_mark(cursor->table->pager);
+    void* node = get_page_snapshot(cursor->table->pager, cursor->page_num, cursor->snapshot);
+    bool moved = false;
+    if (cursor->cell_num >= *leaf_node_num_cells(node)) {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0) {
+            /* 已经到达最右叶节点了 */
+            cursor->end_of_table = true;
+        } else {
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+            moved = true;
+        }
+    }
+    pager_release_pins(cursor->table->pager, mark);
+    return moved;
+}
+
+/**
+ * 返回快照中指向第一个不小于 key 的单元格的游标。
+ * 下降可能停在叶节点末尾，此时移到下一个叶节点的开头。
+ */
+void table_seek(Table* table, uint64_t key, uint64_t snapshot, Cursor* cursor) {
+    snapshot_find(table, key, snapshot, cursor);
+    if (cursor_next_leaf(cursor)) {
+        cursor_update_path(cursor);
+    }
+    cursor_prefetch(cursor);
+}
+
+void table_start(Table* table, uint64_t snapshot, Cursor* cursor) {
+    table_seek(table, 0, snapshot, cursor);
+}
+
+void cursor_read_row(Cursor* cursor, Row* row) {
+    uint32_t mark = pager_pin_mark(cursor->table->pager);
+    void* page = get_page_snapshot(cursor->table->pager, cursor->page_num, cursor->snapshot);
+    leaf_node_read_row(page, cursor->cell_num, row);
+    pager_release_pins(cursor->table->pager, mark);
+}
+
+void cursor_advance(Cursor* cursor) {
+    cursor->cell_num += 1;
+    /* 前进到下一个叶节点 */
+    if (cursor_next_leaf(cursor)) {
+        cursor_update_path(cursor);
+        cursor_prefetch(cursor);
+    }
+}
+
+/**
+ * 在快照中按 id 读取一行，返回这一行是否存在。
+ */
+bool table_get_row(Table* table, uint64_t id, uint64_t snapshot, Row* row) {
+    Cursor cursor;
+    snapshot_find(table, id, snapshot, &cursor);
+    uint32_t mark = pager_pin_mark(table->pager);
+    void* node = get_page_snapshot(table->pager, cursor.page_num, snapshot);
+    bool found = cursor.cell_num < *leaf_node_num_cells(node) &&
+                 leaf_node_key(node, cursor.cell_num) == id;
+    if (found) {
+        leaf_node_read_row(node, cursor.cell_num, row);
+    }
+    pager_release_pins(table->pager, mark);
+    return found;
+}
+
+/*******************************************************************
+ * 后端 热点行缓存
+ *******************************************************************/
+
+/**
+ * id -> 行的副本。点查命中时直接复制出这一行，不固定页面也不下降。
+ * 直接映射：每个 id 按哈希只有一个槽位，冲突时新的行替换旧的。
+ * 槽位按下标分成 ROW_CACHE_STRIPES 组，每组一把锁。
+ *
+ * 快照：写者修改或删除一行之前使它的槽位失效，并在组上记下这次修改在哪个提交中可见，
+ * 写者互斥，就是 commit_seq + 1。读者在快照 S 中读到的行只有在这一组
+ * 没有 S 之后的修改时才放进缓存，并记下 S；快照早于 S 的读者不使用这一项。
+ * 插入新键和拆分不改变已有的行，不需要失效。
+ */
+#define ROW_CACHE_STRIPES 64
+
+typedef struct {
+    bool valid;
+    uint64_t snapshot;  // 从这个快照起有效
+    Row row;
+} RowCacheEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t modified_seq;  // 这一组最近一次修改可见的快照
+} __attribute__((aligned(64))) RowCacheStripe;
+
+struct RowCache {
+    RowCacheEntry* entries;
+    uint32_t mask;  // 槽位数减一，槽位数是 2 的幂
+    RowCacheStripe stripes[ROW_CACHE_STRIPES];
+};
+
+/**
+ * 槽位数取不小于 num_rows 的 2 的幂。
+ */
+RowCache* row_cache_open(uint32_t num_rows) {
+    uint32_t num_entries = ROW_CACHE_STRIPES;
+    while (num_entries < num_rows) {
+        num_entries *= 2;
+    }
+    RowCache* cache = malloc(sizeof(RowCache));
+    cache->entries = calloc(num_entries, sizeof(RowCacheEntry));
+    cache->mask = num_entries - 1;
+    for (uint32_t i = 0; i < ROW_CACHE_STRIPES; i++) {
+        pthread_mutex_init(&cache->stripes[i].lock, NULL);
+        cache->stripes[i].modified_seq = 0;
+    }
+    return cache;
+}
+
+void row_cache_close(RowCache* cache) {
+    for (uint32_t i = 0; i < ROW_CACHE_STRIPES; i++) {
+        pthread_mutex_destroy(&cache->stripes[i].lock);
+    }
+    free(cache->entries);
+    free(cache);
+}
+
+uint32_t row_cache_slot(RowCache* cache, uint64_t id) {
+    return (uint32_t)((id * 0x9E3779B97F4A7C15ull) >> 32) & cache->mask;
+}
+
+bool row_cache_get(RowCache* cache, uint64_t id, uint64_t snapshot, Row* row) {
+    uint32_t slot = row_cache_slot(cache, id);
+    RowCacheEntry* entry = &cache->entries[slot];
+    RowCacheStripe* stripe = &cache->stripes[slot % ROW_CACHE_STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    bool hit = entry->valid && entry->row.id == id && entry->snapshot <= snapshot;
+    if (hit) {
+        *row = entry->row;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return hit;
+}
+
+/**
+ * 放入在快照 snapshot 中读到的行。
+ */
+void row_cache_put(RowCache* cache, const Row* row, uint64_t snapshot) {
+    uint32_t slot = row_cache_slot(cache, row->id);
+    RowCacheEntry* entry = &cache->entries[slot];
+    RowCacheStripe* stripe = &cache->stripes[slot % ROW_CACHE_STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    if (stripe->modified_seq <= snapshot) {
+        entry->valid = true;
+        entry->snapshot = snapshot;
+        entry->row = *row;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * 写者在修改或删除 id 这一行之前调用，visible_seq 是修改可见的快照。
+ */
+void row_cache_invalidate(RowCache* cache, uint64_t id, uint64_t visible_seq) {
+    uint32_t slot = row_cache_slot(cache, id);
+    RowCacheEntry* entry = &cache->entries[slot];
+    RowCacheStripe* stripe = &cache->stripes[slot % ROW_CACHE_STRIPES];
+    pthread_mutex_lock(&stripe->lock);
+    if (entry->valid && entry->row.id == id) {
+        entry->valid = false;
+    }
+    stripe->modified_seq = visible_seq;
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * 写者修改这一行之前调用。写者持有 write_lock，commit_seq 只有它自己会改。
+ */
+void table_invalidate_row(Table* table, uint64_t id) {
+    if (table->row_cache != NULL) {
+        row_cache_invalidate(table->row_cache, id, table->pager->commit_seq + 1);
+    }
+}
+
+/**
+ * 在快照中按 id 读取一行，先查热点行缓存，未命中时读树并放入缓存。
+ */
+bool table_get_row_cached(Table* table, uint64_t id, uint64_t snapshot, Row* row) {
+    RowCache* cache = table->row_cache;
+    // 事务中的写者读到的可能是未提交的行，不放进缓存
+    if (cache == NULL || snapshot == SNAPSHOT_LATEST) {
+        return table_get_row(table, id, snapshot, row);
+    }
+    if (row_cache_get(cache, id, snapshot, row)) {
+        stats_add(table->pager, STAT_ROW_CACHE_HITS, 1);
+        return true;
+    }
+    stats_add(table->pager, STAT_ROW_CACHE_MISSES, 1);
+    if (!table_get_row(table, id, snapshot, row)) {
+        return false;
+    }
+    row_cache_put(cache, row, snapshot);
+    return true;
+}
+
+/*******************************************************************
+ * 后端 向量化扫描
+ *******************************************************************/
+
+// 一批最多的行数，不小于 4 KB 叶节点能放下的单元格数；更大的页面中一个叶节点分成几批
+#define SCAN_BATCH_ROWS 512
+
+/**
+ * 按列产出叶节点中的行：id 直接从槽位中取出，文本列是指向负载的长度和字节，
+ * 都不解码成 Row。需要文本列时整个叶节点先复制到 leaf_copy，
+ * 这样放开锁存之后批次仍然有效，回调不会挡住写者。
+ */
+typedef struct {
+    Cursor cursor;
+    uint64_t high;
+    bool with_text;
+    void* leaf_copy;
+    uint64_t ids[SCAN_BATCH_ROWS];
+    DbText usernames[SCAN_BATCH_ROWS];
+    DbText emails[SCAN_BATCH_ROWS];
+    DbBatch batch;
+} ScanOperator;
+
+/**
+ * 在快照中扫描键在 [low, high] 内的行。leaf_copy 由调用者提供，
+ * 有 PAGE_SIZE 字节，with_text 为 false 时不使用。
+ */
+void scan_open(ScanOperator* scan, Table* table, uint64_t low, uint64_t high,
+               uint64_t snapshot, bool with_text, void* leaf_copy) {
+    table_seek(table, low, snapshot, &scan->cursor);
+    scan->high = high;
+    scan->with_text = with_text;
+    scan->leaf_copy = leaf_copy;
+    scan->batch.count = 0;
+    scan->batch.ids = scan->ids;
+    scan->batch.usernames = with_text ? scan->usernames : NULL;
+    scan->batch.emails = with_text ? scan->emails : NULL;
+}
+
+/**
+ * 读出下一批行，游标移到它们之后，扫描结束时返回 false。
+ * 批次在下一次调用之前有效。
+ */
+bool scan_next_batch(ScanOperator* scan) {
+    Cursor* cursor = &scan->cursor;
+    Pager* pager = cursor->table->pager;
+    while (!cursor->end_of_table) {
+        uint32_t mark = pager_pin_mark(pager);
+        void* node = get_page_snapshot(pager, cursor->page_num, cursor->snapshot);
+        uint32_t end = *leaf_node_num_cells(node);
+        if (end > cursor->cell_num + SCAN_BATCH_ROWS) {
+            end = cursor->cell_num + SCAN_BATCH_ROWS;
+        }
+        // 键有序，范围的终点在叶节点中二分查找一次
+        bool past_high = false;
+        if (scan->high != UINT64_MAX) {
+            uint32_t limit = leaf_node_lower_bound(node, end, scan->high + 1);
+            if (limit < end) {
+                end = limit > cursor->cell_num ? limit : cursor->cell_num;
+                past_high = true;
+            }
+        }
+
+        void* source = node;
+        if (scan->with_text) {
+            memcpy(scan->leaf_copy, node, PAGE_SIZE);
+            source = scan->leaf_copy;
+        }
+        uint32_t count = 0;
+        for (uint32_t i = cursor->cell_num; i < end; i++, count++) {
+            scan->ids[count] = leaf_node_key(source, i);
+            if (scan->with_text) {
+                const uint8_t* bytes = leaf_node_value(source, i);
+                uint32_t username_length = bytes[0];
+                scan->usernames[count].data = (const char*)bytes + 1;
+                scan->usernames[count].length = username_length;
+                scan->emails[count].data = (const char*)bytes + 2 + username_length;
+                scan->emails[count].length = bytes[1 + username_length];
+            }
+        }
+        cursor->cell_num = end;
+        pager_release_pins(pager, mark);
+
+        if (past_high) {
+            cursor->end_of_table = true;
+        } else if (cursor_next_leaf(cursor)) {
+            cursor_update_path(cursor);
+            cursor_prefetch(cursor);
+        }
+        if (count > 0) {
+            scan->batch.count = count;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 只留下文本列等于 value 的行，直接比较负载中的字节。
+ */
+void scan_filter_text(ScanOperator* scan, IndexColumn column, const char* value) {
+    uint32_t length = strlen(value);
+    const DbText* texts = column == INDEX_COLUMN_USERNAME ? scan->usernames : scan->emails;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < scan->batch.count; i++) {
+        if (texts[i].length == length && memcmp(texts[i].data, value, length) == 0) {
+            scan->ids[kept] = scan->ids[i];
+            scan->usernames[kept] = scan->usernames[i];
+            scan->emails[kept] = scan->emails[i];
+            kept++;
+        }
+    }
+    scan->batch.count = kept;
+}
+
+/*******************************************************************
+ * 后端 二级索引
+ *******************************************************************/
+
+void* table_meta_page(Table* table);
+uint32_t get_unused_page_num(Table* table);
+void free_page(Table* table, uint32_t page_num);
+uint32_t tree_path_page(TreePath* path, uint32_t level);
+
+/**
+ * 索引的键。value 指向列值，不以 '\0' 结尾；分隔键的 value 可能只是列值的前缀。
+ */
+typedef struct {
+    const uint8_t* value;
+    uint32_t length;
+    uint64_t id;
+} IndexKey;
+
+// 节点中一个单元格的原始字节，含 [子节点][id] 单元格头
+typedef struct {
+    const uint8_t* data;
+    uint32_t size;
+} IndexCell;
+
+typedef struct {
+    uint64_t* ids;
+    uint32_t count;
+    uint32_t capacity;
+} IdList;
+
+void id_list_init(IdList* list) {
+    list->ids = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void id_list_push(IdList* list, uint64_t id) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        list->ids = realloc(list->ids, sizeof(uint64_t) * list->capacity);
+    }
+    list->ids[list->count++] = id;
+}
+
+void id_list_free(IdList* list) {
+    free(list->ids);
+    id_list_init(list);
+}
+
+const char* row_column_value(const Row* row, IndexColumn column) {
+    return column == INDEX_COLUMN_USERNAME ? row->username : row->email;
+}
+
+uint32_t index_column_size(IndexColumn column) {
+    return column == INDEX_COLUMN_USERNAME ? COLUMN_USERNAME_SIZE : COLUMN_EMAIL_SIZE;
+}
+
+const char* index_column_name(IndexColumn column) {
+    return column == INDEX_COLUMN_USERNAME ? "username" : "email";
+}
+
+IndexKey index_row_key(const Row* row, IndexColumn column) {
+    IndexKey key;
+    key.value = (const uint8_t*)row_column_value(row, column);
+    key.length = strlen(row_column_value(row, column));
+    key.id = row->id;
+    return key;
+}
+
+uint32_t* index_node_num_cells(void* node) {
+    return node + INDEX_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t* index_node_link(void* node) {
+    return node + INDEX_NODE_LINK_OFFSET;
+}
+
+uint16_t* index_node_content_start(void* node) {
+    return node + INDEX_NODE_CONTENT_START_OFFSET;
+}
+
+uint16_t* index_node_cell_offset(void* node, uint32_t cell_num) {
+    return node + INDEX_NODE_HEADER_SIZE + cell_num * INDEX_NODE_SLOT_SIZE;
+}
+
+uint16_t* index_node_cell_size(void* node, uint32_t cell_num) {
+    return (void*)index_node_cell_offset(node, cell_num) + sizeof(uint16_t);
+}
+
+uint32_t index_node_free_space(void* node) {
+    return decode_content_start(*index_node_content_start(node)) - INDEX_NODE_HEADER_SIZE -
+           *index_node_num_cells(node) * INDEX_NODE_SLOT_SIZE;
+}
+
+void initialize_index_node(void* node, NodeType type) {
+    set_node_type(node, type);
+    set_node_root(node, false);
+    *index_node_num_cells(node) = 0;
+    *index_node_link(node) = 0;
+    *index_node_content_start(node) = PAGE_SIZE;
+}
+
+uint32_t index_cell_header_size(NodeType type) {
+    return type == NODE_INDEX_LEAF ? INDEX_LEAF_CELL_HEADER_SIZE
+                                   : INDEX_INTERNAL_CELL_HEADER_SIZE;
+}
+
+IndexCell index_node_get_cell(void* node, uint32_t cell_num) {
+    IndexCell cell;
+    cell.data = node + *index_node_cell_offset(node, cell_num);
+    cell.size = *index_node_cell_size(node, cell_num);
+    return cell;
+}
+
+// 单元格按字节紧密排列，其中的整数不一定对齐，一律用 memcpy 读写
+IndexKey index_cell_key(NodeType type, IndexCell cell) {
+    uint32_t header_size = index_cell_header_size(type);
+    IndexKey key;
+    memcpy(&key.id, cell.data + header_size - sizeof(uint64_t), sizeof(uint64_t));
+    key.value = cell.data + header_size;
+    key.length = cell.size - header_size;
+    return key;
+}
+
+IndexKey index_node_key(void* node, uint32_t cell_num) {
+    return index_cell_key(get_node_type(node), index_node_get_cell(node, cell_num));
+}
+
+/**
+ * 内部节点的第 child_num 个子节点，child_num 等于单元格数时为右子节点。
+ */
+uint32_t index_node_child(void* node, uint32_t child_num) {
+    if (child_num == *index_node_num_cells(node)) {
+        return *index_node_link(node);
+    }
+    uint32_t child;
+    memcpy(&child, index_node_get_cell(node, child_num).data, sizeof(uint32_t));
+    return child;
+}
+
+void index_node_set_child(void* node, uint32_t child_num, uint32_t child) {
+    if (child_num == *index_node_num_cells(node)) {
+        *index_node_link(node) = child;
+    } else {
+        memcpy(node + *index_node_cell_offset(node, child_num), &child, sizeof(uint32_t));
+    }
+}
+
+/**
+ * 把键编码成 type 节点的单元格写入 buffer，内部节点的单元格指向 child。
+ */
+IndexCell index_encode_cell(NodeType type, IndexKey key, uint32_t child, uint8_t* buffer) {
+    uint32_t header_size = index_cell_header_size(type);
+    if (type == NODE_INDEX_INTERNAL) {
+        memcpy(buffer, &child, sizeof(uint32_t));
+    }
+    memcpy(buffer + header_size - sizeof(uint64_t), &key.id, sizeof(uint64_t));
+    memcpy(buffer + header_size, key.value, key.length);
+    IndexCell cell;
+    cell.data = buffer;
+    cell.size = header_size + key.length;
+    return cell;
+}
+
+// 只比较列值
+int index_value_compare(IndexKey a, IndexKey b) {
+    uint32_t length = a.length < b.length ? a.length : b.length;
+    int result = memcmp(a.value, b.value, length);
+    if (result != 0 || a.length == b.length) {
+        return result;
+    }
+    return a.length < b.length ? -1 : 1;
+}
+
+int index_key_compare(IndexKey a, IndexKey b) {
+    int result = index_value_compare(a, b);
+    if (result != 0) {
+        return result;
+    }
+    if (a.id != b.id) {
+        return a.id < b.id ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * 叶节点返回第一个不小于 key 的单元格；内部节点返回应包含 key 的子节点，
+ * 即分隔键不大于 key 的单元格个数。
+ */
+uint32_t index_node_search(void* node, IndexKey key) {
+    bool leaf = get_node_type(node) == NODE_INDEX_LEAF;
+    uint32_t low = 0;
+    uint32_t high = *index_node_num_cells(node);
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        int result = index_key_compare(index_node_key(node, mid), key);
+        if (result < 0 || (!leaf && result == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * 调用者保证 index_node_free_space 足够容纳槽位和单元格。
+ */
+void index_node_insert_cell(void* node, uint32_t cell_num, IndexCell cell) {
+    uint32_t num_cells = *index_node_num_cells(node);
+    memmove(index_node_cell_offset(node, cell_num + 1), index_node_cell_offset(node, cell_num),
+            (num_cells - cell_num) * INDEX_NODE_SLOT_SIZE);
+    uint16_t offset = decode_content_start(*index_node_content_start(node)) - cell.size;
+    memcpy(node + offset, cell.data, cell.size);
+    *index_node_content_start(node) = offset;
+
+    *index_node_cell_offset(node, cell_num) = offset;
+    *index_node_cell_size(node, cell_num) = cell.size;
+    *index_node_num_cells(node) = num_cells + 1;
+}
+
+/**
+ * 删除一个单元格，比它靠前的单元格后移填上空洞，和 leaf_node_remove_cell 一样保持紧凑。
+ */
+void index_node_remove_cell(void* node, uint32_t cell_num) {
+    uint32_t num_cells = *index_node_num_cells(node);
+    uint16_t offset = *index_node_cell_offset(node, cell_num);
+    uint16_t size = *index_node_cell_size(node, cell_num);
+    uint32_t content_start = decode_content_start(*index_node_content_start(node));
+
+    memmove(node + content_start + size, node + content_start, offset - content_start);
+    memmove(index_node_cell_offset(node, cell_num), index_node_cell_offset(node, cell_num + 1),
+            (num_cells - cell_num - 1) * INDEX_NODE_SLOT_SIZE);
+    num_cells--;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (*index_node_cell_offset(node, i) < offset) {
+            *index_node_cell_offset(node, i) += size;
+        }
+    }
+    *index_node_content_start(node) = content_start + size;
+    *index_node_num_cells(node) = num_cells;
+}
+
+void index_node_set_cells(void* node, IndexCell* cells, uint32_t count) {
+    *index_node_num_cells(node) = 0;
+    *index_node_content_start(node) = PAGE_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        index_node_insert_cell(node, i, cells[i]);
+    }
+}
+
+/**
+ * 前缀截断：left 是左半部分最大的键，right 是右半部分最小的键，
+ * 返回满足 left < S <= right 的最短分隔键 S。列值不同时取 right 的列值中
+ * 比 left 大的最短前缀，id 为 0；列值相同时只能用 right 本身。
+ */
+IndexKey index_separator(IndexKey left, IndexKey right) {
+    if (left.length == right.length && memcmp(left.value, right.value, left.length) == 0) {
+        return right;
+    }
+    uint32_t common = 0;
+    while (common < left.length && common < right.length &&
+           left.value[common] == right.value[common]) {
+        common++;
+    }
+    IndexKey separator;
+    separator.value = right.value;
+    separator.length = common + 1;
+    separator.id = 0;
+    return separator;
+}
+
+void* index_new_node(Table* table, NodeType type, uint32_t* page_num) {
+    *page_num = get_unused_page_num(table);
+    void* node = get_page(table->pager, *page_num);
+    mark_page_dirty(table->pager, *page_num);
+    initialize_index_node(node, type);
+    return node;
+}
+
+/**
+ * 写者从索引的根节点下降到应包含 key 的叶节点，沿途记录路径，节点加排他锁存。
+ * 插入时遇到放得下最大单元格、不会拆分的节点就放开它上面的祖先；
+ * 删除最多从父节点中去掉一个单元格，只锁住叶节点和父节点。锁存随调用者释放固定一起放开。
+ */
+void index_find_for_write(Table* table, uint32_t root_page_num, IndexKey key, bool insert,
+                          TreePath* path) {
+    Pager* pager = table->pager;
+    tree_path_init(path);
+
+    uint32_t page_num = root_page_num;
+    uint32_t latched_from = pager_pin_mark(pager);
+    uint32_t node_pin = latched_from;
+    void* node = get_page_latched(pager, page_num, LATCH_EXCLUSIVE);
+    while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+        if (path->depth >= BTREE_MAX_DEPTH) {
+            printf("Tree deeper than %d levels\n", BTREE_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_num = index_node_search(node, key);
+        path->pages[path->depth] = page_num;
+        path->slots[path->depth] = child_num;
+        path->depth++;
+
+        page_num = index_node_child(node, child_num);
+        uint32_t child_pin = pager_pin_mark(pager);
+        node = get_page_latched(pager, page_num, LATCH_EXCLUSIVE);
+        if (!insert) {
+            pager_release_latches(pager, latched_from, node_pin);
+            latched_from = node_pin;
+        } else if (index_node_free_space(node) >= INDEX_NODE_MAX_CELL_SIZE) {
+            pager_release_latches(pager, latched_from, child_pin);
+            latched_from = child_pin;
+        }
+        node_pin = child_pin;
+    }
+    path->leaf_page_num = page_num;
+}
+
+/**
+ * 在路径上第 level 层的节点（level == depth 时为叶节点）的 cell_num 处插入单元格。
+ * 放不下时按字节数拆成两半：叶节点把截断后的分隔键交给父节点，
+ * 内部节点把中间的单元格上移。根节点拆分时两半都移到新页面，根节点的页号不变。
+ */
+void index_node_insert_at(Table* table, TreePath* path, uint32_t level, uint32_t cell_num,
+                          IndexCell cell) {
+    Pager* pager = table->pager;
+    uint32_t page_num = tree_path_page(path, level);
+    void* node = get_page(pager, page_num);
+    if (index_node_free_space(node) >= INDEX_NODE_SLOT_SIZE + cell.size) {
+        mark_page_dirty(pager, page_num);
+        index_node_insert_cell(node, cell_num, cell);
+        return;
+    }
+
+    // 页面会被改写，单元格先指向它在栈上的副本
+    uint64_t original[PAGE_SIZE / sizeof(uint64_t)];
+    memcpy(original, node, PAGE_SIZE);
+    NodeType type = get_node_type(original);
+    bool leaf = type == NODE_INDEX_LEAF;
+
+    uint32_t count = *index_node_num_cells(original) + 1;
+    IndexCell cells[INDEX_NODE_MAX_CELLS + 1];
+    uint32_t total_size = 0;
+    for (uint32_t i = 0, j = 0; i < count; i++) {
+        cells[i] = i == cell_num ? cell : index_node_get_cell(original, j++);
+        total_size += INDEX_NODE_SLOT_SIZE + cells[i].size;
+    }
+    uint32_t split = 0;
+    uint32_t left_size = 0;
+    while (split + 1 < count &&
+           left_size + INDEX_NODE_SLOT_SIZE + cells[split].size <= total_size / 2) {
+        left_size += INDEX_NODE_SLOT_SIZE + cells[split].size;
+        split++;
+    }
+    if (split == 0) {
+        split = 1;
+    }
+    if (!leaf && split + 1 >= count) {
+        split = count - 2;
+    }
+
+    // 叶节点从 split 开始分给右边；内部节点的第 split 个单元格上移，它的子节点成为左边的右子节点
+    IndexKey separator;
+    uint32_t right_first;
+    uint32_t left_link;
+    if (leaf) {
+        separator = index_separator(index_cell_key(type, cells[split - 1]),
+                                    index_cell_key(type, cells[split]));
+        right_first = split;
+    } else {
+        separator = index_cell_key(type, cells[split]);
+        right_first = split + 1;
+        memcpy(&left_link, cells[split].data, sizeof(uint32_t));
+    }
+
+    uint32_t left_page_num = page_num;
+    void* left;
+    if (level == 0) {
+        left = index_new_node(table, type, &left_page_num);
+    } else {
+        left = node;
+        mark_page_dirty(pager, page_num);
+        initialize_index_node(left, type);
+    }
+    uint32_t right_page_num;
+    void* right = index_new_node(table, type, &right_page_num);
+    index_node_set_cells(left, cells, split);
+    index_node_set_cells(right, cells + right_first, count - right_first);
+    if (!leaf) {
+        *index_node_link(left) = left_link;
+        *index_node_link(right) = *index_node_link(original);
+    }
+
+    uint8_t buffer[INDEX_NODE_MAX_CELL_SIZE];
+    IndexCell separator_cell =
+        index_encode_cell(NODE_INDEX_INTERNAL, separator, left_page_num, buffer);
+    if (level == 0) {
+        mark_page_dirty(pager, page_num);
+        initialize_index_node(node, NODE_INDEX_INTERNAL);
+        set_node_root(node, true);
+        index_node_insert_cell(node, 0, separator_cell);
+        *index_node_link(node) = right_page_num;
+        return;
+    }
+
+    // 父节点中原来指向这个节点的位置改指右半部分，左半部分带着分隔键插在它前面
+    uint32_t parent_page_num = path->pages[level - 1];
+    uint32_t slot = path->slots[level - 1];
+    void* parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    index_node_set_child(parent, slot, right_page_num);
+    index_node_insert_at(table, path, level - 1, slot, separator_cell);
+}
+
+void index_insert(Table* table, uint32_t root_page_num, IndexKey key) {
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    TreePath path;
+    index_find_for_write(table, root_page_num, key, true, &path);
+    void* leaf = get_page(pager, path.leaf_page_num);
+    uint8_t buffer[INDEX_NODE_MAX_CELL_SIZE];
+    index_node_insert_at(table, &path, path.depth, index_node_search(leaf, key),
+                         index_encode_cell(NODE_INDEX_LEAF, key, 0, buffer));
+    pager_release_pins(pager, mark);
+}
+
+/**
+ * 删除键。删空的叶节点从父节点中摘下并释放，父节点只剩它一个子节点时留着。
+ * 节点不与兄弟节点合并。
+ */
+void index_remove(Table* table, uint32_t root_page_num, IndexKey key) {
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    TreePath path;
+    index_find_for_write(table, root_page_num, key, false, &path);
+    void* leaf = get_page(pager, path.leaf_page_num);
+    uint32_t cell_num = index_node_search(leaf, key);
+    if (cell_num >= *index_node_num_cells(leaf) ||
+        index_key_compare(index_node_key(leaf, cell_num), key) != 0) {
+        printf("Index entry for id %" PRIu64 " is missing\n", key.id);
+        exit(EXIT_FAILURE);
+    }
+    mark_page_dirty(pager, path.leaf_page_num);
+    index_node_remove_cell(leaf, cell_num);
+
+    if (*index_node_num_cells(leaf) == 0 && path.depth > 0) {
+        uint32_t parent_page_num = path.pages[path.depth - 1];
+        uint32_t slot = path.slots[path.depth - 1];
+        void* parent = get_page(pager, parent_page_num);
+        uint32_t num_cells = *index_node_num_cells(parent);
+        if (num_cells > 0) {
+            // 去掉右子节点时由最后一个单元格的子节点接替
+            mark_page_dirty(pager, parent_page_num);
+            if (slot == num_cells) {
+                *index_node_link(parent) = index_node_child(parent, num_cells - 1);
+                slot = num_cells - 1;
+            }
+            index_node_remove_cell(parent, slot);
+            free_page(table, path.leaf_page_num);
+        }
+    }
+    pager_release_pins(pager, mark);
+}
+
+/**
+ * 在快照中找出列值等于 value 的所有行的 id，按 id 排序。下降时耦合共享锁存；
+ * 读完一个叶节点后，上界的列值仍不大于 value 时从上界重新下降，读下一个叶节点。
+ * 返回前放开全部锁存，调用者再去表中读这些行，不会在持有索引的锁存时等待表的页面。
+ */
+void index_lookup(Table* table, uint32_t root_page_num, const char* value, uint64_t snapshot,
+                  IdList* ids) {
+    Pager* pager = table->pager;
+    IndexKey key;
+    key.value = (const uint8_t*)value;
+    key.length = strlen(value);
+    key.id = 0;
+
+    // 放开父节点的锁存之后它可能被修改，上界要在持有锁存时复制出来
+    uint8_t seek_value[COLUMN_EMAIL_SIZE];
+    uint8_t upper_bound_value[COLUMN_EMAIL_SIZE];
+    IndexKey seek = key;
+    while (true) {
+        uint32_t mark = pager_pin_mark(pager);
+        uint32_t node_pin = mark;
+        bool has_upper_bound = false;
+        IndexKey upper_bound;
+        void* node = get_page_snapshot(pager, root_page_num, snapshot);
+        while (get_node_type(node) == NODE_INDEX_INTERNAL) {
+            uint32_t child_num = index_node_search(node, seek);
+            // 越往下的分隔键越接近，直接覆盖上层的上界
+            if (child_num < *index_node_num_cells(node)) {
+                has_upper_bound = true;
+                upper_bound = index_node_key(node, child_num);
+                memcpy(upper_bound_value, upper_bound.value, upper_bound.length);
+                upper_bound.value = upper_bound_value;
+            }
+            uint32_t page_num = index_node_child(node, child_num);
+            uint32_t child_pin = pager_pin_mark(pager);
+            node = get_page_snapshot(pager, page_num, snapshot);
+            pager_release_latches(pager, node_pin, child_pin);
+            node_pin = child_pin;
+        }
+
+        bool done = !has_upper_bound || index_value_compare(upper_bound, key) > 0;
+        uint32_t num_cells = *index_node_num_cells(node);
+        for (uint32_t i = index_node_search(node, seek); i < num_cells; i++) {
+            IndexKey found = index_node_key(node, i);
+            if (index_value_compare(found, key) != 0) {
+                done = true;
+                break;
+            }
+            id_list_push(ids, found.id);
+        }
+        if (!done) {
+            memcpy(seek_value, upper_bound.value, upper_bound.length);
+            seek = upper_bound;
+            seek.value = seek_value;
+        }
+        pager_release_pins(pager, mark);
+        if (done) {
+            return;
+        }
+    }
+}
+
+/**
+ * 读者用的索引根节点：没有索引，或者快照早于建索引的事务时返回 0。
+ */
+uint32_t index_root_for_snapshot(Table* table, IndexColumn column, uint64_t snapshot) {
+    uint32_t root_page_num = __atomic_load_n(&table->index_roots[column], __ATOMIC_ACQUIRE);
+    if (root_page_num == 0 ||
+        snapshot < __atomic_load_n(&table->index_created[column], __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return root_page_num;
+}
+
+/**
+ * 写者维护表上已有的索引，与表的修改在同一个事务中提交。
+ */
+void index_insert_row(Table* table, const Row* row) {
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (table->index_roots[i] != 0) {
+            index_insert(table, table->index_roots[i], index_row_key(row, i));
+        }
+    }
+}
+
+void index_remove_row(Table* table, const Row* row) {
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (table->index_roots[i] != 0) {
+            index_remove(table, table->index_roots[i], index_row_key(row, i));
+        }
+    }
+}
+
+void index_update_row(Table* table, const Row* old_row, const Row* new_row) {
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (table->index_roots[i] != 0 &&
+            strcmp(row_column_value(old_row, i), row_column_value(new_row, i)) != 0) {
+            index_remove(table, table->index_roots[i], index_row_key(old_row, i));
+            index_insert(table, table->index_roots[i], index_row_key(new_row, i));
+        }
+    }
+}
+
+bool table_has_index(Table* table) {
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (table->index_roots[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 把表中已有的行逐个插入刚建好的空索引。
+ */
+void index_build(Table* table, IndexColumn column) {
+    Cursor cursor;
+    table_start(table, SNAPSHOT_LATEST, &cursor);
+    Row row;
+    while (!cursor.end_of_table) {
+        cursor_read_row(&cursor, &row);
+        index_insert(table, table->index_roots[column], index_row_key(&row, column));
+        cursor_advance(&cursor);
+    }
+}
+
+/*******************************************************************
+ * 输入缓冲区的构造和释放，打印提示，读取输入
+ *******************************************************************/
+
+#define INPUT_CHUNK_SIZE 65536
+
+InputBuffer* new_input_buffer() {
+    InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->input_length = 0;
+    input_buffer->capacity = INPUT_CHUNK_SIZE;
+    input_buffer->data = malloc(input_buffer->capacity);
+    input_buffer->start = 0;
+    input_buffer->end = 0;
+
+    return input_buffer;
+}
+
+void print_prompt() {
+    printf("db > ");
+}
+
+/**
+ * 缓冲区中没有完整的一行、标准输入上也没有可读的数据时，读下一行要等待输入。
+ */
+bool input_buffer_would_block(InputBuffer* input_buffer) {
+    if (memchr(input_buffer->data + input_buffer->start, '\n',
+               input_buffer->end - input_buffer->start) != NULL) {
+        return false;
+    }
+    struct pollfd stdin_poll = {.fd = STDIN_FILENO, .events = POLLIN};
+    return poll(&stdin_poll, 1, 0) == 0;
+}
+
+/**
+ * 取出下一行，输入结束时返回 false。缓冲区中没有完整的一行时才读标准输入，
+ * 一次读一整块；读之前刷新标准输出，交互使用时提示和上一条语句的输出先显示出来。
+ * 最后一行没有换行符时到文件末尾为止。
+ */
+bool read_input(InputBuffer* input_buffer) {
+    char* newline;
+    while ((newline = memchr(input_buffer->data + input_buffer->start, '\n',
+                             input_buffer->end - input_buffer->start)) == NULL) {
+        // 把剩下的半行移到开头，一行比整个缓冲区还长时扩大缓冲区
+        size_t remaining = input_buffer->end - input_buffer->start;
+        memmove(input_buffer->data, input_buffer->data + input_buffer->start, remaining);
+        input_buffer->start = 0;
+        input_buffer->end = remaining;
+        if (remaining == input_buffer->capacity) {
+            input_buffer->capacity *= 2;
+            input_buffer->data = realloc(input_buffer->data, input_buffer->capacity);
+        }
+
+        fflush(stdout);
+        ssize_t bytes_read = read(STDIN_FILENO, input_buffer->data + remaining,
+                                  input_buffer->capacity - remaining);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (remaining == 0) {
+                return false;
+            }
+            // 补上换行符，上面保证了缓冲区没有满
+            input_buffer->data[input_buffer->end++] = '\n';
+            continue;
+        }
+        input_buffer->end += bytes_read;
+    }
+
+    input_buffer->buffer = input_buffer->data + input_buffer->start;
+    input_buffer->input_length = newline - input_buffer->buffer;
+    *newline = '\0';
+    input_buffer->start = newline + 1 - input_buffer->data;
+    return true;
+}
+
+void close_input_buffer(InputBuffer* input_buffer) {
+    free(input_buffer->data);
+    free(input_buffer);
+}
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+OutputBuffer* new_output_buffer() {
+    OutputBuffer* output = malloc(sizeof(OutputBuffer));
+    output->mode = OUTPUT_MODE_TEXT;
+    output->capacity = OUTPUT_BUFFER_SIZE;
+    output->data = malloc(output->capacity);
+    output->length = 0;
+    return output;
+}
+
+/**
+ * 先刷新 stdio 中的提示等文本，再写出攒下的二进制数据，两者在输出中的顺序不变。
+ */
+void output_buffer_flush(OutputBuffer* output) {
+    fflush(stdout);
+    uint32_t written = 0;
+    while (written < output->length) {
+        ssize_t bytes = write(STDOUT_FILENO, output->data + written, output->length - written);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            printf("Error writing output: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        written += bytes;
+    }
+    output->length = 0;
+}
+
+void output_buffer_append(OutputBuffer* output, const void* data, uint32_t length) {
+    if (output->length + length > output->capacity) {
+        output_buffer_flush(output);
+    }
+    memcpy(output->data + output->length, data, length);
+    output->length += length;
+}
+
+/*******************************************************************
+ * 元命令
+ *******************************************************************/
+
+void indent(uint32_t level) {
+    for (uint32_t i = 0; i < level; i++) {
+        printf("  ");
+    }
+}
+
+void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
+    uint32_t mark = pager_pin_mark(pager);
+    void* node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch (get_node_type(node)) {
+        case (NODE_LEAF):
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                indent(indentation_level + 1);
+                printf("- %" PRIu64 "\n", leaf_node_key(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+            if (num_keys > 0) {
+                for (uint32_t i = 0; i < num_keys; i++) {
+                    child = *internal_node_child(node, i);
+                    print_tree(pager, child, indentation_level + 1);
+
+                    indent(indentation_level + 1);
+                    printf("- key %" PRIu64 "\n", internal_node_key(node, i));
+                }
+                child = *internal_node_right_child(node);
+                print_tree(pager, child, indentation_level + 1);
+            }
+            break;
+        case (NODE_INDEX_LEAF):
+            num_keys = *index_node_num_cells(node);
+            indent(indentation_level);
+            printf("- leaf (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                IndexKey key = index_node_key(node, i);
+                indent(indentation_level + 1);
+                printf("- %.*s %" PRIu64 "\n", key.length, key.value, key.id);
+            }
+            break;
+        case (NODE_INDEX_INTERNAL):
+            num_keys = *index_node_num_cells(node);
+            indent(indentation_level);
+            printf("- internal (size %d)\n", num_keys);
+            for (uint32_t i = 0; i < num_keys; i++) {
+                print_tree(pager, index_node_child(node, i), indentation_level + 1);
+                IndexKey key = index_node_key(node, i);
+                indent(indentation_level + 1);
+                printf("- key %.*s %" PRIu64 "\n", key.length, key.value, key.id);
+            }
+            print_tree(pager, *index_node_link(node), indentation_level + 1);
+            break;
+        case (NODE_FREE):
+        case (NODE_META):
+            break;
+    }
+    pager_release_pins(pager, mark);
+}
+
+void print_constants() {
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    printf("LEAF_NODE_MAX_CELL_SIZE: %d\n", LEAF_NODE_MAX_CELL_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+}
+
+void bulk_import(Table* table, const char* path, uint32_t fill_percent);
+
+void print_stats(Table* table) {
+    DbStats stats;
+    db_stats(table, &stats);
+    DbTreeStats tree;
+    db_tree_stats(table, &tree);
+    printf("cache_hits: %" PRIu64 "\n", stats.cache_hits);
+    printf("cache_misses: %" PRIu64 "\n", stats.cache_misses);
+    printf("evictions: %" PRIu64 "\n", stats.evictions);
+    printf("bytes_read: %" PRIu64 "\n", stats.bytes_read);
+    printf("bytes_written: %" PRIu64 "\n", stats.bytes_written);
+    printf("fsyncs: %" PRIu64 "\n", stats.fsyncs);
+    printf("leaf_splits: %" PRIu64 "\n", stats.leaf_splits);
+    printf("internal_splits: %" PRIu64 "\n", stats.internal_splits);
+    printf("row_cache_hits: %" PRIu64 "\n", stats.row_cache_hits);
+    printf("row_cache_misses: %" PRIu64 "\n", stats.row_cache_misses);
+    printf("tree_height: %u\n", tree.height);
+    printf("leaf_pages: %u\n", tree.leaf_pages);
+    printf("rows: %" PRIu64 "\n", tree.rows);
+    printf("leaf_fill: %.2f\n", tree.leaf_fill);
+
+    const char* phase_names[DB_NUM_PHASES] = {"prepare", "execute"};
+    for (uint32_t phase = 0; phase < DB_NUM_PHASES; phase++) {
+        printf("%s: %" PRIu64 " statements, %" PRIu64 " us\n", phase_names[phase],
+               stats.phase_count[phase], stats.phase_nanos[phase] / 1000);
+        // 只打印非空的桶，上界为开区间
+        for (uint32_t i = 0; i < DB_STATS_HISTOGRAM_BUCKETS; i++) {
+            uint64_t count = stats.phase_histogram[phase][i];
+            if (count == 0) {
+                continue;
+            }
+            if (i == DB_STATS_HISTOGRAM_BUCKETS - 1) {
+                printf("  >= %" PRIu64 " us: %" PRIu64 "\n", (uint64_t)1 << (i - 1), count);
+            } else {
+                printf("  < %" PRIu64 " us: %" PRIu64 "\n", (uint64_t)1 << i, count);
+            }
+        }
+    }
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, OutputBuffer* output,
+                                  Table* table) {
+    if (strcmp(input_buffer->buffer, ".exit") == 0) {
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+        printf("Tree:\n");
+        print_tree(table->pager, table->root_page_num, 0);
+        for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+            if (table->index_roots[i] != 0) {
+                printf("Index on %s:\n", index_column_name(i));
+                print_tree(table->pager, table->index_roots[i], 0);
+            }
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+        printf("Constants:\n");
+        print_constants();
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".stats") == 0) {
+        printf("Stats:\n");
+        print_stats(table);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".mode text") == 0) {
+        output->mode = OUTPUT_MODE_TEXT;
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".mode binary") == 0) {
+        output->mode = OUTPUT_MODE_BINARY;
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".mode", 5) == 0 &&
+               (input_buffer->buffer[5] == '\0' || input_buffer->buffer[5] == ' ')) {
+        printf("Usage: .mode text|binary\n");
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer->buffer, ".import ", 8) == 0) {
+        strtok(input_buffer->buffer, " ");
+        char* path = strtok(NULL, " ");
+        char* fill_string = strtok(NULL, " ");
+        uint32_t fill_percent = 100;
+        if (fill_string != NULL) {
+            fill_percent = atoi(fill_string);
+        }
+        if (path == NULL || fill_percent < 1 || fill_percent > 100) {
+            printf("Usage: .import FILE [FILL_PERCENT]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        if (txn_table == table) {
+            printf("Error: Cannot import inside a transaction.\n");
+            return META_COMMAND_SUCCESS;
+        }
+        pthread_mutex_lock(&table->write_lock);
+        bulk_import(table, path, fill_percent);
+        pthread_mutex_unlock(&table->write_lock);
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer->buffer, ".bench") == 0 ||
+               strncmp(input_buffer->buffer, ".bench ", 7) == 0) {
+        // 在临时文件上运行，不碰当前的表；缓冲池大小与当前的表相同
+        strtok(input_buffer->buffer, " ");
+        char* rows_string = strtok(NULL, " ");
+        uint32_t num_rows = rows_string != NULL ? atoi(rows_string) : 10000;
+        if (num_rows == 0) {
+            printf("Usage: .bench [ROWS]\n");
+            return META_COMMAND_SUCCESS;
+        }
+        char path[] = "/tmp/db-bench-XXXXXX";
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            printf("Unable to create benchmark file\n");
+            return META_COMMAND_SUCCESS;
+        }
+        close(fd);
+        DbOptions options = db_default_options();
+        options.cache_frames = table->pager->frame_limit;
+        options.page_size = PAGE_SIZE;
+        db_bench(path, num_rows, options);
+        return META_COMMAND_SUCCESS;
+    } else {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+/*******************************************************************
+ * 前端，SQL 编译器
+ *******************************************************************/
+
+void statement_add_param(Statement* statement, ParamTarget target) {
+    statement->params[statement->num_params++] = target;
+}
+
+PrepareResult statement_set_text(char* destination, const char* value, size_t max_length) {
+    if (strlen(value) > max_length) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    strcpy(destination, value);
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 与 statement_set_text 相同，长度已经由分词得到。
+ */
+PrepareResult statement_set_text_length(char* destination, const char* value, size_t length,
+                                        size_t max_length) {
+    if (length > max_length) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    memcpy(destination, value, length + 1);
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * id 是 64 位无符号的十进制整数，超出范围是语法错误。
+ * 负号单独检查，-0 就是 0。逐位累加，溢出在乘 10 之前判断。
+ */
+PrepareResult parse_id(char* string, uint64_t* id) {
+    if (string == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    bool negative = *string == '-';
+    char* digits = negative ? string + 1 : string;
+    if (*digits == '\0') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    uint64_t value = 0;
+    for (char* p = digits; *p != '\0'; p++) {
+        uint32_t digit = (uint32_t)(*p - '0');
+        if (digit > 9 || value > (UINT64_MAX - digit) / 10) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        value = value * 10 + digit;
+    }
+    if (negative && value > 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    *id = value;
+    return PREPARE_SUCCESS;
+}
+
+void statement_free_rows(Statement* statement) {
+    free(statement->rows);
+    statement->rows = NULL;
+}
+
+char* skip_spaces(char* p) {
+    while (*p == ' ') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * 原地取出 *p 处以空格分隔的下一个词，在词尾写 '\0'，长度写入 length。
+ * 与 strtok_r 的结果相同，但只扫描一遍，后面不必再 strlen。没有词时返回 NULL。
+ */
+char* next_token(char** p, size_t* length) {
+    char* start = skip_spaces(*p);
+    if (*start == '\0') {
+        *p = start;
+        return NULL;
+    }
+    char* end = start;
+    while (*end != ' ' && *end != '\0') {
+        end++;
+    }
+    *length = end - start;
+    *p = *end == '\0' ? end : end + 1;
+    *end = '\0';
+    return start;
+}
+
+/**
+ * 从 *p 开始读取一个以 delimiter 结束的值，去掉两端空格后原地截断。
+ */
+char* parse_value(char** p, char delimiter) {
+    char* start = skip_spaces(*p);
+    char* end = strchr(start, delimiter);
+    if (end == NULL) {
+        return NULL;
+    }
+    *p = end + 1;
+    while (end > start && end[-1] == ' ') {
+        end--;
+    }
+    *end = '\0';
+    return start;
+}
+
+PrepareResult parse_values_row(char** p, Row* row) {
+    *p = skip_spaces(*p);
+    if (**p != '(') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    (*p)++;
+    char* id_string = parse_value(p, ',');
+    char* username = id_string != NULL ? parse_value(p, ',') : NULL;
+    char* email = username != NULL ? parse_value(p, ')') : NULL;
+    if (email == NULL || *username == '\0' || *email == '\0') {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = parse_id(id_string, &row->id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+    if (statement_set_text(row->username, username, COLUMN_USERNAME_SIZE) != PREPARE_SUCCESS ||
+        statement_set_text(row->email, email, COLUMN_EMAIL_SIZE) != PREPARE_SUCCESS) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * insert values (ID, USERNAME, EMAIL), (ID, USERNAME, EMAIL), ...
+ * 一条语句插入多行，不支持占位符。p 指向 values 之后。
+ */
+PrepareResult prepare_insert_values(char* p, Statement* statement) {
+    uint32_t capacity = 16;
+    statement->rows = malloc(sizeof(Row) * capacity);
+    statement->num_rows = 0;
+    while (true) {
+        if (statement->num_rows == capacity) {
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, sizeof(Row) * capacity);
+        }
+        PrepareResult result = parse_values_row(&p, &statement->rows[statement->num_rows]);
+        if (result != PREPARE_SUCCESS) {
+            statement_free_rows(statement);
+            return result;
+        }
+        statement->num_rows++;
+
+        p = skip_spaces(p);
+        if (*p == '\0') {
+            return PREPARE_SUCCESS;
+        }
+        if (*p != ',') {
+            statement_free_rows(statement);
+            return PREPARE_SYNTAX_ERROR;
+        }
+        p++;
+    }
+}
+
+/**
+ * insert ID USERNAME EMAIL，每一项都可以是占位符 ?
+ * 解析会改写 sql。这是导入脚本中最多的语句，用 next_token 一遍扫描分词。
+ */
+PrepareResult prepare_insert(char* sql, Statement* statement) {
+    statement->type = STATEMENT_INSERT;
+    statement->rows = NULL;
+    statement->num_rows = 1;
+
+    char* values = skip_spaces(sql + strlen("insert"));
+    if (strncmp(values, "values", 6) == 0 && (values[6] == ' ' || values[6] == '(')) {
+        return prepare_insert_values(values + 6, statement);
+    }
+
+    char* p = sql;
+    size_t length;
+    size_t username_length;
+    size_t email_length;
+    next_token(&p, &length);
+    char* id_string = next_token(&p, &length);
+    char* username = id_string != NULL ? next_token(&p, &username_length) : NULL;
+    char* email = username != NULL ? next_token(&p, &email_length) : NULL;
+
+    if (email == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(id_string, "?") == 0) {
+        statement_add_param(statement, PARAM_ID);
+    } else {
+        PrepareResult result = parse_id(id_string, &statement->row_to_insert.id);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    }
+    if (strcmp(username, "?") == 0) {
+        statement_add_param(statement, PARAM_USERNAME);
+    } else if (statement_set_text_length(statement->row_to_insert.username, username,
+                                         username_length,
+                                         COLUMN_USERNAME_SIZE) != PREPARE_SUCCESS) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    if (strcmp(email, "?") == 0) {
+        statement_add_param(statement, PARAM_EMAIL);
+    } else if (statement_set_text_length(statement->row_to_insert.email, email, email_length,
+                                         COLUMN_EMAIL_SIZE) != PREPARE_SUCCESS) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_select_operand(char* string, Statement* statement, uint32_t index) {
+    if (string != NULL && strcmp(string, "?") == 0) {
+        statement_add_param(statement, PARAM_SELECT_OPERAND_0 + index);
+        return PREPARE_SUCCESS;
+    }
+    return parse_id(string, &statement->select_operands[index]);
+}
+
+/**
+ * where id = K | id > K | id >= K | id < K | id <= K
+ * where id between A and B
+ * where username = V | email = V
+ * K、A、B、V 都可以是占位符 ?。where 是 strtok_r 已经取出的下一个词，
+ * 为 NULL 时没有条件，选中所有行。
+ */
+PrepareResult parse_where(char* where, char** save_pointer, Statement* statement) {
+    statement->select_op = SELECT_ALL;
+    if (where == NULL) {
+        return PREPARE_SUCCESS;
+    }
+    char* save = *save_pointer;
+    char* column = strtok_r(NULL, " ", &save);
+    char* op = strtok_r(NULL, " ", &save);
+    if (strcmp(where, "where") != 0 || column == NULL || op == NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(column, "username") == 0 || strcmp(column, "email") == 0) {
+        // 文本列只支持等值比较
+        statement->select_op = SELECT_COLUMN_EQUAL;
+        statement->column =
+            strcmp(column, "username") == 0 ? INDEX_COLUMN_USERNAME : INDEX_COLUMN_EMAIL;
+        char* value = strtok_r(NULL, " ", &save);
+        if (strcmp(op, "=") != 0 || value == NULL || strtok_r(NULL, " ", &save) != NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (strcmp(value, "?") == 0) {
+            statement_add_param(statement, PARAM_WHERE_VALUE);
+        } else if (statement_set_text(statement->where_value, value,
+                                      index_column_size(statement->column)) !=
+                   PREPARE_SUCCESS) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        *save_pointer = save;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(column, "id") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (strcmp(op, "between") == 0) {
+        statement->select_op = SELECT_BETWEEN;
+    } else if (strcmp(op, "=") == 0) {
+        statement->select_op = SELECT_EQUAL;
+    } else if (strcmp(op, ">=") == 0) {
+        statement->select_op = SELECT_GREATER_EQUAL;
+    } else if (strcmp(op, "<=") == 0) {
+        statement->select_op = SELECT_LESS_EQUAL;
+    } else if (strcmp(op, ">") == 0) {
+        statement->select_op = SELECT_GREATER;
+    } else if (strcmp(op, "<") == 0) {
+        statement->select_op = SELECT_LESS;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    PrepareResult result = parse_select_operand(strtok_r(NULL, " ", &save), statement, 0);
+    if (result != PREPARE_SUCCESS) {
+        return result;
+    }
+    if (statement->select_op == SELECT_BETWEEN) {
+        char* and = strtok_r(NULL, " ", &save);
+        if (and == NULL || strcmp(and, "and") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        result = parse_select_operand(strtok_r(NULL, " ", &save), statement, 1);
+        if (result != PREPARE_SUCCESS) {
+            return result;
+        }
+    }
+
+    if (strtok_r(NULL, " ", &save) != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *save_pointer = save;
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * select [* | id | count(*) | min(id) | max(id)] [where ...]
+ */
+PrepareResult prepare_select(char* sql, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    char* save;
+    strtok_r(sql, " ", &save);
+    char* token = strtok_r(NULL, " ", &save);
+    if (token != NULL && strcmp(token, "where") != 0) {
+        if (strcmp(token, "id") == 0) {
+            statement->projection = PROJECT_ID;
+        } else if (strcmp(token, "count(*)") == 0) {
+            statement->projection = PROJECT_COUNT;
+        } else if (strcmp(token, "min(id)") == 0) {
+            statement->projection = PROJECT_MIN;
+        } else if (strcmp(token, "max(id)") == 0) {
+            statement->projection = PROJECT_MAX;
+        } else if (strcmp(token, "*") != 0) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        token = strtok_r(NULL, " ", &save);
+    }
+    return parse_where(token, &save, statement);
+}
+
+/**
+ * delete [where ...]
+ */
+PrepareResult prepare_delete(char* sql, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    char* save;
+    strtok_r(sql, " ", &save);
+    return parse_where(strtok_r(NULL, " ", &save), &save, statement);
+}
+
+/**
+ * update set username = USERNAME, email = EMAIL [where ...]
+ * 可以只改其中一列，新值可以是占位符 ?。id 是键，不能修改。
+ */
+PrepareResult prepare_update(char* sql, Statement* statement) {
+    statement->type = STATEMENT_UPDATE;
+    statement->update_username = false;
+    statement->update_email = false;
+
+    char* save;
+    strtok_r(sql, " ", &save);
+    char* set = strtok_r(NULL, " ", &save);
+    if (set == NULL || strcmp(set, "set") != 0) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    char* column = strtok_r(NULL, " ,", &save);
+    while (column != NULL && strcmp(column, "where") != 0) {
+        char* equals = strtok_r(NULL, " ,", &save);
+        char* value = strtok_r(NULL, " ,", &save);
+        if (equals == NULL || strcmp(equals, "=") != 0 || value == NULL) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        char* destination;
+        size_t max_length;
+        ParamTarget target;
+        if (strcmp(column, "username") == 0 && !statement->update_username) {
+            statement->update_username = true;
+            destination = statement->row_to_insert.username;
+            max_length = COLUMN_USERNAME_SIZE;
+            target = PARAM_USERNAME;
+        } else if (strcmp(column, "email") == 0 && !statement->update_email) {
+            statement->update_email = true;
+            destination = statement->row_to_insert.email;
+            max_length = COLUMN_EMAIL_SIZE;
+            target = PARAM_EMAIL;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        if (strcmp(value, "?") == 0) {
+            statement_add_param(statement, target);
+        } else if (statement_set_text(destination, value, max_length) != PREPARE_SUCCESS) {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        column = strtok_r(NULL, " ,", &save);
+    }
+    if (!statement->update_username && !statement->update_email) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return parse_where(column, &save, statement);
+}
+
+/**
+ * create index on username | create index on email
+ */
+PrepareResult prepare_create_index(char* sql, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+    char* save;
+    strtok_r(sql, " ", &save);
+    char* index = strtok_r(NULL, " ", &save);
+    char* on = strtok_r(NULL, " ", &save);
+    char* column = strtok_r(NULL, " ", &save);
+    if (index == NULL || strcmp(index, "index") != 0 || on == NULL || strcmp(on, "on") != 0 ||
+        column == NULL || strtok_r(NULL, " ", &save) != NULL) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (strcmp(column, "username") == 0) {
+        statement->column = INDEX_COLUMN_USERNAME;
+    } else if (strcmp(column, "email") == 0) {
+        statement->column = INDEX_COLUMN_EMAIL;
+    } else {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_statement(char* sql, Statement* statement) {
+    statement->table = NULL;
+    statement->rows = NULL;
+    statement->num_params = 0;
+    statement->bound_params = 0;
+    statement->projection = PROJECT_ROWS;
+
+    if (strncmp(sql, "insert", 6) == 0) {
+        return prepare_insert(sql, statement);
+    }
+    if (strcmp(sql, "select") == 0 || strncmp(sql, "select ", 7) == 0) {
+        return prepare_select(sql, statement);
+    }
+    if (strcmp(sql, "delete") == 0 || strncmp(sql, "delete ", 7) == 0) {
+        return prepare_delete(sql, statement);
+    }
+    if (strncmp(sql, "update ", 7) == 0) {
+        return prepare_update(sql, statement);
+    }
+    if (strncmp(sql, "create ", 7) == 0) {
+        return prepare_create_index(sql, statement);
+    }
+    if (strcmp(sql, "begin") == 0) {
+        statement->type = STATEMENT_BEGIN;
+        return PREPARE_SUCCESS;
+    }
+    if (strcmp(sql, "commit") == 0) {
+        statement->type = STATEMENT_COMMIT;
+        return PREPARE_SUCCESS;
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/*******************************************************************
+ * 虚拟机
+ *******************************************************************/
+
+/**
+ * ROW_SIZE 字节的定长记录，即 .bin 导入文件的格式。叶节点改用 encode_row。
+ */
+void serialize_row(Row* source, void* destination) {
+    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
+    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
+    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+}
+
+void deserialize_row(void* source, Row* destination) {
+    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
+    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
+    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+}
+
+/**
+ * 返回固定住的元数据页，还没有时在文件末尾分配一个，并记到根节点中。
+ * 调用者照常在修改它之前调用 mark_page_dirty。
+ */
+void* table_meta_page(Table* table) {
+    Pager* pager = table->pager;
+    if (table->meta_page_num != 0) {
+        return get_page(pager, table->meta_page_num);
+    }
+    uint32_t meta_page_num = pager->num_pages;
+    void* meta = get_page(pager, meta_page_num);
+    mark_page_dirty(pager, meta_page_num);
+    memset(meta, 0, PAGE_SIZE);
+    set_node_type(meta, NODE_META);
+
+    void* root = get_page(pager, table->root_page_num);
+    mark_page_dirty(pager, table->root_page_num);
+    *root_node_meta_page(root) = meta_page_num;
+    table->meta_page_num = meta_page_num;
+    return meta;
+}
+
+/**
+ * 优先取空闲页面链表中的页面，链表为空时放在数据库文件的末尾。
+ * 调用者照常在修改返回的页面之前调用 mark_page_dirty。
+ */
+uint32_t get_unused_page_num(Table* table) {
+    Pager* pager = table->pager;
+    if (table->meta_page_num == 0) {
+        return pager->num_pages;
+    }
+    uint32_t mark = pager_pin_mark(pager);
+    void* meta = get_page(pager, table->meta_page_num);
+    uint32_t page_num = *meta_free_head(meta);
+    if (page_num == 0) {
+        pager_release_pins(pager, mark);
+        return pager->num_pages;
+    }
+    void* page = get_page(pager, page_num);
+    mark_page_dirty(pager, table->meta_page_num);
+    *meta_free_head(meta) = *free_page_next(page);
+    pager_release_pins(pager, mark);
+    return page_num;
+}
+
+/**
+ * 把树中不再引用的页面放进空闲页面链表。旧的快照仍可能读到它，
+ * mark_page_dirty 先保存了它的映像。调用者持有它的排他锁存。
+ */
+void free_page(Table* table, uint32_t page_num) {
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    void* meta = table_meta_page(table);
+    void* page = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    mark_page_dirty(pager, table->meta_page_num);
+    set_node_type(page, NODE_FREE);
+    set_node_root(page, false);
+    *free_page_next(page) = *meta_free_head(meta);
+    *meta_free_head(meta) = page_num;
+    pager_release_pins(pager, mark);
+}
+
+void create_new_root(Table* table, uint32_t right_child_page_num,
+                     uint64_t left_child_max_key) {
+    /**
+     * 处理拆分根节点。
+     * 旧根节点复制到新的页面，成为左子节点。
+     * 右子节点的地址和左子节点的最大键作为参数传入。
+     * 重新初始化根页面，以包含新的根节点。
+     * 新的根节点指向两个子节点。
+     */
+
+    void* root = get_page(table->pager, table->root_page_num);
+    uint32_t left_child_page_num = get_unused_page_num(table);
+    void* left_child = get_page(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, table->root_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+
+    /* 左子节点有从旧根复制的数据 */
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    /* 根节点是一个新的内部节点，有一个键和两个子节点 */
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    *internal_node_key_base(root) = node_key_base(left_child_max_key, left_child_max_key);
+    internal_node_set_key(root, 0, left_child_max_key);
+    *internal_node_right_child(root) = right_child_page_num;
+}
+
+void internal_node_split_and_insert(Cursor* cursor, uint32_t level,
+                                    uint32_t new_child_page_num, uint64_t separator_key);
+
+/**
+ * 路径上第 level 层的节点（level == depth 时为叶节点）拆分出了
+ * 右兄弟 new_child_page_num，左半部分的最大键为 separator_key。
+ * 在父节点中紧挨着原子节点插入新的子节点，父节点由路径给出。
+ */
+void internal_node_insert(Cursor* cursor, uint32_t level, uint32_t new_child_page_num,
+                          uint64_t separator_key) {
+    Table* table = cursor->table;
+    if (level == 0) {
+        // 拆分的是根节点
+        create_new_root(table, new_child_page_num, separator_key);
+        return;
+    }
+
+    uint32_t parent_page_num = cursor->path.pages[level - 1];
+    uint32_t slot = cursor->path.slots[level - 1];
+    void* parent = get_page(table->pager, parent_page_num);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if (!internal_node_can_fit(parent, 1, separator_key, separator_key)) {
+        internal_node_split_and_insert(cursor, level - 1, new_child_page_num, separator_key);
+        return;
+    }
+    mark_page_dirty(table->pager, parent_page_num);
+    internal_node_fit_keys(parent, separator_key, separator_key);
+
+    if (slot == original_num_keys) {
+        /* 原子节点是右子节点：它移入单元格，新的子节点取代右子节点 */
+        *internal_node_cell(parent, slot) = *internal_node_right_child(parent);
+        internal_node_set_key(parent, slot, separator_key);
+        *internal_node_right_child(parent) = new_child_page_num;
+    } else {
+        /* 原子节点的上界交给新的子节点，原子节点改用 separator_key */
+        memmove(internal_node_cell(parent, slot + 2), internal_node_cell(parent, slot + 1),
+                (original_num_keys - slot - 1) * internal_node_cell_size(parent));
+        *internal_node_cell(parent, slot + 1) = new_child_page_num;
+        internal_node_set_key(parent, slot + 1, internal_node_key(parent, slot));
+        internal_node_set_key(parent, slot, separator_key);
+    }
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+}
+
+/**
+ * count 个子节点及其最大键能否放进一个内部节点。最后一个键不存进节点。
+ */
+bool internal_children_fit(uint64_t* max_keys, uint32_t count) {
+    if (count < 2) {
+        return true;
+    }
+    bool wide = max_keys[count - 2] - max_keys[0] > UINT32_MAX;
+    return count - 1 <= (wide ? INTERNAL_NODE_WIDE_MAX_CELLS : INTERNAL_NODE_MAX_CELLS);
+}
+
+/**
+ * 用 count 个子节点及其最大键重写内部节点，最后一个成为右子节点。
+ * 除最后一个之外的键有序，范围超过 32 位时节点存完整的键。
+ */
+void internal_node_set_children(void* node, uint32_t* children, uint64_t* max_keys,
+                                uint32_t count) {
+    *internal_node_num_keys(node) = count - 1;
+    *internal_node_wide_keys(node) = 0;
+    *internal_node_key_base(node) = 0;
+    if (count > 1) {
+        if (max_keys[count - 2] - max_keys[0] > UINT32_MAX) {
+            *internal_node_wide_keys(node) = 1;
+        } else {
+            *internal_node_key_base(node) = node_key_base(max_keys[0], max_keys[count - 2]);
+        }
+    }
+    for (uint32_t i = 0; i + 1 < count; i++) {
+        *internal_node_cell(node, i) = children[i];
+        internal_node_set_key(node, i, max_keys[i]);
+    }
+    *internal_node_right_child(node) = children[count - 1];
+}
+
+void internal_node_split_and_insert(Cursor* cursor, uint32_t level,
+                                    uint32_t new_child_page_num, uint64_t separator_key) {
+    /**
+     * 路径上第 level 层的节点已满。把它的子节点连同新的子节点排好，
+     * 前一半留在原节点，后一半移到新节点，中间的键交给上一层。
+     */
+    Pager* pager = cursor->table->pager;
+    uint32_t old_page_num = cursor->path.pages[level];
+    uint32_t slot = cursor->path.slots[level];
+    void* old_node = get_page(pager, old_page_num);
+    stats_add(pager, STAT_INTERNAL_SPLITS, 1);
+
+    uint32_t num_keys = *internal_node_num_keys(old_node);
+    uint32_t total = num_keys + 2;
+    uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+    uint64_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+
+    // 新的子节点排在 slot + 1，separator_key 排在 slot，原来的键依次后移
+    for (uint32_t i = 0, j = 0; i < total; i++) {
+        if (i == slot + 1) {
+            children[i] = new_child_page_num;
+        } else {
+            children[i] = *internal_node_child(old_node, j++);
+        }
+    }
+    for (uint32_t i = 0, j = 0; i < total - 1; i++) {
+        if (i == slot) {
+            keys[i] = separator_key;
+        } else {
+            keys[i] = internal_node_key(old_node, j++);
+        }
+    }
+
+    // 最右侧追加时左边几乎留满，右边只放原右子节点和新的子节点
+    bool append = cursor_on_right_edge(cursor) && slot == num_keys;
+    uint32_t left_count = append ? total - 2 : total / 2;
+    uint32_t right_count = total - left_count;
+    uint64_t left_max = keys[left_count - 1];
+
+    uint32_t new_page_num = get_unused_page_num(cursor->table);
+    void* new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+    internal_node_set_children(new_node, children + left_count, keys + left_count,
+                               right_count);
+
+    mark_page_dirty(pager, old_page_num);
+    internal_node_set_children(old_node, children, keys, left_count);
+
+    internal_node_insert(cursor, level, new_page_num, left_max);
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, uint64_t key, Row* value) {
+    /**
+     * 创建一个新节点，与旧节点按字节数平分全部单元格和新单元格。
+     * 更新父节点或创建一个新的父节点。
+     * 在最右叶节点的末尾追加时旧节点保持全满，新行单独放进新节点，
+     * 递增的键因此把叶节点填满而不是只用一半。
+     */
+
+    // 获取旧节点的指针
+    void* old_node = get_page(cursor->table->pager, cursor->page_num);
+    stats_add(cursor->table->pager, STAT_LEAF_SPLITS, 1);
+    bool append =
+        cursor_on_right_edge(cursor) && cursor->cell_num == *leaf_node_num_cells(old_node);
+    // 获取一个未使用的页号，并使用它创建新节点
+    uint32_t new_page_num = get_unused_page_num(cursor->table);
+    // 获取新节点的指针
+    void* new_node = get_page(cursor->table->pager, new_page_num);
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+    mark_page_dirty(cursor->table->pager, new_page_num);
+    // 初始化新节点
+    initialize_leaf_node(new_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    uint8_t payload[LEAF_NODE_MAX_PAYLOAD_SIZE];
+    if (append) {
+        LeafCell cell;
+        cell.key = key;
+        cell.payload = payload;
+        cell.size = encode_row(value, payload);
+        leaf_node_set_cells(new_node, &cell, 1);
+
+        cursor->table->path_cache_valid = false;
+        uint64_t old_max = leaf_node_key(old_node, *leaf_node_num_cells(old_node) - 1);
+        internal_node_insert(cursor, cursor->path.depth, new_page_num, old_max);
+        return;
+    }
+
+    // 旧页面会被改写，单元格的负载先指向它在栈上的副本
+    uint64_t original[PAGE_SIZE / sizeof(uint64_t)];
+    memcpy(original, old_node, PAGE_SIZE);
+
+    uint32_t num_cells = *leaf_node_num_cells(original);
+    LeafCell cells[LEAF_NODE_MAX_CELLS + 1];
+    for (uint32_t i = 0, j = 0; i <= num_cells; i++) {
+        if (i == cursor->cell_num) {
+            cells[i].key = key;
+            cells[i].payload = payload;
+            cells[i].size = encode_row(value, payload);
+        } else {
+            cells[i] = leaf_node_get_cell(original, j++);
+        }
+    }
+    uint32_t left_count = leaf_node_distribute(old_node, new_node, cells, num_cells + 1);
+
+    // 树的形状变了，缓存的路径作废
+    cursor->table->path_cache_valid = false;
+
+    // 叶节点位于路径末端；路径长度为 0 时它就是根节点，会创建新的根节点
+    uint64_t new_max = leaf_node_key(old_node, left_count - 1);
+    internal_node_insert(cursor, cursor->path.depth, new_page_num, new_max);
+}
+
+void leaf_node_insert(Cursor* cursor, uint64_t key, Row* value) {
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+
+    if (leaf_node_used_space_after(node, key, leaf_node_cell_size(value)) >
+        LEAF_NODE_SPACE_FOR_CELLS) {
+        // Node full
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+    leaf_node_fit_key(node, key);
+
+    uint8_t payload[LEAF_NODE_MAX_PAYLOAD_SIZE];
+    LeafCell cell;
+    cell.key = key;
+    cell.payload = payload;
+    cell.size = encode_row(value, payload);
+    leaf_node_insert_cell(node, cursor->cell_num, cell);
+}
+
+uint32_t tree_path_page(TreePath* path, uint32_t level) {
+    return level == path->depth ? path->leaf_page_num : path->pages[level];
+}
+
+/**
+ * 取出内部节点的子节点和键，返回子节点的个数。键比子节点少一个。
+ */
+uint32_t internal_node_get_children(void* node, uint32_t* children, uint64_t* keys) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++) {
+        children[i] = *internal_node_cell(node, i);
+        keys[i] = internal_node_key(node, i);
+    }
+    children[num_keys] = *internal_node_right_child(node);
+    return num_keys + 1;
+}
+
+bool node_is_underfull(void* node) {
+    if (get_node_type(node) == NODE_LEAF) {
+        return leaf_node_used_space(node) < LEAF_NODE_MIN_USED;
+    }
+    return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+typedef enum { REBALANCE_NONE, REBALANCE_SHIFTED, REBALANCE_MERGED } RebalanceResult;
+
+/**
+ * 相邻的两个叶节点放得进一页就合并到左边，否则按字节数重新平分，
+ * separator 改为左边的最大键。两边都改存完整的键后可能放不下，这时保持原样。
+ */
+RebalanceResult leaf_node_rebalance(void* left, void* right, uint64_t* separator) {
+    uint64_t left_copy[PAGE_SIZE / sizeof(uint64_t)];
+    uint64_t right_copy[PAGE_SIZE / sizeof(uint64_t)];
+    memcpy(left_copy, left, PAGE_SIZE);
+    memcpy(right_copy, right, PAGE_SIZE);
+
+    uint32_t left_cells = *leaf_node_num_cells(left_copy);
+    uint32_t right_cells = *leaf_node_num_cells(right_copy);
+    LeafCell cells[2 * LEAF_NODE_MAX_CELLS];
+    for (uint32_t i = 0; i < left_cells; i++) {
+        cells[i] = leaf_node_get_cell(left_copy, i);
+    }
+    for (uint32_t i = 0; i < right_cells; i++) {
+        cells[left_cells + i] = leaf_node_get_cell(right_copy, i);
+    }
+    uint32_t count = left_cells + right_cells;
+
+    if (leaf_cells_size(cells, count) <= LEAF_NODE_SPACE_FOR_CELLS) {
+        leaf_node_set_cells(left, cells, count);
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right_copy);
+        return REBALANCE_MERGED;
+    }
+    uint32_t left_count = leaf_cells_split_to_fit(cells, count);
+    if (left_count == 0) {
+        return REBALANCE_NONE;
+    }
+    leaf_node_set_cells(left, cells, left_count);
+    leaf_node_set_cells(right, cells + left_count, count - left_count);
+    *separator = cells[left_count - 1].key;
+    return REBALANCE_SHIFTED;
+}
+
+/**
+ * 内部节点的版本：separator 是父节点中两者之间的键，合并时下移到左边，
+ * 重新平分时换成新的中间键。
+ */
+RebalanceResult internal_node_rebalance(void* left, void* right, uint64_t* separator) {
+    uint32_t children[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint64_t keys[2 * INTERNAL_NODE_MAX_CELLS + 2];
+    uint32_t left_count = internal_node_get_children(left, children, keys);
+    keys[left_count - 1] = *separator;
+    uint32_t total =
+        left_count + internal_node_get_children(right, children + left_count, keys + left_count);
+
+    if (internal_children_fit(keys, total)) {
+        internal_node_set_children(left, children, keys, total);
+        return REBALANCE_MERGED;
+    }
+    uint32_t split = total / 2;
+    if (!internal_children_fit(keys, split) ||
+        !internal_children_fit(keys + split, total - split)) {
+        return REBALANCE_NONE;
+    }
+    internal_node_set_children(left, children, keys, split);
+    internal_node_set_children(right, children + split, keys + split, total - split);
+    *separator = keys[split - 1];
+    return REBALANCE_SHIFTED;
+}
+
+/**
+ * 根节点只剩一个子节点：把子节点复制到根页面，树矮一层。
+ * 这个子节点是刚合并出来的，已经加着排他锁存。
+ */
+void btree_collapse_root(Table* table) {
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+    uint32_t child_page_num = *internal_node_right_child(root);
+    void* child = get_page(pager, child_page_num);
+    mark_page_dirty(pager, table->root_page_num);
+
+    uint32_t meta_page_num = *root_node_meta_page(root);
+    memcpy(root, child, PAGE_SIZE);
+    set_node_root(root, true);
+    *root_node_meta_page(root) = meta_page_num;
+    free_page(table, child_page_num);
+}
+
+/**
+ * 路径上第 level 层的节点删除单元格或子节点之后可能低于下限，
+ * 与相邻的兄弟节点合并，放不下就在两者之间重新平分。合并从父节点
+ * 删去一个子节点，再检查父节点；根节点只剩一个子节点时树矮一层。
+ * 删除时的下降已经锁住了这一层之上会被修改的祖先，这里只给兄弟节点加锁存。
+ */
+void btree_rebalance(Cursor* cursor, uint32_t level) {
+    Table* table = cursor->table;
+    Pager* pager = table->pager;
+    TreePath* path = &cursor->path;
+    table->path_cache_valid = false;
+
+    void* node = get_page(pager, tree_path_page(path, level));
+    if (level == 0) {
+        if (get_node_type(node) == NODE_INTERNAL && *internal_node_num_keys(node) == 0) {
+            btree_collapse_root(table);
+        }
+        return;
+    }
+    if (!node_is_underfull(node)) {
+        return;
+    }
+
+    // 与左兄弟配对，本身是最左子节点时与右兄弟配对
+    uint32_t parent_page_num = path->pages[level - 1];
+    void* parent = get_page(pager, parent_page_num);
+    if (*internal_node_num_keys(parent) == 0) {
+        // 放不下而没有合并的父节点可能只剩一个子节点，没有兄弟可以配对
+        return;
+    }
+    uint32_t slot = path->slots[level - 1];
+    uint32_t left_slot = slot > 0 ? slot - 1 : 0;
+    uint32_t left_page_num = *internal_node_child(parent, left_slot);
+    uint32_t right_page_num = *internal_node_child(parent, left_slot + 1);
+    get_page_latched(pager, slot > 0 ? left_page_num : right_page_num, LATCH_EXCLUSIVE);
+    void* left = get_page(pager, left_page_num);
+    void* right = get_page(pager, right_page_num);
+
+    /**
+     * 两个节点的键和它们之间的分隔键都在 [low, high] 内，重新平分后新的分隔键也是。
+     * 父节点要改存完整的键而放不下时保持原样，节点低于下限也只是浪费一些空间。
+     */
+    uint64_t separator = internal_node_key(parent, left_slot);
+    uint64_t low = separator;
+    uint64_t high = separator;
+    node_key_range_widen(left, &low, &high);
+    node_key_range_widen(right, &low, &high);
+    if (!internal_node_can_fit(parent, 0, low, high)) {
+        return;
+    }
+    mark_page_dirty(pager, parent_page_num);
+    internal_node_fit_keys(parent, low, high);
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+
+    RebalanceResult result = get_node_type(node) == NODE_LEAF
+                                 ? leaf_node_rebalance(left, right, &separator)
+                                 : internal_node_rebalance(left, right, &separator);
+    if (result == REBALANCE_NONE) {
+        return;
+    }
+    if (result == REBALANCE_SHIFTED) {
+        internal_node_set_key(parent, left_slot, separator);
+        return;
+    }
+
+    // 合并后的左节点沿用右节点的上界：删去左节点的键和右节点
+    uint32_t children[INTERNAL_NODE_MAX_CELLS + 1];
+    uint64_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+    uint32_t count = internal_node_get_children(parent, children, keys);
+    memmove(children + left_slot + 1, children + left_slot + 2,
+            (count - left_slot - 2) * sizeof(uint32_t));
+    memmove(keys + left_slot, keys + left_slot + 1, (count - left_slot - 2) * sizeof(uint64_t));
+    internal_node_set_children(parent, children, keys, count - 1);
+    free_page(table, right_page_num);
+
+    btree_rebalance(cursor, level - 1);
+}
+
+int compare_rows_by_id(const void* a, const void* b);
+
+/**
+ * 检查排好序的 rows 中是否有键已在表中，每个叶节点只下降一次。
+ * 持有 write_lock 时树不会变，只读不必加锁存。
+ */
+bool leaf_nodes_contain_any(Table* table, Row* rows, uint32_t num_rows) {
+    Pager* pager = table->pager;
+    uint32_t i = 0;
+    while (i < num_rows) {
+        uint32_t mark = pager_pin_mark(pager);
+        TreePath path;
+        tree_path_init(&path);
+        uint32_t page_num = table->root_page_num;
+        void* node = get_page(pager, page_num);
+        while (get_node_type(node) == NODE_INTERNAL) {
+            page_num = tree_path_descend(&path, page_num, node, rows[i].id);
+            node = get_page(pager, page_num);
+        }
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        do {
+            uint32_t cell_num = leaf_node_lower_bound(node, num_cells, rows[i].id);
+            if (cell_num < num_cells && leaf_node_key(node, cell_num) == rows[i].id) {
+                pager_release_pins(pager, mark);
+                return true;
+            }
+            i++;
+        } while (i < num_rows && tree_path_covers(&path, rows[i].id));
+        pager_release_pins(pager, mark);
+    }
+    return false;
+}
+
+/**
+ * 多行 insert 要么全部插入，要么一行也不插入：先按键排序，
+ * 检查批内和表中都没有重复，再插入。下降到一个叶节点后，
+ * 把落在它键范围内的行都插进去，插入会让叶节点拆分时才重新下降。
+ */
+ExecuteResult execute_insert_rows(Statement* statement, Table* table) {
+    Pager* pager = table->pager;
+    Row* rows = statement->rows;
+    uint32_t num_rows = statement->num_rows;
+    qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+    for (uint32_t i = 1; i < num_rows; i++) {
+        if (rows[i].id == rows[i - 1].id) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+    if (leaf_nodes_contain_any(table, rows, num_rows)) {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    uint32_t i = 0;
+    while (i < num_rows) {
+        uint32_t mark = pager_pin_mark(pager);
+        Cursor cursor;
+        table_find(table, rows[i].id, leaf_node_cell_size(&rows[i]), &cursor);
+        void* node = get_page(pager, cursor.page_num);
+        while (true) {
+            // 只有第一行插入时祖先按需加了锁存，之后的行放不下就重新下降
+            bool splits = !node_is_safe_for_insert(node, leaf_node_cell_size(&rows[i]),
+                                                   rows[i].id, &cursor.path);
+            leaf_node_insert(&cursor, rows[i].id, &rows[i]);
+            index_insert_row(table, &rows[i]);
+            i++;
+            if (splits || i == num_rows || !tree_path_covers(&cursor.path, rows[i].id) ||
+                !node_is_safe_for_insert(node, leaf_node_cell_size(&rows[i]), rows[i].id,
+                                         &cursor.path)) {
+                break;
+            }
+            cursor.cell_num =
+                leaf_node_lower_bound(node, *leaf_node_num_cells(node), rows[i].id);
+        }
+        pager_release_pins(pager, mark);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement* statement, Table* table) {
+    if (statement->rows != NULL) {
+        return execute_insert_rows(statement, table);
+    }
+
+    Row* row_to_insert = &(statement->row_to_insert);
+    uint64_t key_to_insert = row_to_insert->id;
+    Cursor cursor;
+    table_find(table, key_to_insert, leaf_node_cell_size(row_to_insert), &cursor);
+
+    void* node = get_page(table->pager, cursor.page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    if (cursor.cell_num < num_cells) {
+        uint64_t key_at_index = leaf_node_key(node, cursor.cell_num);
+        if (key_at_index == key_to_insert) {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    leaf_node_insert(&cursor, row_to_insert->id, row_to_insert);
+    index_insert_row(table, row_to_insert);
+
+    return EXECUTE_SUCCESS;
+}
+
+bool print_batch_callback(const DbBatch* batch, void* context) {
+    for (uint32_t i = 0; i < batch->count; i++) {
+        if (batch->usernames == NULL) {
+            printf("(%" PRIu64 ")\n", batch->ids[i]);
+        } else {
+            printf("(%" PRIu64 ", %.*s, %.*s)\n", batch->ids[i], batch->usernames[i].length,
+                   batch->usernames[i].data, batch->emails[i].length, batch->emails[i].data);
+        }
+    }
+    return true;
+}
+
+/**
+ * 按小端写入整数，与主机的字节序无关。
+ */
+void binary_put_uint(uint8_t* destination, uint64_t value, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        destination[i] = value >> (8 * i);
+    }
+}
+
+/**
+ * 二进制模式下每一行是一条记录：4 字节的记录长度，8 字节的 id，
+ * 1 字节的 username 长度和 username，1 字节的 email 长度和 email，整数都是小端。
+ * select id 和聚合的记录只有 id，长度为 8。一条 select 的结果以长度为 0 的记录结束，
+ * 之后照常打印 Executed.。
+ */
+bool binary_batch_callback(const DbBatch* batch, void* context) {
+    OutputBuffer* output = context;
+    uint8_t record[sizeof(uint32_t) + sizeof(uint64_t) + 2 + COLUMN_USERNAME_SIZE +
+                   COLUMN_EMAIL_SIZE];
+    for (uint32_t i = 0; i < batch->count; i++) {
+        uint32_t length = sizeof(uint64_t);
+        binary_put_uint(record + sizeof(uint32_t), batch->ids[i], sizeof(uint64_t));
+        if (batch->usernames != NULL) {
+            uint8_t* p = record + sizeof(uint32_t) + sizeof(uint64_t);
+            *p++ = batch->usernames[i].length;
+            memcpy(p, batch->usernames[i].data, batch->usernames[i].length);
+            p += batch->usernames[i].length;
+            *p++ = batch->emails[i].length;
+            memcpy(p, batch->emails[i].data, batch->emails[i].length);
+            p += batch->emails[i].length;
+            length = p - (record + sizeof(uint32_t));
+        }
+        binary_put_uint(record, length, sizeof(uint32_t));
+        output_buffer_append(output, record, sizeof(uint32_t) + length);
+    }
+    return true;
+}
+
+/**
+ * 写出一条 select 的结束记录，连同攒下的结果一起写到标准输出。
+ */
+void binary_end_result(OutputBuffer* output) {
+    uint8_t end[sizeof(uint32_t)] = {0};
+    output_buffer_append(output, end, sizeof(uint32_t));
+    output_buffer_flush(output);
+}
+
+void text_copy(char* destination, const DbText* text) {
+    memcpy(destination, text->data, text->length);
+    destination[text->length] = '\0';
+}
+
+typedef struct {
+    DbRowCallback callback;
+    void* context;
+} RowCallbackAdapter;
+
+/**
+ * db_step 的回调逐行接收 Row，在这里从批次中解码出来。没有文本列时文本为空。
+ */
+bool row_adapter_callback(const DbBatch* batch, void* context) {
+    RowCallbackAdapter* adapter = context;
+    Row row;
+    row.username[0] = '\0';
+    row.email[0] = '\0';
+    for (uint32_t i = 0; i < batch->count; i++) {
+        row.id = batch->ids[i];
+        if (batch->usernames != NULL) {
+            text_copy(row.username, &batch->usernames[i]);
+            text_copy(row.email, &batch->emails[i]);
+        }
+        if (!adapter->callback(&row, adapter->context)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 把 select 的条件换算成键的闭区间，low > high 表示空范围。
+ */
+void select_range(Statement* statement, uint64_t* low, uint64_t* high) {
+    uint64_t value = statement->select_operands[0];
+    *low = 0;
+    *high = UINT64_MAX;
+    switch (statement->select_op) {
+        case (SELECT_ALL):
+            break;
+        case (SELECT_EQUAL):
+            *low = value;
+            *high = value;
+            break;
+        case (SELECT_GREATER_EQUAL):
+            *low = value;
+            break;
+        case (SELECT_LESS_EQUAL):
+            *high = value;
+            break;
+        case (SELECT_GREATER):
+            if (value == UINT64_MAX) {
+                *low = 1;
+                *high = 0;
+            } else {
+                *low = value + 1;
+            }
+            break;
+        case (SELECT_LESS):
+            if (value == 0) {
+                *low = 1;
+                *high = 0;
+            } else {
+                *high = value - 1;
+            }
+            break;
+        case (SELECT_BETWEEN):
+            *low = value;
+            *high = statement->select_operands[1];
+            break;
+        case (SELECT_COLUMN_EQUAL):
+            // 没有索引时扫描整个表，逐行比较
+            break;
+    }
+}
+
+bool row_matches(Statement* statement, const Row* row) {
+    return statement->select_op != SELECT_COLUMN_EQUAL ||
+           strcmp(row_column_value(row, statement->column), statement->where_value) == 0;
+}
+
+/**
+ * 把批次按语句的投影交给回调；聚合只累计到 value，扫描结束后输出一行。
+ */
+typedef struct {
+    Projection projection;
+    DbBatchCallback callback;
+    void* context;
+    bool has_value;
+    uint64_t value;  // count(*) 的行数，或 min(id)、max(id) 的结果
+} SelectOutput;
+
+void select_output_init(SelectOutput* output, Projection projection, DbBatchCallback callback,
+                        void* context) {
+    output->projection = projection;
+    output->callback = callback;
+    output->context = context;
+    // 没有行时 count(*) 仍然输出 0，min 和 max 不输出
+    output->has_value = projection == PROJECT_COUNT;
+    output->value = 0;
+}
+
+/**
+ * batch 中的行按 id 排序，至少有一行。返回 false 时不再需要后面的行。
+ */
+bool select_output_batch(SelectOutput* output, const DbBatch* batch) {
+    DbBatch ids_only;
+    switch (output->projection) {
+        case (PROJECT_ROWS):
+            return output->callback == NULL || output->callback(batch, output->context);
+        case (PROJECT_ID):
+            ids_only = *batch;
+            ids_only.usernames = NULL;
+            ids_only.emails = NULL;
+            return output->callback == NULL || output->callback(&ids_only, output->context);
+        case (PROJECT_COUNT):
+            output->value += batch->count;
+            return true;
+        case (PROJECT_MIN):
+            output->has_value = true;
+            output->value = batch->ids[0];
+            return false;
+        case (PROJECT_MAX):
+            output->has_value = true;
+            output->value = batch->ids[batch->count - 1];
+            return true;
+    }
+    return true;
+}
+
+void select_output_finish(SelectOutput* output) {
+    if (output->projection == PROJECT_ROWS || output->projection == PROJECT_ID ||
+        !output->has_value || output->callback == NULL) {
+        return;
+    }
+    DbBatch batch;
+    batch.count = 1;
+    batch.ids = &output->value;
+    batch.usernames = NULL;
+    batch.emails = NULL;
+    output->callback(&batch, output->context);
+}
+
+/**
+ * 把一行作为一批输出。
+ */
+bool select_output_row(SelectOutput* output, Row* row) {
+    DbText username = {row->username, strlen(row->username)};
+    DbText email = {row->email, strlen(row->email)};
+    DbBatch batch;
+    batch.count = 1;
+    batch.ids = &row->id;
+    batch.usernames = &username;
+    batch.emails = &email;
+    return select_output_batch(output, &batch);
+}
+
+/**
+ * where 列 = 值 在列上有索引时：先从索引取出全部 id。只要 id 的投影直接用它们，
+ * 否则在同一个快照中逐个读出行，每行作为一批输出。
+ */
+void select_from_index(Statement* statement, Table* table, uint32_t index_root,
+                       uint64_t snapshot, SelectOutput* output) {
+    IdList ids;
+    id_list_init(&ids);
+    index_lookup(table, index_root, statement->where_value, snapshot, &ids);
+    DbBatch batch;
+    if (statement->projection != PROJECT_ROWS) {
+        if (ids.count > 0) {
+            batch.count = ids.count;
+            batch.ids = ids.ids;
+            batch.usernames = NULL;
+            batch.emails = NULL;
+            select_output_batch(output, &batch);
+        }
+        id_list_free(&ids);
+        return;
+    }
+
+    Row row;
+    for (uint32_t i = 0; i < ids.count; i++) {
+        if (!table_get_row_cached(table, ids.ids[i], snapshot, &row)) {
+            continue;
+        }
+        if (!select_output_row(output, &row)) {
+            break;
+        }
+    }
+    id_list_free(&ids);
+}
+
+/**
+ * 启用了热点行缓存时 where id = K 直接按 id 读这一行，命中缓存时不下降。
+ */
+void select_point(Table* table, uint64_t id, uint64_t snapshot, SelectOutput* output) {
+    Row row;
+    if (table_get_row_cached(table, id, snapshot, &row)) {
+        select_output_row(output, &row);
+    }
+}
+
+/**
+ * 定位到范围起点，一次读一个叶节点，越过终点就停止。
+ * 只有输出整行或按文本列过滤时才需要文本列。
+ */
+void select_serial(Statement* statement, Table* table, uint64_t low, uint64_t high,
+                   uint64_t snapshot, SelectOutput* output) {
+    bool filter = statement->select_op == SELECT_COLUMN_EQUAL;
+    bool with_text = statement->projection == PROJECT_ROWS || filter;
+    uint64_t leaf_copy[PAGE_SIZE / sizeof(uint64_t)];
+    ScanOperator scan;
+    scan_open(&scan, table, low, high, snapshot, with_text, leaf_copy);
+    while (scan_next_batch(&scan)) {
+        if (filter) {
+            scan_filter_text(&scan, statement->column, statement->where_value);
+        }
+        if (scan.batch.count > 0 && !select_output_batch(output, &scan.batch)) {
+            break;
+        }
+    }
+}
+
+/*******************************************************************
+ * 后端 并行扫描
+ *******************************************************************/
+
+/**
+ * 全表扫描按树的上几层切成互不相交的键范围，由线程池中的线程各自扫描。
+ * 范围比线程多得多，线程做完一个就领取下一个，不均匀的范围因此能互相抵消。
+ * 聚合的部分结果最后合并，与顺序无关；输出行时调用线程按范围的顺序
+ * 交出已完成的范围，线程最多领先每线程 SCAN_POOL_WINDOW 个范围，缓存的行数有上限。
+ */
+#define SCAN_RANGES_PER_THREAD 8
+#define SCAN_POOL_WINDOW 2
+
+// 一个范围的输出：聚合的部分结果，或者按顺序缓存的行
+typedef struct {
+    bool done;
+    SelectOutput output;
+    IdList ids;
+    // 文本列按叶节点负载的格式连续存放：[用户名长度][用户名][邮箱长度][邮箱]
+    uint8_t* text;
+    uint32_t text_size;
+    uint32_t text_capacity;
+} ScanPart;
+
+typedef struct {
+    Table* table;
+    Statement* statement;
+    uint64_t snapshot;
+    uint64_t* bounds;  // 第 i 个范围是 [bounds[i], bounds[i + 1] - 1]，最后一个到 high 为止
+    uint64_t high;
+    uint32_t num_ranges;
+    ScanPart* parts;
+    bool ordered;
+    uint32_t window;  // ordered 时最多领先已交出的范围多少个
+
+    // 以下由 ScanPool.lock 保护
+    uint32_t next_range;
+    uint32_t delivered;  // ordered 时调用线程已经交出的范围数
+    uint32_t active;     // 正在扫描的线程数
+    bool stop;           // 回调要求提前结束
+} ScanJob;
+
+struct ScanPool {
+    pthread_t* threads;
+    uint32_t num_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // 有新的任务，或者又可以领取范围
+    pthread_cond_t progress;  // 有范围扫描完成
+    ScanJob* job;             // 同一时刻只执行一个任务，为 NULL 时空闲
+    bool shutdown;
+};
+
+void scan_part_append_text(ScanPart* part, const DbText* text) {
+    if (part->text_size + 1 + text->length > part->text_capacity) {
+        part->text_capacity = part->text_capacity > 0 ? part->text_capacity * 2 : PAGE_SIZE;
+        if (part->text_capacity < part->text_size + 1 + text->length) {
+            part->text_capacity = part->text_size + 1 + text->length;
+        }
+        part->text = realloc(part->text, part->text_capacity);
+    }
+    part->text[part->text_size] = text->length;
+    memcpy(part->text + part->text_size + 1, text->data, text->length);
+    part->text_size += 1 + text->length;
+}
+
+bool scan_job_claimable(ScanJob* job) {
+    return !job->stop && job->next_range < job->num_ranges &&
+           (!job->ordered || job->next_range < job->delivered + job->window);
+}
+
+/**
+ * 扫描第 range 个范围。行先复制到部分结果中，叶节点的锁存不会留到调用线程输出时。
+ */
+void scan_job_run(ScanJob* job, uint32_t range) {
+    Statement* statement = job->statement;
+    ScanPart* part = &job->parts[range];
+    uint64_t low = job->bounds[range];
+    uint64_t high = range + 1 < job->num_ranges ? job->bounds[range + 1] - 1 : job->high;
+    bool filter = statement->select_op == SELECT_COLUMN_EQUAL;
+    bool with_text = statement->projection == PROJECT_ROWS || filter;
+
+    uint64_t leaf_copy[PAGE_SIZE / sizeof(uint64_t)];
+    ScanOperator scan;
+    scan_open(&scan, job->table, low, high, job->snapshot, with_text, leaf_copy);
+    while (!__atomic_load_n(&job->stop, __ATOMIC_RELAXED) && scan_next_batch(&scan)) {
+        if (filter) {
+            scan_filter_text(&scan, statement->column, statement->where_value);
+        }
+        if (!job->ordered) {
+            if (scan.batch.count > 0) {
+                select_output_batch(&part->output, &scan.batch);
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < scan.batch.count; i++) {
+            id_list_push(&part->ids, scan.ids[i]);
+            if (statement->projection == PROJECT_ROWS) {
+                scan_part_append_text(part, &scan.usernames[i]);
+                scan_part_append_text(part, &scan.emails[i]);
+            }
+        }
+    }
+}
+
+void* scan_pool_worker(void* argument) {
+    ScanPool* pool = argument;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && (pool->job == NULL || !scan_job_claimable(pool->job))) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        ScanJob* job = pool->job;
+        uint32_t range = job->next_range++;
+        job->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        scan_job_run(job, range);
+
+        pthread_mutex_lock(&pool->lock);
+        job->parts[range].done = true;
+        job->active--;
+        pthread_cond_broadcast(&pool->progress);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    // 固定栈是线程局部的，随线程一起释放
+    free(pin_stack.pins);
+    return NULL;
+}
+
+ScanPool* scan_pool_open(uint32_t num_threads) {
+    ScanPool* pool = malloc(sizeof(ScanPool));
+    pool->num_threads = num_threads;
+    pool->threads = malloc(sizeof(pthread_t) * num_threads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->progress, NULL);
+    pool->job = NULL;
+    pool->shutdown = false;
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_create(&pool->threads[i], NULL, scan_pool_worker, pool);
+    }
+    return pool;
+}
+
+void scan_pool_close(ScanPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint32_t i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->progress);
+    free(pool->threads);
+    free(pool);
+}
+
+int compare_keys(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+/**
+ * 在快照中从根节点逐层向下展开，直到子节点不少于 target 个，或者子节点已经是叶节点。
+ * 展开过的内部节点的键就是子树之间的分界，落在 [low, high) 内的分界把范围切开。
+ * 返回各范围的起点，根节点是叶节点时只有一个范围。
+ */
+void scan_partition(Table* table, uint64_t snapshot, uint64_t low, uint64_t high,
+                    uint32_t target, IdList* bounds) {
+    Pager* pager = table->pager;
+    IdList keys;
+    IdList pages;
+    IdList children;
+    id_list_init(&keys);
+    id_list_init(&pages);
+    id_list_init(&children);
+    id_list_push(&pages, table->root_page_num);
+
+    uint32_t mark = pager_pin_mark(pager);
+    bool internal = get_node_type(get_page_snapshot(pager, table->root_page_num, snapshot)) ==
+                    NODE_INTERNAL;
+    pager_release_pins(pager, mark);
+    while (internal) {
+        children.count = 0;
+        for (uint32_t i = 0; i < pages.count; i++) {
+            void* node = get_page_snapshot(pager, pages.ids[i], snapshot);
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t j = 0; j < num_keys; j++) {
+                id_list_push(&keys, internal_node_key(node, j));
+                id_list_push(&children, *internal_node_child(node, j));
+            }
+            id_list_push(&children, *internal_node_right_child(node));
+            pager_release_pins(pager, mark);
+        }
+        if (children.count >= target) {
+            break;
+        }
+        internal = get_node_type(get_page_snapshot(pager, children.ids[0], snapshot)) ==
+                   NODE_INTERNAL;
+        pager_release_pins(pager, mark);
+        IdList swap = pages;
+        pages = children;
+        children = swap;
+    }
 
-    if (pager->num_pages == 0) {
-        // New database file. Initialize page 0 as leaf node
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
+    qsort(keys.ids, keys.count, sizeof(uint64_t), compare_keys);
+    id_list_push(bounds, low);
+    for (uint32_t i = 0; i < keys.count; i++) {
+        // 子树包含不大于分界的键，下一个范围从分界之后开始
+        if (keys.ids[i] >= low && keys.ids[i] < high) {
+            id_list_push(bounds, keys.ids[i] + 1);
+        }
     }
+    id_list_free(&keys);
+    id_list_free(&pages);
+    id_list_free(&children);
+}
 
-    return table;
+/**
+ * 把排好顺序的一个范围交给回调，每批最多 SCAN_BATCH_ROWS 行。
+ */
+bool scan_part_deliver(ScanPart* part, Projection projection, SelectOutput* output) {
+    uint64_t ids[SCAN_BATCH_ROWS];
+    DbText usernames[SCAN_BATCH_ROWS];
+    DbText emails[SCAN_BATCH_ROWS];
+    DbBatch batch;
+    batch.ids = ids;
+    batch.usernames = projection == PROJECT_ROWS ? usernames : NULL;
+    batch.emails = projection == PROJECT_ROWS ? emails : NULL;
+    uint32_t offset = 0;
+    for (uint32_t first = 0; first < part->ids.count; first += SCAN_BATCH_ROWS) {
+        batch.count = part->ids.count - first;
+        if (batch.count > SCAN_BATCH_ROWS) {
+            batch.count = SCAN_BATCH_ROWS;
+        }
+        for (uint32_t i = 0; i < batch.count; i++) {
+            ids[i] = part->ids.ids[first + i];
+            if (projection == PROJECT_ROWS) {
+                usernames[i].length = part->text[offset];
+                usernames[i].data = (const char*)part->text + offset + 1;
+                offset += 1 + usernames[i].length;
+                emails[i].length = part->text[offset];
+                emails[i].data = (const char*)part->text + offset + 1;
+                offset += 1 + emails[i].length;
+            }
+        }
+        if (!select_output_batch(output, &batch)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-void db_close(Table* table) {
-    Pager* pager = table->pager;
+/**
+ * 用线程池扫描 [low, high]。线程池正被其他查询使用，或者树太小切不开时返回 false，
+ * 由调用者单线程扫描。
+ */
+bool select_parallel(Statement* statement, Table* table, uint64_t low, uint64_t high,
+                     uint64_t snapshot, SelectOutput* output) {
+    ScanPool* pool = table->scan_pool;
+    if (pool == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&pool->lock);
+    bool busy = pool->job != NULL;
+    pthread_mutex_unlock(&pool->lock);
+    if (busy) {
+        return false;
+    }
 
-    for (uint32_t i = 0; i < pager->num_pages; i++) {
-        if (pager->pages[i] == NULL) {
-            continue;
-        }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+    IdList bounds;
+    id_list_init(&bounds);
+    scan_partition(table, snapshot, low, high, pool->num_threads * SCAN_RANGES_PER_THREAD,
+                   &bounds);
+    if (bounds.count < 2) {
+        id_list_free(&bounds);
+        return false;
     }
 
-    int result = close(pager->file_descriptor);
-    if (result == -1) {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+    ScanJob job;
+    job.table = table;
+    job.statement = statement;
+    job.snapshot = snapshot;
+    job.bounds = bounds.ids;
+    job.high = high;
+    job.num_ranges = bounds.count;
+    job.parts = calloc(job.num_ranges, sizeof(ScanPart));
+    for (uint32_t i = 0; i < job.num_ranges; i++) {
+        select_output_init(&job.parts[i].output, statement->projection, NULL, NULL);
+        id_list_init(&job.parts[i].ids);
+    }
+    job.ordered = statement->projection == PROJECT_ROWS || statement->projection == PROJECT_ID;
+    job.window = pool->num_threads * SCAN_POOL_WINDOW;
+    job.next_range = 0;
+    job.delivered = 0;
+    job.active = 0;
+    job.stop = false;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->job != NULL) {
+        // 检查之后被其他查询抢先了
+        pthread_mutex_unlock(&pool->lock);
+        free(job.parts);
+        id_list_free(&bounds);
+        return false;
     }
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager->pages[i];
-        if (page) {
-            free(page);
-            pager->pages[i] = NULL;
+    pool->job = &job;
+    pthread_cond_broadcast(&pool->work);
+    if (job.ordered) {
+        // 按顺序交出完成的范围，交出时不持有锁
+        while (job.delivered < job.num_ranges && !job.stop) {
+            ScanPart* part = &job.parts[job.delivered];
+            while (!part->done) {
+                pthread_cond_wait(&pool->progress, &pool->lock);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            bool more = scan_part_deliver(part, statement->projection, output);
+            id_list_free(&part->ids);
+            free(part->text);
+            part->text = NULL;
+            pthread_mutex_lock(&pool->lock);
+            __atomic_store_n(&job.stop, !more, __ATOMIC_RELAXED);
+            job.delivered++;
+            pthread_cond_broadcast(&pool->work);
         }
     }
-    free(pager);
-    free(table);
+    while (job.active > 0 || (!job.stop && job.next_range < job.num_ranges)) {
+        pthread_cond_wait(&pool->progress, &pool->lock);
+    }
+    pool->job = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < job.num_ranges; i++) {
+        ScanPart* part = &job.parts[i];
+        if (!job.ordered && part->output.has_value) {
+            if (output->projection == PROJECT_COUNT) {
+                output->value += part->output.value;
+            } else if (!output->has_value || part->output.value > output->value) {
+                output->has_value = true;
+                output->value = part->output.value;
+            }
+        }
+        id_list_free(&part->ids);
+        free(part->text);
+    }
+    free(job.parts);
+    id_list_free(&bounds);
+    return true;
 }
 
-/*******************************************************************
- * 游标
- *******************************************************************/
+ExecuteResult execute_select(Statement* statement, Table* table, DbBatchCallback callback,
+                             void* context) {
+    SelectOutput output;
+    select_output_init(&output, statement->projection, callback, context);
+    uint64_t low;
+    uint64_t high;
+    select_range(statement, &low, &high);
+    if (low > high) {
+        select_output_finish(&output);
+        return EXECUTE_SUCCESS;
+    }
+    // 整个扫描读同一个快照：期间提交的插入不可见，写者也不必等扫描结束。
+    // 在自己的事务中读最新的页面，能看到尚未提交的插入
+    bool in_transaction = txn_table == table;
+    uint64_t snapshot =
+        in_transaction ? SNAPSHOT_LATEST : pager_snapshot_begin(table->pager);
+
+    uint32_t index_root = 0;
+    if (statement->select_op == SELECT_COLUMN_EQUAL) {
+        index_root = index_root_for_snapshot(table, statement->column, snapshot);
+    }
+    if (index_root != 0) {
+        select_from_index(statement, table, index_root, snapshot, &output);
+    } else if (statement->select_op == SELECT_EQUAL && table->row_cache != NULL &&
+               !in_transaction) {
+        select_point(table, low, snapshot, &output);
+    } else if (in_transaction || statement->projection == PROJECT_MIN ||
+               !select_parallel(statement, table, low, high, snapshot, &output)) {
+        // 事务中的写者读未提交的页面，不交给其他线程；min(id) 读完第一批就结束
+        select_serial(statement, table, low, high, snapshot, &output);
+    }
 
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    // 获取叶节点的内容
-    void* node = get_page(table->pager, page_num);
-    // 获取叶节点中已有的单元格数量
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    if (!in_transaction) {
+        pager_snapshot_end(table->pager, snapshot);
+    }
 
-    // 分配游标内存
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
-    cursor->end_of_table = false;
+    select_output_finish(&output);
+    return EXECUTE_SUCCESS;
+}
 
-    // 二分查找
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (one_past_max_index != min_index) {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
+/**
+ * where 列 = 值 选中的行的 id，按 id 排序。写者读最新的页面：有索引就查索引，否则扫描整个表。
+ */
+void column_matching_ids(Statement* statement, Table* table, IdList* ids) {
+    uint32_t index_root = table->index_roots[statement->column];
+    if (index_root != 0) {
+        index_lookup(table, index_root, statement->where_value, SNAPSHOT_LATEST, ids);
+        return;
+    }
+    Cursor cursor;
+    table_start(table, SNAPSHOT_LATEST, &cursor);
+    Row row;
+    while (!cursor.end_of_table) {
+        cursor_read_row(&cursor, &row);
+        if (row_matches(statement, &row)) {
+            id_list_push(ids, row.id);
+        }
+        cursor_advance(&cursor);
+    }
+}
 
-        // 如果找到了键，返回游标
-        if (key == key_at_index) {
-            cursor->cell_num = index;
-            return cursor;
+/**
+ * 删除键在 [low, high] 内的行。每下降一次删掉一个叶节点中落在范围内的所有行，
+ * 再从它的上界之后继续。叶节点可能低于下限时下降锁住了合并要修改的祖先，
+ * 删完后与兄弟节点合并或重新平分；否则删到会低于下限的那一行就停下，从这一行重新下降。
+ */
+void delete_range(Table* table, uint64_t low, uint64_t high) {
+    Pager* pager = table->pager;
+    bool has_index = table_has_index(table);
+    uint64_t key = low;
+    bool done = low > high;
+    while (!done) {
+        uint32_t mark = pager_pin_mark(pager);
+        Cursor cursor;
+        table_find_for_write(table, key, WRITE_DELETE, 0, &cursor);
+        void* node = get_page(pager, cursor.page_num);
+        bool can_rebalance = !node_is_safe_for_delete(node);
+        bool deleted = false;
+
+        // 删完这个叶节点就从它的上界之后继续
+        done = !cursor.path.has_upper_bound || cursor.path.upper_bound >= high;
+        if (!done) {
+            key = cursor.path.upper_bound + 1;
+        }
+        while (cursor.cell_num < *leaf_node_num_cells(node)) {
+            uint64_t cell_key = leaf_node_key(node, cursor.cell_num);
+            if (cell_key > high) {
+                done = true;
+                break;
+            }
+            uint32_t cell_size =
+                leaf_node_slot_size(node) + *leaf_node_payload_size(node, cursor.cell_num);
+            if (!can_rebalance && leaf_node_used_space(node) - cell_size < LEAF_NODE_MIN_USED) {
+                key = cell_key;
+                done = false;
+                break;
+            }
+            if (!deleted) {
+                mark_page_dirty(pager, cursor.page_num);
+                deleted = true;
+            }
+            if (has_index) {
+                Row row;
+                leaf_node_read_row(node, cursor.cell_num, &row);
+                index_remove_row(table, &row);
+            }
+            table_invalidate_row(table, cell_key);
+            leaf_node_remove_cell(node, cursor.cell_num);
         }
 
-        // 如果目标键小于当前索引处的键，将搜索范围缩小到左半边
-        if (key < key_at_index) {
-            one_past_max_index = index;
-        } else {
-            // 否则，将搜索范围缩小到右半边
-            min_index = index + 1;
+        if (deleted && can_rebalance) {
+            btree_rebalance(&cursor, cursor.path.depth);
         }
+        pager_release_pins(pager, mark);
     }
-
-    // 如果没有找到键，返回光标指向插入位置
-    cursor->cell_num = min_index;
-    return cursor;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
-    /**
-     * 返回应包含给定键的子节点的索引。
-     */
+ExecuteResult execute_delete(Statement* statement, Table* table) {
+    if (statement->select_op == SELECT_COLUMN_EQUAL) {
+        IdList ids;
+        id_list_init(&ids);
+        column_matching_ids(statement, table, &ids);
+        for (uint32_t i = 0; i < ids.count; i++) {
+            delete_range(table, ids.ids[i], ids.ids[i]);
+        }
+        id_list_free(&ids);
+        return EXECUTE_SUCCESS;
+    }
+    uint64_t low;
+    uint64_t high;
+    select_range(statement, &low, &high);
+    delete_range(table, low, high);
+    return EXECUTE_SUCCESS;
+}
 
-    uint32_t num_keys = *internal_node_num_keys(node);
+/**
+ * 修改键在 [low, high] 内的行，一个叶节点中的行在一次下降中改完。新的单元格放得下就原地替换；
+ * 放不下时叶节点要拆分，下降锁住了拆分要修改的祖先才拆分，拆分后从下一个键重新下降。
+ * 变短的行不触发合并。
+ */
+void update_range(Statement* statement, Table* table, uint64_t low, uint64_t high) {
+    Pager* pager = table->pager;
+    uint64_t key = low;
+    bool done = low > high;
+    while (!done) {
+        uint32_t mark = pager_pin_mark(pager);
+        Cursor cursor;
+        table_find(table, key, LEAF_NODE_MAX_CELL_SIZE, &cursor);
+        void* node = get_page(pager, cursor.page_num);
+        bool can_split = !node_is_safe_for_insert(node, LEAF_NODE_MAX_CELL_SIZE, key, &cursor.path);
+
+        done = !cursor.path.has_upper_bound || cursor.path.upper_bound >= high;
+        if (!done) {
+            key = cursor.path.upper_bound + 1;
+        }
+        while (cursor.cell_num < *leaf_node_num_cells(node)) {
+            Row row;
+            leaf_node_read_row(node, cursor.cell_num, &row);
+            if (row.id > high) {
+                done = true;
+                break;
+            }
+            Row old_row = row;
+            table_invalidate_row(table, row.id);
+            if (statement->update_username) {
+                strcpy(row.username, statement->row_to_insert.username);
+            }
+            if (statement->update_email) {
+                strcpy(row.email, statement->row_to_insert.email);
+            }
 
-    /* 二分查找 */
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys; /* 子节点数量比键数量多 1 */
+            // 键不变，槽位原样复用，只比较负载
+            uint32_t old_size = *leaf_node_payload_size(node, cursor.cell_num);
+            if (leaf_node_free_space(node) + old_size >= row_payload_size(&row)) {
+                mark_page_dirty(pager, cursor.page_num);
+                leaf_node_remove_cell(node, cursor.cell_num);
+                uint8_t payload[LEAF_NODE_MAX_PAYLOAD_SIZE];
+                LeafCell cell;
+                cell.key = row.id;
+                cell.payload = payload;
+                cell.size = encode_row(&row, payload);
+                leaf_node_insert_cell(node, cursor.cell_num, cell);
+                index_update_row(table, &old_row, &row);
+                cursor.cell_num++;
+                continue;
+            }
 
-    while (min_index != max_index) {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key) {
-            max_index = index;
-        } else {
-            min_index = index + 1;
+            if (can_split) {
+                mark_page_dirty(pager, cursor.page_num);
+                leaf_node_remove_cell(node, cursor.cell_num);
+                leaf_node_insert(&cursor, row.id, &row);
+                index_update_row(table, &old_row, &row);
+                // 树的形状变了，剩下的行重新下降
+                done = row.id == high;
+                key = row.id + 1;
+            } else {
+                key = row.id;
+                done = false;
+            }
+            break;
         }
+        pager_release_pins(pager, mark);
     }
-    return min_index;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-    void* node = get_page(table->pager, page_num);
-
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void* child = get_page(table->pager, child_num);
-    switch (get_node_type(child)) {
-        case NODE_LEAF:
-            return leaf_node_find(table, child_num, key);
-        case NODE_INTERNAL:
-            return internal_node_find(table, child_num, key);
+ExecuteResult execute_update(Statement* statement, Table* table) {
+    if (statement->select_op == SELECT_COLUMN_EQUAL) {
+        IdList ids;
+        id_list_init(&ids);
+        column_matching_ids(statement, table, &ids);
+        for (uint32_t i = 0; i < ids.count; i++) {
+            update_range(statement, table, ids.ids[i], ids.ids[i]);
+        }
+        id_list_free(&ids);
+        return EXECUTE_SUCCESS;
     }
+    uint64_t low;
+    uint64_t high;
+    select_range(statement, &low, &high);
+    update_range(statement, table, low, high);
+    return EXECUTE_SUCCESS;
 }
 
 /**
- * 返回给定键的位置。
- * 如果键不存在，则返回应插入的位置
+ * 在元数据页中记下新的空索引，再把表中已有的行插入。建好的索引立即用于
+ * 这个事务之后的语句；其他线程的快照要等事务提交之后才会用到它。
  */
-Cursor* table_find(Table* table, uint32_t key) {
-    // 获取表的根节点页号
-    uint32_t root_page_num = table->root_page_num;
-    // 获取根节点的内容
-    void* root_node = get_page(table->pager, root_page_num);
-
-    // 如果根节点是叶节点
-    if (get_node_type(root_node) == NODE_LEAF) {
-        // 在叶节点中查找键的位置
-        return leaf_node_find(table, root_page_num, key);
-    } else {
-        // 在内部节点中搜索
-        return internal_node_find(table, root_page_num, key);
+ExecuteResult execute_create_index(Statement* statement, Table* table) {
+    IndexColumn column = statement->column;
+    if (table->index_roots[column] != 0) {
+        return EXECUTE_INDEX_EXISTS;
     }
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    // 元数据页可能也要在文件末尾分配，先于根节点取得
+    void* meta = table_meta_page(table);
+    uint32_t root_page_num = get_unused_page_num(table);
+    void* root = get_page(pager, root_page_num);
+    mark_page_dirty(pager, root_page_num);
+    initialize_index_node(root, NODE_INDEX_LEAF);
+    set_node_root(root, true);
+    mark_page_dirty(pager, table->meta_page_num);
+    *meta_index_root(meta, column) = root_page_num;
+    pager_release_pins(pager, mark);
+
+    // 持有 write_lock，提交序号在事务结束前不会变
+    __atomic_store_n(&table->index_created[column], pager->commit_seq + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&table->index_roots[column], root_page_num, __ATOMIC_RELEASE);
+    index_build(table, column);
+    return EXECUTE_SUCCESS;
 }
 
-Cursor* table_start(Table* table) {
-    Cursor* cursor = table_find(table, 0);
+ExecuteResult execute_write(Statement* statement, Table* table) {
+    switch (statement->type) {
+        case (STATEMENT_DELETE):
+            return execute_delete(statement, table);
+        case (STATEMENT_UPDATE):
+            return execute_update(statement, table);
+        case (STATEMENT_CREATE_INDEX):
+            return execute_create_index(statement, table);
+        default:
+            return execute_insert(statement, table);
+    }
+}
 
-    void* node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    cursor->end_of_table = (num_cells == 0);
+/**
+ * 可以在多个线程中同时调用。写语句互斥执行并在返回前提交，
+ * 读语句只加共享锁存，与写者和其他读者并发。
+ */
+ExecuteResult run_statement(Statement* statement, Table* table, DbBatchCallback callback,
+                            void* context) {
+    if (statement->bound_params != (1u << statement->num_params) - 1) {
+        return EXECUTE_UNBOUND_PARAMETER;
+    }
 
-    return cursor;
+    Pager* pager = table->pager;
+    uint32_t mark = pager_pin_mark(pager);
+    bool in_transaction = txn_table == table;
+    ExecuteResult result;
+    switch (statement->type) {
+        case (STATEMENT_INSERT):
+        case (STATEMENT_DELETE):
+        case (STATEMENT_UPDATE):
+        case (STATEMENT_CREATE_INDEX):
+            // 事务中的写语句已经持有 write_lock，修改留到 commit 时一起提交
+            if (!in_transaction) {
+                pthread_mutex_lock(&table->write_lock);
+            }
+            result = execute_write(statement, table);
+            pager_release_pins(pager, mark);
+            if (!in_transaction) {
+                pager_commit(pager);
+                pthread_mutex_unlock(&table->write_lock);
+            }
+            return result;
+        case (STATEMENT_SELECT):
+            result = execute_select(statement, table, callback, context);
+            pager_release_pins(pager, mark);
+            return result;
+        case (STATEMENT_BEGIN):
+            if (txn_table != NULL) {
+                return EXECUTE_TRANSACTION_ACTIVE;
+            }
+            pthread_mutex_lock(&table->write_lock);
+            txn_table = table;
+            return EXECUTE_SUCCESS;
+        case (STATEMENT_COMMIT):
+            if (!in_transaction) {
+                return EXECUTE_NO_TRANSACTION;
+            }
+            pager_commit(pager);
+            txn_table = NULL;
+            pthread_mutex_unlock(&table->write_lock);
+            return EXECUTE_SUCCESS;
+    }
 }
 
-void* cursor_value(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
-    return leaf_node_value(page, cursor->cell_num);
+ExecuteResult execute_statement(Statement* statement, Table* table, DbBatchCallback callback,
+                                void* context) {
+    uint64_t start = stats_now();
+    ExecuteResult result = run_statement(statement, table, callback, context);
+    stats_record_phase(table->pager, DB_PHASE_EXECUTE, stats_now() - start);
+    return result;
 }
 
-void cursor_advance(Cursor* cursor) {
-    uint32_t page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+/*******************************************************************
+ * 嵌入式接口，见 db.h
+ *******************************************************************/
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
-        /* 前进到下一个叶节点 */
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0) {
-            /* 已经到达最右叶节点了 */
-            cursor->end_of_table = true;
-        } else {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
-        }
+Statement* db_prepare(Table* table, const char* sql, PrepareResult* result) {
+    // 解析会改写字符串，在副本上进行
+    uint64_t start = stats_now();
+    char* buffer = strdup(sql);
+    Statement* statement = malloc(sizeof(Statement));
+    *result = prepare_statement(buffer, statement);
+    free(buffer);
+    stats_record_phase(table->pager, DB_PHASE_PREPARE, stats_now() - start);
+    if (*result != PREPARE_SUCCESS) {
+        free(statement);
+        return NULL;
     }
+    statement->table = table;
+    return statement;
 }
 
-/*******************************************************************
- * 输入缓冲区的构造和释放，打印提示，读取输入
- *******************************************************************/
-
-InputBuffer* new_input_buffer() {
-    InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
+PrepareResult db_bind_id(Statement* statement, uint32_t index, uint64_t value) {
+    if (index < 1 || index > statement->num_params) {
+        return PREPARE_INVALID_PARAMETER;
+    }
+    ParamTarget target = statement->params[index - 1];
+    if (target == PARAM_USERNAME || target == PARAM_EMAIL || target == PARAM_WHERE_VALUE) {
+        return PREPARE_INVALID_PARAMETER;
+    }
 
-    return input_buffer;
+    if (target == PARAM_ID) {
+        statement->row_to_insert.id = value;
+    } else {
+        statement->select_operands[target - PARAM_SELECT_OPERAND_0] = value;
+    }
+    statement->bound_params |= 1u << (index - 1);
+    return PREPARE_SUCCESS;
 }
 
-void print_prompt() {
-    printf("db > ");
+PrepareResult db_bind_int(Statement* statement, uint32_t index, int64_t value) {
+    if (value < 0) {
+        return PREPARE_NEGATIVE_ID;
+    }
+    return db_bind_id(statement, index, value);
 }
 
-void read_input(InputBuffer* input_buffer) {
-    ssize_t bytes_read =
-        getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-
-    if (bytes_read <= 0) {
-        printf("Error reading input\n");
-        exit(EXIT_FAILURE);
+PrepareResult db_bind_text(Statement* statement, uint32_t index, const char* value) {
+    if (index < 1 || index > statement->num_params) {
+        return PREPARE_INVALID_PARAMETER;
+    }
+    PrepareResult result;
+    switch (statement->params[index - 1]) {
+        case (PARAM_USERNAME):
+            result = statement_set_text(statement->row_to_insert.username, value,
+                                        COLUMN_USERNAME_SIZE);
+            break;
+        case (PARAM_EMAIL):
+            result = statement_set_text(statement->row_to_insert.email, value,
+                                        COLUMN_EMAIL_SIZE);
+            break;
+        case (PARAM_WHERE_VALUE):
+            result = statement_set_text(statement->where_value, value,
+                                        index_column_size(statement->column));
+            break;
+        default:
+            return PREPARE_INVALID_PARAMETER;
     }
+    if (result == PREPARE_SUCCESS) {
+        statement->bound_params |= 1u << (index - 1);
+    }
+    return result;
+}
 
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+ExecuteResult db_step(Statement* statement, DbRowCallback callback, void* context) {
+    if (callback == NULL) {
+        return execute_statement(statement, statement->table, NULL, NULL);
+    }
+    RowCallbackAdapter adapter;
+    adapter.callback = callback;
+    adapter.context = context;
+    return execute_statement(statement, statement->table, row_adapter_callback, &adapter);
 }
 
-void close_input_buffer(InputBuffer* input_buffer) {
-    free(input_buffer->buffer);
-    free(input_buffer);
+ExecuteResult db_step_batch(Statement* statement, DbBatchCallback callback, void* context) {
+    return execute_statement(statement, statement->table, callback, context);
 }
 
-/*******************************************************************
- * 元命令
- *******************************************************************/
+void db_finalize(Statement* statement) {
+    statement_free_rows(statement);
+    free(statement);
+}
 
-void indent(uint32_t level) {
-    for (uint32_t i = 0; i < level; i++) {
-        printf("  ");
+void db_stats(Table* table, DbStats* stats) {
+    Pager* pager = table->pager;
+    uint64_t counters[NUM_STATS] = {0};
+    memset(stats, 0, sizeof(DbStats));
+    pthread_mutex_lock(&pager->stats_lock);
+    for (StatsShard* shard = pager->stats_shards; shard != NULL; shard = shard->next) {
+        for (uint32_t i = 0; i < NUM_STATS; i++) {
+            counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (uint32_t phase = 0; phase < DB_NUM_PHASES; phase++) {
+            stats->phase_count[phase] +=
+                __atomic_load_n(&shard->phase_count[phase], __ATOMIC_RELAXED);
+            stats->phase_nanos[phase] +=
+                __atomic_load_n(&shard->phase_nanos[phase], __ATOMIC_RELAXED);
+            for (uint32_t i = 0; i < DB_STATS_HISTOGRAM_BUCKETS; i++) {
+                stats->phase_histogram[phase][i] +=
+                    __atomic_load_n(&shard->phase_histogram[phase][i], __ATOMIC_RELAXED);
+            }
+        }
     }
+    pthread_mutex_unlock(&pager->stats_lock);
+    stats->cache_hits = counters[STAT_CACHE_HITS];
+    stats->cache_misses = counters[STAT_CACHE_MISSES];
+    stats->evictions = counters[STAT_EVICTIONS];
+    stats->bytes_read = counters[STAT_BYTES_READ];
+    stats->bytes_written = counters[STAT_BYTES_WRITTEN];
+    stats->fsyncs = counters[STAT_FSYNCS];
+    stats->leaf_splits = counters[STAT_LEAF_SPLITS];
+    stats->internal_splits = counters[STAT_INTERNAL_SPLITS];
+    stats->row_cache_hits = counters[STAT_ROW_CACHE_HITS];
+    stats->row_cache_misses = counters[STAT_ROW_CACHE_MISSES];
 }
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-    void* node = get_page(pager, page_num);
-    uint32_t num_keys, child;
-
-    switch (get_node_type(node)) {
-        case (NODE_LEAF):
-            num_keys = *leaf_node_num_cells(node);
-            indent(indentation_level);
-            printf("- leaf (size %d)\n", num_keys);
-            for (uint32_t i = 0; i < num_keys; i++) {
-                indent(indentation_level + 1);
-                printf("- %d\n", *leaf_node_key(node, i));
-            }
-            break;
-        case (NODE_INTERNAL):
-            num_keys = *internal_node_num_keys(node);
-            indent(indentation_level);
-            printf("- internal (size %d)\n", num_keys);
-            if (num_keys > 0) {
-                for (uint32_t i = 0; i < num_keys; i++) {
-                    child = *internal_node_child(node, i);
-                    print_tree(pager, child, indentation_level + 1);
+void db_tree_stats(Table* table, DbTreeStats* stats) {
+    Pager* pager = table->pager;
+    // 事务中看自己的修改，否则在快照中遍历，不挡住写者
+    bool in_transaction = txn_table == table;
+    uint64_t snapshot = in_transaction ? SNAPSHOT_LATEST : pager_snapshot_begin(pager);
 
-                    indent(indentation_level + 1);
-                    printf("- key %d\n", *internal_node_key(node, i));
-                }
-                child = *internal_node_right_child(node);
-                print_tree(pager, child, indentation_level + 1);
-            }
+    stats->height = 1;
+    uint32_t page_num = table->root_page_num;
+    while (true) {
+        uint32_t mark = pager_pin_mark(pager);
+        void* node = get_page_snapshot(pager, page_num, snapshot);
+        bool leaf = get_node_type(node) == NODE_LEAF;
+        if (!leaf) {
+            page_num = *internal_node_child(node, 0);
+            stats->height++;
+        }
+        pager_release_pins(pager, mark);
+        if (leaf) {
             break;
+        }
     }
-}
 
-void print_constants() {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
-}
+    stats->leaf_pages = 0;
+    stats->rows = 0;
+    uint64_t used_space = 0;
+    while (page_num != 0) {
+        uint32_t mark = pager_pin_mark(pager);
+        void* node = get_page_snapshot(pager, page_num, snapshot);
+        stats->leaf_pages++;
+        stats->rows += *leaf_node_num_cells(node);
+        used_space += leaf_node_used_space(node);
+        page_num = *leaf_node_next_leaf(node);
+        pager_release_pins(pager, mark);
+    }
+    stats->leaf_fill = (double)used_space / ((double)stats->leaf_pages * LEAF_NODE_SPACE_FOR_CELLS);
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
-    if (strcmp(input_buffer->buffer, ".exit") == 0) {
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    } else if (strcmp(input_buffer->buffer, ".btree") == 0) {
-        printf("Tree:\n");
-        // print_leaf_node(get_page(table->pager, 0));
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
-    } else if (strcmp(input_buffer->buffer, ".constants") == 0) {
-        printf("Constants:\n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    } else {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    if (!in_transaction) {
+        pager_snapshot_end(pager, snapshot);
     }
 }
 
 /*******************************************************************
- * 前端，SQL 编译器
+ * 批量导入
  *******************************************************************/
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
-    statement->type = STATEMENT_INSERT;
+/**
+ * .import FILE [FILL_PERCENT]
+ * FILE 为每行 "id,username,email" 的 CSV，以 .bin 结尾时为 serialize_row
+ * 格式的定长记录。输入未排序时先做外部归并排序，
+ * 然后自底向上逐层写出 B 树，整个过程中不会拆分节点。
+ */
+#define IMPORT_RUN_ROWS (1 << 16)
+#define IMPORT_RUN_BUFFER_ROWS 64
+#define IMPORT_MAX_LINE 1024
+#define BULK_MAX_LEVELS 32
+
+typedef struct {
+    FILE* file;
+    bool binary;
+    uint32_t line_num;
+    char* line;
+    void* record;
+} ImportReader;
+
+/**
+ * 临时文件中一段已排序的行
+ */
+typedef struct {
+    FILE* file;
+    off_t offset;
+    off_t end;
+    Row buffer[IMPORT_RUN_BUFFER_ROWS];
+    uint32_t buffer_pos;
+    uint32_t buffer_len;
+} ImportRun;
+
+typedef struct {
+    uint32_t page_num;  // INVALID_PAGE_NUM 表示没有节点
+    uint32_t count;     // 叶节点为单元格数，内部节点为子节点数
+    uint32_t bytes;     // 叶节点已用的槽位和负载字节数
+    uint64_t min_key;   // 节点中的第一个键，存差值时也是基准键，节点中没有键时无意义
+    uint64_t max_key;
+} BulkNode;
+
+typedef struct {
+    BulkNode open;     // 正在填充的节点
+    BulkNode pending;  // 已填满但还没交给上一层，最后一个节点不足时从它借
+} BulkLevel;
 
-    char* keyword = strtok(input_buffer->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
+typedef struct {
+    Table* table;
+    uint32_t leaf_capacity;      // 每个叶节点装入的字节数
+    uint32_t internal_capacity;  // 每个内部节点装入的子节点数
+    uint32_t internal_wide_capacity;  // 存完整的键时每个内部节点装入的子节点数
+    uint32_t prev_leaf_page_num;
+    uint32_t num_rows;
+    uint32_t num_levels;
+    BulkLevel levels[BULK_MAX_LEVELS];
+} BulkLoader;
+
+PrepareResult parse_import_line(char* line, Row* row) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char* id_string = strtok(line, ",");
+    char* username = strtok(NULL, ",");
+    char* email = strtok(NULL, ",");
 
     if (id_string == NULL || username == NULL || email == NULL) {
         return PREPARE_SYNTAX_ERROR;
     }
 
-    int id = atoi(id_string);
-    if (id < 0) {
-        return PREPARE_NEGATIVE_ID;
+    PrepareResult result = parse_id(id_string, &row->id);
+    if (result != PREPARE_SUCCESS) {
+        return result;
     }
     if (strlen(username) > COLUMN_USERNAME_SIZE) {
         return PREPARE_STRING_TOO_LONG;
@@ -693,401 +7292,783 @@ PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
         return PREPARE_STRING_TOO_LONG;
     }
 
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
+    strcpy(row->username, username);
+    strcpy(row->email, email);
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_import_record(void* record, Row* row) {
+    deserialize_row(record, row);
+    if (memchr(row->username, '\0', USERNAME_SIZE) == NULL ||
+        memchr(row->email, '\0', EMAIL_SIZE) == NULL) {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 读取下一条有效的行，跳过无法解析的行。到达文件末尾时返回 false。
+ */
+bool import_next_row(ImportReader* reader, Row* row, bool report_errors) {
+    while (true) {
+        PrepareResult result;
+        if (reader->binary) {
+            if (fread(reader->record, ROW_SIZE, 1, reader->file) != 1) {
+                return false;
+            }
+            reader->line_num++;
+            result = parse_import_record(reader->record, row);
+        } else {
+            if (fgets(reader->line, IMPORT_MAX_LINE, reader->file) == NULL) {
+                return false;
+            }
+            reader->line_num++;
+            result = parse_import_line(reader->line, row);
+        }
+
+        if (result == PREPARE_SUCCESS) {
+            return true;
+        }
+        if (report_errors) {
+            switch (result) {
+                case (PREPARE_NEGATIVE_ID):
+                    printf("Line %d: ID must be positive.\n", reader->line_num);
+                    break;
+                case (PREPARE_STRING_TOO_LONG):
+                    printf("Line %d: String is too long.\n", reader->line_num);
+                    break;
+                default:
+                    printf("Line %d: Syntax error. Could not parse row.\n",
+                           reader->line_num);
+                    break;
+            }
+        }
+    }
+}
+
+void import_rewind(ImportReader* reader) {
+    rewind(reader->file);
+    reader->line_num = 0;
+}
 
-    return PREPARE_SUCCESS;
+int compare_rows_by_id(const void* a, const void* b) {
+    uint64_t id_a = ((const Row*)a)->id;
+    uint64_t id_b = ((const Row*)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer,
-                                Statement* statement) {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
-        return prepare_insert(input_buffer, statement);
-    }
-    if (strcmp(input_buffer->buffer, "select") == 0) {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+bool import_run_next(ImportRun* run, Row* row) {
+    if (run->buffer_pos == run->buffer_len) {
+        off_t remaining = (run->end - run->offset) / sizeof(Row);
+        if (remaining == 0) {
+            return false;
+        }
+        uint32_t count = remaining < IMPORT_RUN_BUFFER_ROWS ? remaining
+                                                            : IMPORT_RUN_BUFFER_ROWS;
+        if (pread(fileno(run->file), run->buffer, count * sizeof(Row), run->offset) !=
+            (ssize_t)(count * sizeof(Row))) {
+            printf("Error reading import run: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        run->offset += count * sizeof(Row);
+        run->buffer_pos = 0;
+        run->buffer_len = count;
     }
-
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    *row = run->buffer[run->buffer_pos++];
+    return true;
 }
 
-/*******************************************************************
- * 虚拟机
- *******************************************************************/
+void bulk_open_node(BulkLoader* loader, uint32_t level) {
+    Pager* pager = loader->table->pager;
+    uint32_t mark = pager_pin_mark(pager);
 
-void serialize_row(Row* source, void* destination) {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+    uint32_t page_num = get_unused_page_num(loader->table);
+    void* node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    if (level == 0) {
+        initialize_leaf_node(node);
+        if (loader->prev_leaf_page_num != INVALID_PAGE_NUM) {
+            void* prev_leaf = get_page(pager, loader->prev_leaf_page_num);
+            *leaf_node_next_leaf(prev_leaf) = page_num;
+            mark_page_dirty(pager, loader->prev_leaf_page_num);
+        }
+        loader->prev_leaf_page_num = page_num;
+    } else {
+        initialize_internal_node(node);
+    }
+    pager_release_pins(pager, mark);
+
+    BulkLevel* bulk_level = &loader->levels[level];
+    bulk_level->open.page_num = page_num;
+    bulk_level->open.count = 0;
+    bulk_level->open.bytes = 0;
+    bulk_level->open.min_key = 0;
+    bulk_level->open.max_key = 0;
+    if (level >= loader->num_levels) {
+        loader->num_levels = level + 1;
+    }
 }
 
-void deserialize_row(void* source, Row* destination) {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
-}
+void bulk_add_child(BulkLoader* loader, uint32_t level, BulkNode child);
 
 /**
- * 在我们开始回收利用空闲页面之前，新页面将始终放在数据库文件的末尾
+ * 当前节点已满：把上一个已满的节点交给父层，当前节点变为待定节点。
  */
-uint32_t get_unused_page_num(Pager* pager) {
-    return pager->num_pages;
+void bulk_close_open_node(BulkLoader* loader, uint32_t level) {
+    BulkLevel* bulk_level = &loader->levels[level];
+    if (bulk_level->pending.page_num != INVALID_PAGE_NUM) {
+        bulk_add_child(loader, level + 1, bulk_level->pending);
+    }
+    bulk_level->pending = bulk_level->open;
+    bulk_level->open.page_num = INVALID_PAGE_NUM;
 }
 
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-    /**
-     * 处理拆分根节点。
-     * 旧根节点复制到新的页面，成为左子节点。
-     * 右子节点的地址作为参数传入。
-     * 重新初始化根页面，以包含新的根节点。
-     * 新的根节点指向两个子节点。
-     */
-
-    void* root = get_page(table->pager, table->root_page_num);
-    void* right_child = get_page(table->pager, right_child_page_num);
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void* left_child = get_page(table->pager, left_child_page_num);
-
-    if (get_node_type(root) == NODE_INTERNAL) {
-        initialize_internal_node(right_child);
-        initialize_internal_node(left_child);
+void bulk_add_child(BulkLoader* loader, uint32_t level, BulkNode child) {
+    if (level >= BULK_MAX_LEVELS) {
+        printf("Bulk load exceeded %d tree levels\n", BULK_MAX_LEVELS);
+        exit(EXIT_FAILURE);
+    }
+    Pager* pager = loader->table->pager;
+    BulkLevel* bulk_level = &loader->levels[level];
+    // 加入子节点要写入上一个子节点的最大键，它与第一个键的差值放不进 32 位时节点存完整的键
+    uint32_t capacity = loader->internal_capacity;
+    if (bulk_level->open.count >= 2 &&
+        bulk_level->open.max_key - bulk_level->open.min_key > UINT32_MAX) {
+        capacity = loader->internal_wide_capacity;
+    }
+    if (bulk_level->open.page_num != INVALID_PAGE_NUM && bulk_level->open.count >= capacity) {
+        bulk_close_open_node(loader, level);
+    }
+    if (bulk_level->open.page_num == INVALID_PAGE_NUM) {
+        bulk_open_node(loader, level);
     }
 
-    /* 左子节点有从旧根复制的数据 */
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
-
-    if (get_node_type(left_child) == NODE_INTERNAL) {
-        void* child;
-        for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-            child = get_page(table->pager, *internal_node_child(left_child, i));
-            *node_parent(child) = left_child_page_num;
+    uint32_t mark = pager_pin_mark(pager);
+    BulkNode* open = &bulk_level->open;
+    void* node = get_page(pager, open->page_num);
+    if (open->count > 0) {
+        if (open->count == 1) {
+            *internal_node_key_base(node) = open->max_key;
+            open->min_key = open->max_key;
+        } else {
+            internal_node_fit_keys(node, open->max_key, open->max_key);
         }
-        child = get_page(table->pager, *internal_node_right_child(left_child));
-        *node_parent(child) = left_child_page_num;
+        // 原来的右子节点移入单元格，新的子节点成为右子节点
+        *internal_node_cell(node, open->count - 1) = *internal_node_right_child(node);
+        internal_node_set_key(node, open->count - 1, open->max_key);
+        *internal_node_num_keys(node) = open->count;
     }
-
-    /* 根节点是一个新的内部节点，有一个键和两个子节点 */
-    initialize_internal_node(root);
-    set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
+    *internal_node_right_child(node) = child.page_num;
+    mark_page_dirty(pager, open->page_num);
+    open->count++;
+    open->max_key = child.max_key;
+    pager_release_pins(pager, mark);
 }
 
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    /**
-     * 向父节点添加一个与子节点对应的新的子节点/键对
-     */
-
-    void* parent = get_page(table->pager, parent_page_num);
-    void* child = get_page(table->pager, child_page_num);
-    // uint32_t child_max_key = get_node_max_key(child);
-    uint32_t child_max_key = get_node_max_key(table->pager, child);  // 新增
-    uint32_t index = internal_node_find_child(parent, child_max_key);
-
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
-    // *internal_node_num_keys(parent) = original_num_keys + 1;
+void bulk_add_row(BulkLoader* loader, Row* row) {
+    Pager* pager = loader->table->pager;
+    BulkLevel* bulk_level = &loader->levels[0];
+    uint8_t payload[LEAF_NODE_MAX_PAYLOAD_SIZE];
+    LeafCell cell;
+    cell.key = row->id;
+    cell.payload = payload;
+    cell.size = encode_row(row, payload);
+    uint32_t cell_bytes = LEAF_NODE_SLOT_SIZE + cell.size;
+    BulkNode* open = &bulk_level->open;
+    if (open->page_num != INVALID_PAGE_NUM && open->count > 0) {
+        // 键范围超过 32 位时节点改存完整的键，已有的槽位也一起变大
+        uint32_t mark = pager_pin_mark(pager);
+        void* node = get_page(pager, open->page_num);
+        bool full = leaf_node_used_space_after(node, row->id, cell_bytes) > loader->leaf_capacity;
+        pager_release_pins(pager, mark);
+        if (full) {
+            bulk_close_open_node(loader, 0);
+        }
+    }
+    if (open->page_num == INVALID_PAGE_NUM) {
+        bulk_open_node(loader, 0);
+    }
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-        // printf("Need to implement splitting internal node\n");
-        // exit(EXIT_FAILURE);
-        internal_node_split_and_insert(table, parent_page_num, child_page_num);  // 新增
-        return;                                                                  // 新增
+    uint32_t mark = pager_pin_mark(pager);
+    void* node = get_page(pager, open->page_num);
+    if (open->count == 0) {
+        // 行按键递增，以第一个键为基准键，后面的键都在它之后
+        *leaf_node_key_base(node) = row->id;
+        open->min_key = row->id;
+    } else {
+        leaf_node_fit_key(node, row->id);
     }
+    leaf_node_insert_cell(node, open->count, cell);
+    mark_page_dirty(pager, open->page_num);
+    open->bytes = leaf_node_used_space(node);
+    pager_release_pins(pager, mark);
 
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
-    /**
-     * 右子节点为 INVALID_PAGE_NUM 的内部节点为空
-     */
-    if (right_child_page_num == INVALID_PAGE_NUM) {           // 新增
-        *internal_node_right_child(parent) = child_page_num;  // 新增
-        return;                                               // 新增
-    }                                                         // 新增
+    open->count++;
+    open->max_key = row->id;
+    loader->num_rows++;
 
-    void* right_child = get_page(table->pager, right_child_page_num);
     /**
-     * 如果某个节点的单元格数已经达到上限，
-     * 我们就不能在拆分前进行递增。
-     * 在不插入新键/子节点对的情况下进行递增，
-     * 并立即调用 internal_node_split_and_insert
-     * 会在 (max_cells + 1) 处创建一个新键，
-     * 并带有一个未初始化的值。
+     * 新页面在根节点指向它们之前都不可达，可以分批提交，
+     * 启用 WAL 时写集合就不会占满缓冲池。
      */
-    *internal_node_num_keys(parent) = original_num_keys + 1;  // 新增
-
-    // if (child_max_key > get_node_max_key(right_child)) {
-    if (child_max_key > get_node_max_key(table->pager, right_child)) {  // 新增
-        /* 取代右子节点 */
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) =
-            // get_node_max_key(right_child);
-            get_node_max_key(table->pager, right_child);  // 新增
-        *internal_node_right_child(parent) = child_page_num;
-    } else {
-        /* 为新的单元格腾出位置 */
-        for (uint32_t i = original_num_keys; i > index; i--) {
-            void* destination = internal_node_cell(parent, i);
-            void* source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-        }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
+    uint32_t commit_pages = pager->frame_limit > 0 ? pager->frame_limit / 2 : 1024;
+    if (pager->txn_num_pages >= commit_pages) {
+        pager_commit(pager);
     }
 }
 
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
-}
-
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-    uint32_t old_page_num = parent_page_num;
-    void* old_node = get_page(table->pager, parent_page_num);
-    uint32_t old_max = get_node_max_key(table->pager, old_node);
-
-    void* child = get_page(table->pager, child_page_num);
-    uint32_t child_max = get_node_max_key(table->pager, child);
-
-    uint32_t new_page_num = get_unused_page_num(table->pager);
-
-    /*
-    Declaring a flag before updating pointers which
-    records whether this operation involves splitting the root -
-    if it does, we will insert our newly created node during
-    the step where the table's new root is created. If it does
-    not, we have to insert the newly created node into its parent
-    after the old node's keys have been transferred over. We are not
-    able to do this if the newly created node's parent is not a newly
-    initialized root node, because in that case its parent may have existing
-    keys aside from our old node which we are splitting. If that is true, we
-    need to find a place for our newly created node in its parent, and we
-    cannot insert it at the correct index if it does not yet have any keys
-    */
-    uint32_t splitting_root = is_node_root(old_node);
-
-    void* parent;
-    void* new_node;
-    if (splitting_root) {
-        create_new_root(table, new_page_num);
-        parent = get_page(table->pager, table->root_page_num);
-        /*
-        If we are splitting the root, we need to update old_node to point
-        to the new root's left child, new_page_num will already point to
-        the new root's right child
-        */
-        old_page_num = *internal_node_child(parent, 0);
-        old_node = get_page(table->pager, old_page_num);
-    } else {
-        parent = get_page(table->pager, *node_parent(old_node));
-        new_node = get_page(table->pager, new_page_num);
-        initialize_internal_node(new_node);
+/**
+ * 叶节点按字节数平衡：最后一个叶节点不足一半时，与待定节点平分。
+ */
+void bulk_rebalance_leaves(BulkLoader* loader) {
+    Pager* pager = loader->table->pager;
+    BulkNode* left = &loader->levels[0].pending;
+    BulkNode* right = &loader->levels[0].open;
+    if (right->bytes >= (left->bytes + right->bytes) / 2) {
+        return;
     }
 
-    uint32_t* old_num_keys = internal_node_num_keys(old_node);
-
-    uint32_t cur_page_num = *internal_node_right_child(old_node);
-    void* cur = get_page(table->pager, cur_page_num);
-
-    /*
-    First put right child into new node and set right child of old node to invalid page number
-    */
-    internal_node_insert(table, new_page_num, cur_page_num);
-    *node_parent(cur) = new_page_num;
-    *internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-    /*
-    For each key until you get to the middle key, move the key and the child to the new node
-    */
-    for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
-        cur_page_num = *internal_node_child(old_node, i);
-        cur = get_page(table->pager, cur_page_num);
-
-        internal_node_insert(table, new_page_num, cur_page_num);
-        *node_parent(cur) = new_page_num;
-
-        (*old_num_keys)--;
+    uint32_t mark = pager_pin_mark(pager);
+    void* left_node = get_page(pager, left->page_num);
+    void* right_node = get_page(pager, right->page_num);
+    void* original = malloc(PAGE_SIZE * 2);
+    memcpy(original, left_node, PAGE_SIZE);
+    memcpy(original + PAGE_SIZE, right_node, PAGE_SIZE);
+
+    uint32_t total = left->count + right->count;
+    LeafCell* cells = malloc(sizeof(LeafCell) * total);
+    for (uint32_t i = 0; i < left->count; i++) {
+        cells[i] = leaf_node_get_cell(original, i);
+    }
+    for (uint32_t i = 0; i < right->count; i++) {
+        cells[left->count + i] = leaf_node_get_cell(original + PAGE_SIZE, i);
+    }
+    // 两边合起来要存完整的键时槽位变大，平分后可能放不下，这时最后一个叶节点空一些
+    uint32_t left_count = leaf_cells_split_to_fit(cells, total);
+    if (left_count > 0) {
+        leaf_node_set_cells(left_node, cells, left_count);
+        leaf_node_set_cells(right_node, cells + left_count, total - left_count);
+    }
+    free(cells);
+    free(original);
+    if (left_count == 0) {
+        pager_release_pins(pager, mark);
+        return;
     }
 
-    /*
-    Set child before middle key, which is now the highest key, to be node's right child,
-    and decrement number of keys
-    */
-    *internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys - 1);
-    (*old_num_keys)--;
+    left->count = left_count;
+    left->bytes = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(left_node);
+    left->max_key = leaf_node_key(left_node, left_count - 1);
+    right->min_key = leaf_node_key(right_node, 0);
+    right->count = total - left_count;
+    right->bytes = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(right_node);
+    mark_page_dirty(pager, left->page_num);
+    mark_page_dirty(pager, right->page_num);
+    pager_release_pins(pager, mark);
+}
 
-    /*
-    Determine which of the two nodes after the split should contain the child to be inserted,
-    and insert the child
-    */
-    uint32_t max_after_split = get_node_max_key(table->pager, old_node);
+/**
+ * 每层最后一个节点可能很空，从左边的待定节点借一半过来。
+ */
+void bulk_rebalance(BulkLoader* loader, uint32_t level) {
+    if (level == 0) {
+        bulk_rebalance_leaves(loader);
+        return;
+    }
+    Pager* pager = loader->table->pager;
+    BulkNode* left = &loader->levels[level].pending;
+    BulkNode* right = &loader->levels[level].open;
+    uint32_t total = left->count + right->count;
+    uint32_t right_count = total / 2;
+    if (right->count >= right_count) {
+        return;
+    }
+    uint32_t move = right_count - right->count;
+    uint32_t left_count = left->count - move;
+
+    uint32_t mark = pager_pin_mark(pager);
+    void* left_node = get_page(pager, left->page_num);
+    void* right_node = get_page(pager, right->page_num);
+    uint32_t* children = malloc(sizeof(uint32_t) * total);
+    uint64_t* max_keys = malloc(sizeof(uint64_t) * total);
+    for (uint32_t i = 0; i + 1 < left->count; i++) {
+        children[i] = *internal_node_cell(left_node, i);
+        max_keys[i] = internal_node_key(left_node, i);
+    }
+    children[left->count - 1] = *internal_node_right_child(left_node);
+    max_keys[left->count - 1] = left->max_key;
+    for (uint32_t i = 0; i + 1 < right->count; i++) {
+        children[left->count + i] = *internal_node_cell(right_node, i);
+        max_keys[left->count + i] = internal_node_key(right_node, i);
+    }
+    children[total - 1] = *internal_node_right_child(right_node);
+    max_keys[total - 1] = right->max_key;
+
+    // 平分后要存完整的键而放不下时不平分，最后一个节点空一些
+    if (internal_children_fit(max_keys, left_count) &&
+        internal_children_fit(max_keys + left_count, right_count)) {
+        internal_node_set_children(left_node, children, max_keys, left_count);
+        internal_node_set_children(right_node, children + left_count,
+                                   max_keys + left_count, right_count);
+        mark_page_dirty(pager, left->page_num);
+        mark_page_dirty(pager, right->page_num);
+        left->max_key = max_keys[left_count - 1];
+        left->count = left_count;
+        right->count = right_count;
+    }
+    free(children);
+    free(max_keys);
+    pager_release_pins(pager, mark);
+}
 
-    uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
+/**
+ * 逐层收尾，直到某一层只剩一个节点，把它复制到根页面。
+ */
+void bulk_finish(BulkLoader* loader) {
+    if (loader->num_rows == 0) {
+        return;
+    }
+    Pager* pager = loader->table->pager;
 
-    internal_node_insert(table, destination_page_num, child_page_num);
-    *node_parent(child) = destination_page_num;
+    uint32_t level = 0;
+    while (true) {
+        BulkLevel* bulk_level = &loader->levels[level];
+        bool has_pending = bulk_level->pending.page_num != INVALID_PAGE_NUM;
+        if (!has_pending && level + 1 >= loader->num_levels) {
+            break;
+        }
+        if (has_pending) {
+            bulk_rebalance(loader, level);
+            bulk_add_child(loader, level + 1, bulk_level->pending);
+        }
+        bulk_add_child(loader, level + 1, bulk_level->open);
+        level++;
+    }
 
-    update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
+    uint32_t mark = pager_pin_mark(pager);
+    uint32_t top_page_num = loader->levels[level].open.page_num;
+    void* top = get_page(pager, top_page_num);
+    // 其他页面在这之前都无法从根到达，只有根页面需要挡住读者
+    void* root = get_page_latched(pager, loader->table->root_page_num, LATCH_EXCLUSIVE);
+    mark_page_dirty(pager, loader->table->root_page_num);
+    uint32_t meta_page_num = *root_node_meta_page(root);
+    memcpy(root, top, PAGE_SIZE);
+    set_node_root(root, true);
+    *root_node_meta_page(root) = meta_page_num;
+    // 原来的顶层页面不再被引用
+    free_page(loader->table, top_page_num);
+    pager_release_pins(pager, mark);
+}
 
-    if (!splitting_root) {
-        internal_node_insert(table, *node_parent(old_node), new_page_num);
-        *node_parent(new_node) = *node_parent(old_node);
+void bulk_add_unique_row(BulkLoader* loader, Row* row, bool* has_last, uint64_t* last_id) {
+    if (*has_last && row->id == *last_id) {
+        printf("Skipped duplicate id %" PRIu64 ".\n", row->id);
+        return;
     }
+    *has_last = true;
+    *last_id = row->id;
+    bulk_add_row(loader, row);
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-    /**
-     * 创建一个新节点并将一半的单元格移到新节点。
-     * 在两个节点中的一个中插入新值。
-     * 更新父节点或创建一个新的父节点。
-     */
-
-    // 获取旧节点的指针
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-    // 获取一个未使用的页号，并使用它创建新节点
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    // 获取新节点的指针
-    void* new_node = get_page(cursor->table->pager, new_page_num);
-    // 初始化新节点
-    initialize_leaf_node(new_node);
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node) = new_page_num;
-
-    /**
-     * 所有现有键加上新键应该均匀地分配在
-     * 旧（左）和新（右）节点之间。
-     * 从右边开始，将每个键移动到正确的位置。
-     */
+/**
+ * 把输入切成有序段写入临时文件，再用小顶堆做多路归并。
+ */
+void bulk_load_unsorted(BulkLoader* loader, ImportReader* reader) {
+    FILE* runs_file = tmpfile();
+    if (runs_file == NULL) {
+        printf("Unable to create temporary file for sorting\n");
+        exit(EXIT_FAILURE);
+    }
 
-    // 从右到左迭代处理节点的单元格
-    // i 只是迭代器，用于计算单元格编号，并非直接表示单元格编号
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-        void* destination_node;
-        // 判断是放入旧节点还是新节点
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
-            destination_node = new_node;
-        } else {
-            destination_node = old_node;
+    Row* chunk = malloc(sizeof(Row) * IMPORT_RUN_ROWS);
+    ImportRun** runs = NULL;
+    uint32_t num_runs = 0;
+    off_t offset = 0;
+    bool more = true;
+    while (more) {
+        uint32_t count = 0;
+        while (count < IMPORT_RUN_ROWS && (more = import_next_row(reader, &chunk[count], false))) {
+            count++;
+        }
+        if (count == 0) {
+            break;
+        }
+        qsort(chunk, count, sizeof(Row), compare_rows_by_id);
+        if (pwrite(fileno(runs_file), chunk, count * sizeof(Row), offset) !=
+            (ssize_t)(count * sizeof(Row))) {
+            printf("Error writing import run: %d\n", errno);
+            exit(EXIT_FAILURE);
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leaf_node_cell(destination_node, index_within_node);
 
-        if (i == cursor->cell_num) {
-            serialize_row(value,
-                          leaf_node_value(destination_node, index_within_node));
-            *leaf_node_key(destination_node, index_within_node) = key;
-        } else if (i > cursor->cell_num) {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
-        } else {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+        runs = realloc(runs, sizeof(ImportRun*) * (num_runs + 1));
+        ImportRun* run = malloc(sizeof(ImportRun));
+        run->file = runs_file;
+        run->offset = offset;
+        run->end = offset + count * sizeof(Row);
+        run->buffer_pos = 0;
+        run->buffer_len = 0;
+        runs[num_runs++] = run;
+        offset = run->end;
+    }
+    free(chunk);
+
+    // heap[i] 是段下标，按各段当前行的 id 排成小顶堆
+    Row* heads = malloc(sizeof(Row) * (num_runs > 0 ? num_runs : 1));
+    uint32_t* heap = malloc(sizeof(uint32_t) * (num_runs > 0 ? num_runs : 1));
+    uint32_t heap_size = 0;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        if (!import_run_next(runs[i], &heads[i])) {
+            continue;
+        }
+        uint32_t pos = heap_size++;
+        while (pos > 0 && heads[heap[(pos - 1) / 2]].id > heads[i].id) {
+            heap[pos] = heap[(pos - 1) / 2];
+            pos = (pos - 1) / 2;
         }
+        heap[pos] = i;
     }
 
-    /* 更新两个叶节点上的单元格数 */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    bool has_last = false;
+    uint64_t last_id = 0;
+    while (heap_size > 0) {
+        uint32_t top = heap[0];
+        bulk_add_unique_row(loader, &heads[top], &has_last, &last_id);
 
-    // 如果旧节点是根节点
-    if (is_node_root(old_node)) {
-        // 创建一个新的根节点
-        return create_new_root(cursor->table, new_page_num);
-    } else {
-        uint32_t parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-        void* parent = get_page(cursor->table->pager, parent_page_num);
+        if (!import_run_next(runs[top], &heads[top])) {
+            top = heap[--heap_size];
+        }
+        // 下沉
+        uint32_t pos = 0;
+        while (true) {
+            uint32_t smallest = pos;
+            uint32_t left = 2 * pos + 1;
+            uint32_t right = left + 1;
+            uint64_t smallest_id = heads[top].id;
+            if (left < heap_size && heads[heap[left]].id < smallest_id) {
+                smallest = left;
+                smallest_id = heads[heap[left]].id;
+            }
+            if (right < heap_size && heads[heap[right]].id < smallest_id) {
+                smallest = right;
+            }
+            if (smallest == pos) {
+                break;
+            }
+            heap[pos] = heap[smallest];
+            pos = smallest;
+        }
+        if (heap_size > 0) {
+            heap[pos] = top;
+        }
+    }
 
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
-        return;
+    for (uint32_t i = 0; i < num_runs; i++) {
+        free(runs[i]);
     }
+    free(runs);
+    free(heads);
+    free(heap);
+    fclose(runs_file);
 }
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+bool has_suffix(const char* string, const char* suffix) {
+    size_t string_length = strlen(string);
+    size_t suffix_length = strlen(suffix);
+    return string_length >= suffix_length &&
+           strcmp(string + string_length - suffix_length, suffix) == 0;
+}
 
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
-        // Node full
-        leaf_node_split_and_insert(cursor, key, value);
+void bulk_import(Table* table, const char* path, uint32_t fill_percent) {
+    uint32_t mark = pager_pin_mark(table->pager);
+    void* root = get_page(table->pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    pager_release_pins(table->pager, mark);
+    if (!empty) {
+        printf("Table must be empty to import.\n");
         return;
     }
 
-    if (cursor->cell_num < num_cells) {
-        // Make room for new cell
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
+    ImportReader reader;
+    reader.file = fopen(path, "r");
+    if (reader.file == NULL) {
+        printf("Unable to open '%s'.\n", path);
+        return;
+    }
+    reader.binary = has_suffix(path, ".bin");
+    reader.line_num = 0;
+    reader.line = malloc(IMPORT_MAX_LINE);
+    reader.record = malloc(ROW_SIZE);
+
+    // 第一遍：报告错误行，顺便检查是否已经有序
+    bool sorted = true;
+    bool has_last = false;
+    uint64_t last_id = 0;
+    Row row;
+    while (import_next_row(&reader, &row, true)) {
+        if (has_last && row.id < last_id) {
+            sorted = false;
         }
+        has_last = true;
+        last_id = row.id;
+    }
+    import_rewind(&reader);
+
+    BulkLoader loader;
+    loader.table = table;
+    loader.leaf_capacity = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+    loader.internal_capacity = INTERNAL_NODE_MAX_CELLS * fill_percent / 100 + 1;
+    if (loader.internal_capacity < 2) {
+        loader.internal_capacity = 2;
+    }
+    loader.internal_wide_capacity = INTERNAL_NODE_WIDE_MAX_CELLS * fill_percent / 100 + 1;
+    if (loader.internal_wide_capacity < 2) {
+        loader.internal_wide_capacity = 2;
+    }
+    loader.prev_leaf_page_num = INVALID_PAGE_NUM;
+    loader.num_rows = 0;
+    loader.num_levels = 0;
+    for (uint32_t i = 0; i < BULK_MAX_LEVELS; i++) {
+        loader.levels[i].open.page_num = INVALID_PAGE_NUM;
+        loader.levels[i].pending.page_num = INVALID_PAGE_NUM;
     }
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
-}
+    if (sorted) {
+        has_last = false;
+        while (import_next_row(&reader, &row, false)) {
+            bulk_add_unique_row(&loader, &row, &has_last, &last_id);
+        }
+    } else {
+        bulk_load_unsorted(&loader, &reader);
+    }
+    bulk_finish(&loader);
+    table->path_cache_valid = false;
+    // 表原来是空的，已有的索引也是空的
+    for (uint32_t i = 0; i < NUM_INDEX_COLUMNS; i++) {
+        if (table->index_roots[i] != 0) {
+            index_build(table, i);
+        }
+    }
+    pager_commit(table->pager);
 
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-    Row* row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
+    printf("Imported %d rows.\n", loader.num_rows);
 
-    void* node = get_page(table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
+    free(reader.line);
+    free(reader.record);
+    fclose(reader.file);
+}
 
-    if (cursor->cell_num < num_cells) {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert) {
-            return EXECUTE_DUPLICATE_KEY;
-        }
-    }
+/*******************************************************************
+ * 基准测试
+ *
+ * 每个负载在新建的数据库上通过嵌入式接口执行，逐个操作计时。
+ * 结果每个负载一行 JSON，便于脚本比较前后两次的结果：
+ *   {"benchmark":"lookup","rows":10000,"cache_frames":1024,"ops":10000,
+ *    "ops_per_sec":812345,"p50_us":1.10,"p99_us":2.31,"p999_us":9.87}
+ *******************************************************************/
 
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+#define BENCH_MAX_LOOKUPS 100000
+#define BENCH_FULL_SCANS 5
+#define BENCH_RANGE_SCANS 1000
+#define BENCH_RANGE_ROWS 100
 
-    free(cursor);
+uint64_t bench_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-    return EXECUTE_SUCCESS;
+// xorshift64*，固定种子，每次运行的操作序列相同
+uint32_t bench_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return (*state * 0x2545F4914F6CDD1DULL) >> 32;
 }
 
-void print_row(Row* row) {
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+int compare_latencies(const void* a, const void* b) {
+    uint64_t left = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return left < right ? -1 : left > right;
 }
 
-ExecuteResult execute_select(Statement* statement, Table* table) {
-    Cursor* cursor = table_start(table);
+double bench_percentile_us(uint64_t* latencies, uint32_t ops, double fraction) {
+    uint32_t index = ops * fraction;
+    if (index >= ops) {
+        index = ops - 1;
+    }
+    return latencies[index] / 1000.0;
+}
 
-    Row row;
-    while (!(cursor->end_of_table)) {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+void bench_report(const char* name, uint32_t num_rows, DbOptions options,
+                  uint64_t* latencies, uint32_t ops, uint64_t elapsed) {
+    if (ops == 0) {
+        return;
     }
+    qsort(latencies, ops, sizeof(uint64_t), compare_latencies);
+    printf("{\"benchmark\":\"%s\",\"rows\":%u,\"cache_frames\":%u,\"page_size\":%u,"
+           "\"ops\":%u,\"ops_per_sec\":%.0f,\"p50_us\":%.2f,\"p99_us\":%.2f,"
+           "\"p999_us\":%.2f}\n",
+           name, num_rows, options.cache_frames, PAGE_SIZE, ops, ops * 1e9 / elapsed,
+           bench_percentile_us(latencies, ops, 0.50),
+           bench_percentile_us(latencies, ops, 0.99),
+           bench_percentile_us(latencies, ops, 0.999));
+}
 
-    free(cursor);
+bool bench_count_rows(const DbBatch* batch, void* context) {
+    *(uint64_t*)context += batch->count;
+    return true;
+}
 
-    return EXECUTE_SUCCESS;
+void bench_remove(const char* path) {
+    char* wal_path = wal_path_for(path);
+    unlink(path);
+    unlink(wal_path);
+    free(wal_path);
 }
 
-ExecuteResult execute_statement(Statement* statement, Table* table) {
-    switch (statement->type) {
-        case (STATEMENT_INSERT):
-            return execute_insert(statement, table);
-        case (STATEMENT_SELECT):
-            return execute_select(statement, table);
+/**
+ * 按 ids 的顺序逐行插入，每行一个事务，返回打开着的表。
+ */
+Table* bench_insert(const char* name, const char* path, uint32_t* ids, uint32_t num_rows,
+                    DbOptions options, uint64_t* latencies) {
+    bench_remove(path);
+    Table* table = db_open_with_options(path, options);
+    if (table == NULL) {
+        return NULL;
+    }
+    PrepareResult result;
+    Statement* insert = db_prepare(table, "insert ? ? ?", &result);
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    uint64_t started = bench_now();
+    for (uint32_t i = 0; i < num_rows; i++) {
+        uint64_t op_started = bench_now();
+        snprintf(username, sizeof(username), "user%u", ids[i]);
+        snprintf(email, sizeof(email), "person%u@example.com", ids[i]);
+        db_bind_id(insert, 1, ids[i]);
+        db_bind_text(insert, 2, username);
+        db_bind_text(insert, 3, email);
+        db_step(insert, NULL, NULL);
+        latencies[i] = bench_now() - op_started;
     }
+    bench_report(name, num_rows, options, latencies, num_rows, bench_now() - started);
+    db_finalize(insert);
+    return table;
+}
+
+/**
+ * 在 path 上依次运行顺序插入、随机插入、随机点查、全表扫描和范围扫描，
+ * 读负载在随机插入建成的表上、重新打开之后运行。结束时删除数据库文件。
+ */
+void db_bench(const char* path, uint32_t num_rows, DbOptions options) {
+    if (num_rows == 0) {
+        return;
+    }
+    uint32_t max_ops = num_rows > BENCH_MAX_LOOKUPS ? num_rows : BENCH_MAX_LOOKUPS;
+    uint64_t* latencies = malloc(sizeof(uint64_t) * max_ops);
+    uint32_t* ids = malloc(sizeof(uint32_t) * num_rows);
+    uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+    for (uint32_t i = 0; i < num_rows; i++) {
+        ids[i] = i + 1;
+    }
+    // 页面大小与打开着的数据库不同时打不开，什么也不测
+    Table* table = bench_insert("insert_seq", path, ids, num_rows, options, latencies);
+    if (table == NULL) {
+        free(ids);
+        free(latencies);
+        return;
+    }
+    db_close(table);
+    for (uint32_t i = num_rows - 1; i > 0; i--) {
+        uint32_t j = bench_random(&random_state) % (i + 1);
+        uint32_t swap = ids[i];
+        ids[i] = ids[j];
+        ids[j] = swap;
+    }
+    db_close(bench_insert("insert_random", path, ids, num_rows, options, latencies));
+    table = db_open_with_options(path, options);
+
+    PrepareResult result;
+    uint64_t rows_seen = 0;
+    Statement* lookup = db_prepare(table, "select where id = ?", &result);
+    uint32_t ops = num_rows < BENCH_MAX_LOOKUPS ? num_rows : BENCH_MAX_LOOKUPS;
+    uint64_t started = bench_now();
+    for (uint32_t i = 0; i < ops; i++) {
+        uint64_t op_started = bench_now();
+        db_bind_id(lookup, 1, bench_random(&random_state) % num_rows + 1);
+        db_step_batch(lookup, bench_count_rows, &rows_seen);
+        latencies[i] = bench_now() - op_started;
+    }
+    bench_report("lookup", num_rows, options, latencies, ops, bench_now() - started);
+    db_finalize(lookup);
+
+    Statement* scan = db_prepare(table, "select", &result);
+    started = bench_now();
+    for (uint32_t i = 0; i < BENCH_FULL_SCANS; i++) {
+        uint64_t op_started = bench_now();
+        db_step_batch(scan, bench_count_rows, &rows_seen);
+        latencies[i] = bench_now() - op_started;
+    }
+    bench_report("scan_full", num_rows, options, latencies, BENCH_FULL_SCANS,
+                 bench_now() - started);
+    db_finalize(scan);
+
+    Statement* range = db_prepare(table, "select where id between ? and ?", &result);
+    started = bench_now();
+    for (uint32_t i = 0; i < BENCH_RANGE_SCANS; i++) {
+        uint64_t op_started = bench_now();
+        uint32_t low = bench_random(&random_state) % num_rows + 1;
+        db_bind_id(range, 1, low);
+        db_bind_id(range, 2, (uint64_t)low + BENCH_RANGE_ROWS - 1);
+        db_step_batch(range, bench_count_rows, &rows_seen);
+        latencies[i] = bench_now() - op_started;
+    }
+    bench_report("scan_range", num_rows, options, latencies, BENCH_RANGE_SCANS,
+                 bench_now() - started);
+    db_finalize(range);
+
+    db_close(table);
+    bench_remove(path);
+    free(ids);
+    free(latencies);
 }
 
 /*******************************************************************
  * 主函数
  *******************************************************************/
 
+/**
+ * --batch 模式用于从管道导入脚本：不打印提示，连续的写语句在 REPL 打开的一个事务中
+ * 执行，成功的语句不逐条确认。一批在要等待输入、输入结束、遇到其他语句、元命令或错误、
+ * 或者达到 REPL_BATCH_MAX_STATEMENTS 条时结束，一起提交后打印一行确认。
+ */
+#define REPL_BATCH_MAX_STATEMENTS 65536
+
+typedef struct {
+    bool enabled;
+    bool in_transaction;  // 这一批的事务由 REPL 打开，用户的 begin 不算
+    uint32_t executed;    // 已执行、还没有确认的语句数
+} ReplBatch;
+
+bool statement_is_write(Statement* statement) {
+    return statement->type == STATEMENT_INSERT || statement->type == STATEMENT_DELETE ||
+           statement->type == STATEMENT_UPDATE || statement->type == STATEMENT_CREATE_INDEX;
+}
+
+void repl_batch_end(ReplBatch* batch, Table* table) {
+    if (batch->in_transaction) {
+        Statement commit = {.type = STATEMENT_COMMIT};
+        execute_statement(&commit, table, NULL, NULL);
+        batch->in_transaction = false;
+    }
+    if (batch->executed > 0) {
+        printf("Executed %u statements.\n", batch->executed);
+        batch->executed = 0;
+    }
+}
+
+#ifndef DB_NO_MAIN
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         printf("Must supply a database filename.\n");
@@ -1095,15 +8076,59 @@ int main(int argc, char* argv[]) {
     }
 
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    DbOptions options = db_default_options();
+    ReplBatch batch = {0};
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0) {
+            batch.enabled = true;
+        } else if (strcmp(argv[i], "--cache-frames") == 0 && i + 1 < argc) {
+            options.cache_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options.pager_mode = PAGER_MODE_MMAP;
+        } else if (strcmp(argv[i], "--wal") == 0) {
+            options.wal = true;
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            options.io_uring = true;
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            options.prefetch_pages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            options.scan_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            options.page_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--row-cache") == 0 && i + 1 < argc) {
+            options.row_cache_rows = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            options.compress = true;
+        } else if (strcmp(argv[i], "--checkpoint-rate") == 0 && i + 1 < argc) {
+            options.checkpoint_rate = atoi(argv[++i]);
+        } else {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    Table* table = db_open_with_options(filename, options);
+    if (table == NULL) {
+        exit(EXIT_FAILURE);
+    }
 
     InputBuffer* input_buffer = new_input_buffer();
+    OutputBuffer* output = new_output_buffer();
     while (true) {
-        print_prompt();
-        read_input(input_buffer);
+        if (!batch.enabled) {
+            print_prompt();
+        } else if (batch.executed >= REPL_BATCH_MAX_STATEMENTS ||
+                   input_buffer_would_block(input_buffer)) {
+            repl_batch_end(&batch, table);
+        }
+        if (!read_input(input_buffer)) {
+            repl_batch_end(&batch, table);
+            printf("Error reading input\n");
+            exit(EXIT_FAILURE);
+        }
 
         if (input_buffer->buffer[0] == '.') {
-            switch (do_meta_command(input_buffer, table)) {
+            repl_batch_end(&batch, table);
+            switch (do_meta_command(input_buffer, output, table)) {
                 case (META_COMMAND_SUCCESS):
                     continue;
                 case (META_COMMAND_UNRECOGNIZED_COMMAND):
@@ -1113,7 +8138,13 @@ int main(int argc, char* argv[]) {
         }
 
         Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) {
+        uint64_t start = stats_now();
+        PrepareResult prepare_result = prepare_statement(input_buffer->buffer, &statement);
+        stats_record_phase(table->pager, DB_PHASE_PREPARE, stats_now() - start);
+        if (prepare_result != PREPARE_SUCCESS) {
+            repl_batch_end(&batch, table);
+        }
+        switch (prepare_result) {
             case (PREPARE_SUCCESS):
                 break;
             case (PREPARE_NEGATIVE_ID):
@@ -1123,6 +8154,7 @@ int main(int argc, char* argv[]) {
                 printf("String is too long.\n");
                 continue;
             case (PREPARE_SYNTAX_ERROR):
+            case (PREPARE_INVALID_PARAMETER):
                 printf("Syntax error. Could not parse statement.\n");
                 continue;
             case (PREPARE_UNRECOGNIZED_STATEMENT):
@@ -1131,13 +8163,53 @@ int main(int argc, char* argv[]) {
                 continue;
         }
 
-        switch (execute_statement(&statement, table)) {
+        // 用户自己打开的事务中不再嵌套 REPL 的事务，语句逐条确认
+        bool batched = batch.enabled && statement_is_write(&statement) &&
+                       (txn_table == NULL || batch.in_transaction);
+        if (!batched) {
+            repl_batch_end(&batch, table);
+        } else if (!batch.in_transaction) {
+            Statement begin = {.type = STATEMENT_BEGIN};
+            execute_statement(&begin, table, NULL, NULL);
+            batch.in_transaction = true;
+        }
+
+        ExecuteResult result;
+        if (output->mode == OUTPUT_MODE_BINARY && statement.type == STATEMENT_SELECT) {
+            result = execute_statement(&statement, table, binary_batch_callback, output);
+            binary_end_result(output);
+        } else {
+            result = execute_statement(&statement, table, print_batch_callback, NULL);
+        }
+        statement_free_rows(&statement);
+        if (batched) {
+            if (result == EXECUTE_SUCCESS) {
+                batch.executed++;
+                continue;
+            }
+            repl_batch_end(&batch, table);
+        }
+
+        switch (result) {
             case (EXECUTE_SUCCESS):
                 printf("Executed.\n");
                 break;
             case (EXECUTE_DUPLICATE_KEY):
                 printf("Error: Duplicate key.\n");
                 break;
+            case (EXECUTE_UNBOUND_PARAMETER):
+                printf("Error: Unbound parameter.\n");
+                break;
+            case (EXECUTE_TRANSACTION_ACTIVE):
+                printf("Error: Transaction already open.\n");
+                break;
+            case (EXECUTE_NO_TRANSACTION):
+                printf("Error: No transaction is open.\n");
+                break;
+            case (EXECUTE_INDEX_EXISTS):
+                printf("Error: Index already exists.\n");
+                break;
         }
     }
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
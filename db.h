@@ -0,0 +1,220 @@
+#ifndef DB_H
+#define DB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*******************************************************************
+ * 嵌入式接口
+ *
+ *   Table* table = db_open("app.db");
+ *   PrepareResult result;
+ *   Statement* insert = db_prepare(table, "insert ? ? ?", &result);
+ *   db_bind_int(insert, 1, 42);
+ *   db_bind_text(insert, 2, "alice");
+ *   db_bind_text(insert, 3, "alice@example.com");
+ *   db_step(insert, NULL, NULL);
+ *   db_finalize(insert);
+ *   db_close(table);
+ *
+ * 编译 db.c 时定义 DB_NO_MAIN 即可去掉命令行程序的 main，与调用方一起链接。
+ * 同一个 Table 可以在多个线程中同时使用；一个 Statement 同一时刻只能在一个线程中使用。
+ *******************************************************************/
+
+typedef enum {
+    PREPARE_SUCCESS,
+    PREPARE_NEGATIVE_ID,
+    PREPARE_STRING_TOO_LONG,
+    PREPARE_SYNTAX_ERROR,
+    PREPARE_UNRECOGNIZED_STATEMENT,
+    PREPARE_INVALID_PARAMETER  // 参数编号超出范围，或值的类型与占位符不符
+} PrepareResult;
+
+typedef enum {
+    EXECUTE_SUCCESS,
+    EXECUTE_DUPLICATE_KEY,
+    EXECUTE_UNBOUND_PARAMETER,
+    EXECUTE_TRANSACTION_ACTIVE,  // 当前线程已经打开了事务
+    EXECUTE_NO_TRANSACTION,      // commit 时没有打开的事务
+    EXECUTE_INDEX_EXISTS         // create index 的列上已经有索引
+} ExecuteResult;
+
+typedef enum {
+    PAGER_MODE_BUFFERED,  // 缓冲池 + pread/pwrite
+    PAGER_MODE_MMAP       // 直接返回文件映射中的页面
+} PagerMode;
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+typedef struct {
+    uint64_t id;
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+} Row;
+
+typedef struct {
+    uint32_t cache_frames;
+    PagerMode pager_mode;
+    bool wal;
+    uint32_t prefetch_pages;
+    bool io_uring;
+    uint32_t scan_threads;  // 大于 1 时全表扫描由这么多线程并行完成
+    /**
+     * 新建数据库的页面大小，4096 到 65536 之间的 2 的幂，0 表示 4096。
+     * 已有的数据库使用文件头中记录的页面大小，忽略这一项。
+     * 同时打开的数据库的页面大小必须相同，不同时 db_open_with_options 返回 NULL。
+     */
+    uint32_t page_size;
+    /**
+     * 后台检查点线程每秒最多写回的页数，0 表示不启动它，
+     * 脏页只在置换、日志过长和关闭时写回。只在开启 wal 时生效。
+     */
+    uint32_t checkpoint_rate;
+    /**
+     * 新建的数据库在写回时压缩页面，读入缓冲池时解压。已有的数据库按文件头决定，
+     * 忽略这一项。压缩后省不下整块磁盘空间的页面原样写入，4096 字节的页面总是原样写入；
+     * 压缩的数据库不能用 mmap 模式打开，也不使用 io_uring。
+     */
+    bool compress;
+    /**
+     * 热点行缓存的行数，0 表示不启用。启用后 where id = K 的 select 先查缓存，
+     * 命中时不必下降；修改和删除使对应的行失效。每一行约占 300 字节。
+     */
+    uint32_t row_cache_rows;
+} DbOptions;
+
+typedef struct Table Table;
+typedef struct Statement Statement;
+
+/**
+ * select 每找到一行调用一次。row 只在回调期间有效，返回 false 提前结束扫描。
+ */
+typedef bool (*DbRowCallback)(const Row* row, void* context);
+
+/**
+ * 不以 '\0' 结尾的文本。
+ */
+typedef struct {
+    const char* data;
+    uint32_t length;
+} DbText;
+
+/**
+ * select 的一批结果，按列存放：第 i 行是 ids[i]、usernames[i]、emails[i]。
+ * select id 和聚合没有文本列，usernames、emails 为 NULL；
+ * count(*)、min(id)、max(id) 的结果是只有一行的批次，值在 ids[0] 中。
+ */
+typedef struct {
+    uint32_t count;
+    const uint64_t* ids;
+    const DbText* usernames;
+    const DbText* emails;
+} DbBatch;
+
+/**
+ * select 每产出一批行调用一次，通常是一个叶节点中的行。
+ * batch 只在回调期间有效，返回 false 提前结束扫描。
+ */
+typedef bool (*DbBatchCallback)(const DbBatch* batch, void* context);
+
+DbOptions db_default_options();
+Table* db_open_with_options(const char* filename, DbOptions options);
+Table* db_open(const char* filename);
+void db_close(Table* table);
+
+/**
+ * 编译一条语句。语句中的 ? 是占位符，按出现顺序从 1 开始编号：
+ *   insert ? ? ?
+ *   select where id = ?
+ *   select where id between ? and ?
+ *   update set username = ?, email = ? where id = ?
+ *   delete where id < ?
+ *   select where email = ?
+ *   select count(*) where id > ?
+ *   create index on email
+ * 多行的 insert values (1, a, a@x), (2, b, b@x) 不支持占位符。
+ * begin 之后到 commit 为止，当前线程的写语句一起提交，期间其他写者等待；
+ * 事务中的 select 能看到尚未提交的修改。
+ * where username = ? 或 where email = ? 在列上有索引时查索引，否则扫描整个表。
+ * select 之后可以跟 id、count(*)、min(id) 或 max(id)，只读 id，不解码整行。
+ * 失败时返回 NULL，原因写入 result。
+ */
+Statement* db_prepare(Table* table, const char* sql, PrepareResult* result);
+
+/**
+ * 绑定参数。绑定的值一直保留，可以只改其中几个再执行。
+ * id 是 64 位无符号整数，db_bind_id 能绑定所有的 id；
+ * db_bind_int 绑定负数时返回 PREPARE_NEGATIVE_ID，绑定不了 2^63 及以上的 id。
+ */
+PrepareResult db_bind_id(Statement* statement, uint32_t index, uint64_t value);
+PrepareResult db_bind_int(Statement* statement, uint32_t index, int64_t value);
+PrepareResult db_bind_text(Statement* statement, uint32_t index, const char* value);
+
+/**
+ * 执行语句。select 把每一行交给 callback（可以为 NULL）；
+ * insert、update、delete 在返回前提交。所有占位符都必须已经绑定。
+ */
+ExecuteResult db_step(Statement* statement, DbRowCallback callback, void* context);
+
+/**
+ * 与 db_step 相同，select 的结果按批交给 callback，文本列不复制到 Row 中。
+ */
+ExecuteResult db_step_batch(Statement* statement, DbBatchCallback callback, void* context);
+
+void db_finalize(Statement* statement);
+
+typedef enum {
+    DB_PHASE_PREPARE,  // 编译语句
+    DB_PHASE_EXECUTE,  // 执行语句，写语句包括提交
+    DB_NUM_PHASES
+} DbPhase;
+
+/**
+ * 直方图按微秒取对数分桶：桶 0 不到 1 微秒，桶 i 是 [2^(i-1), 2^i) 微秒，
+ * 最后一个桶包括所有更长的。
+ */
+#define DB_STATS_HISTOGRAM_BUCKETS 24
+
+/**
+ * 从打开数据库开始累计的计数。
+ */
+typedef struct {
+    uint64_t cache_hits;    // 页面已在缓冲池中
+    uint64_t cache_misses;  // 需要从文件读取或新分配的页面
+    uint64_t evictions;     // 为腾出帧而置换的页面
+    uint64_t bytes_read;
+    uint64_t bytes_written;  // 数据库文件和日志
+    uint64_t fsyncs;
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t row_cache_hits;  // where id = K 在热点行缓存中找到
+    uint64_t row_cache_misses;
+    uint64_t phase_count[DB_NUM_PHASES];
+    uint64_t phase_nanos[DB_NUM_PHASES];
+    uint64_t phase_histogram[DB_NUM_PHASES][DB_STATS_HISTOGRAM_BUCKETS];
+} DbStats;
+
+typedef struct {
+    uint32_t height;      // 只有根叶节点时为 1
+    uint32_t leaf_pages;
+    uint64_t rows;
+    double leaf_fill;  // 叶节点已用空间占可用空间的平均比例
+} DbTreeStats;
+
+/**
+ * 读取计数。计数按线程分别累加，这里把各线程的加起来，不影响正在执行的语句。
+ */
+void db_stats(Table* table, DbStats* stats);
+
+/**
+ * 遍历表的内部节点最左路径和全部叶节点，得到树的形状。代价与叶节点数成正比。
+ */
+void db_tree_stats(Table* table, DbTreeStats* stats);
+
+/**
+ * 在 path 上新建数据库，运行插入、点查和扫描的基准测试，每个负载向标准输出写一行 JSON。
+ * path 原有的内容会被删除，结束时也删除它。
+ */
+void db_bench(const char* path, uint32_t num_rows, DbOptions options);
+
+#endif
@@ -1,11 +1,13 @@
 describe 'database' do
   before do
-    `rm -rf test.db`
+    `rm -rf test.db test.db-wal test.csv`
   end
 
-  def run_script(commands)
+  def run_script(commands, options = "")
     raw_output = nil
-    IO.popen("./db test.db", "r+") do |pipe|
+    IO.popen("./db test.db #{options}", "r+") do |pipe|
+      # Read concurrently so long scripts cannot fill the output pipe
+      reader = Thread.new { pipe.gets(nil) }
       commands.each do |command|
         begin
           pipe.puts command
@@ -17,7 +19,7 @@ describe 'database' do
       pipe.close_write
 
       # Read entire output
-      raw_output = pipe.gets(nil)
+      raw_output = reader.value
     end
     raw_output.split("\n")
   end
@@ -48,6 +50,326 @@ describe 'database' do
     ])
   end
 
+  it 'keeps a table much larger than the buffer pool' do
+    script = (1..1500).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--cache-frames 64")
+
+    result = run_script(["select", ".exit"], "--cache-frames 64")
+    expect(result.length).to eq(1502)
+    expect(result.first).to eq("db > (1, user1, person1@example.com)")
+    expect(result[1499]).to eq("(1500, user1500, person1500@example.com)")
+  end
+
+  it 'scans the same rows with leaf readahead on or off' do
+    script = (1..2000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    with_readahead = run_script(["select", ".exit"], "--cache-frames 64 --prefetch 8")
+    without_readahead = run_script(["select", ".exit"], "--cache-frames 64 --prefetch 0")
+    expect(with_readahead.length).to eq(2002)
+    expect(with_readahead).to eq(without_readahead)
+    expect(with_readahead[1999]).to eq("(2000, user2000, person2000@example.com)")
+  end
+
+  it 'returns the same rows from a parallel scan, in order' do
+    script = (1..3000).map do |i|
+      "insert #{(i * 7) % 3001} user#{i % 5} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script)
+
+    queries = [
+      "select",
+      "select id where id between 100 and 2500",
+      "select count(*) where username = user3",
+      "select max(id) where id < 2999",
+      ".exit",
+    ]
+    parallel = run_script(queries, "--scan-threads 4")
+    expect(parallel).to eq(run_script(queries))
+    expect(parallel[0]).to eq("db > (1, user0, person1715@example.com)")
+    expect(parallel[-6...(parallel.length)]).to eq([
+      "Executed.",
+      "db > (600)",
+      "Executed.",
+      "db > (2998)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'acknowledges piped writes in batches' do
+    script = (1..3000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "insert 5 again again@example.com"
+    script << "select count(*)"
+    script << "delete where id > 1000"
+    script << ".exit"
+    result = run_script(script, "--wal --batch")
+
+    # How many writes share a commit depends on how the pipe is read
+    acks = result.select { |line| line =~ /^Executed \d+ statements\.$/ }
+    expect(acks.sum { |line| line[/\d+/].to_i }).to eq(3001)
+    expect(result - acks).to eq([
+      "Error: Duplicate key.",
+      "(3000)",
+      "Executed.",
+    ])
+
+    result = run_script(["select count(*)", ".exit"])
+    expect(result).to eq([
+      "db > (1000)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'writes select results as length-prefixed binary records' do
+    run_script([
+      "insert 2 bob bob@example.com",
+      "insert 1 alice alice@example.com",
+      ".exit",
+    ])
+
+    output = IO.popen("./db test.db", "r+b") do |pipe|
+      pipe.puts ".mode binary"
+      pipe.puts "select"
+      pipe.puts "select id where id > 1"
+      pipe.puts ".mode text"
+      pipe.puts "select count(*)"
+      pipe.puts ".exit"
+      pipe.close_write
+      pipe.read
+    end
+
+    alice = [1].pack("Q<") + [5].pack("C") + "alice" + [17].pack("C") + "alice@example.com"
+    bob = [2].pack("Q<") + [3].pack("C") + "bob" + [15].pack("C") + "bob@example.com"
+    expected = "db > db > " +
+      [alice.length].pack("L<") + alice + [bob.length].pack("L<") + bob + [0].pack("L<") +
+      "Executed.\ndb > " +
+      [8, 2, 0].pack("L<Q<L<") +
+      "Executed.\ndb > db > (2)\nExecuted.\ndb > "
+    expect(output).to eq(expected.b)
+  end
+
+  it 'reads and writes through the io_uring engine' do
+    script = (1..2000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--io-uring --cache-frames 64")
+
+    result = run_script(["select", ".exit"], "--io-uring --cache-frames 64")
+    expect(result.length).to eq(2002)
+    expect(result.first).to eq("db > (1, user1, person1@example.com)")
+    expect(result[1999]).to eq("(2000, user2000, person2000@example.com)")
+
+    result = run_script(["select where id > 1998", ".exit"])
+    expect(result).to eq([
+      "db > (1999, user1999, person1999@example.com)",
+      "(2000, user2000, person2000@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reads and writes the same file format in mmap mode' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--mmap")
+    expect(File.size("test.db") % 4096).to eq(0)
+
+    result = run_script(["insert 101 user101 person101@example.com", ".exit"])
+    expect(result).to match_array(["db > Executed.", "db > "])
+
+    result = run_script(["select", ".exit"], "--mmap")
+    expect(result.length).to eq(103)
+    expect(result.first).to eq("db > (1, user1, person1@example.com)")
+    expect(result[100]).to eq("(101, user101, person101@example.com)")
+  end
+
+  it 'keeps the page size chosen when the database was created' do
+    script = (1..1000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--page-size 65536")
+    # 文件头和一个放得下全部行的根叶节点
+    expect(File.size("test.db")).to eq(2 * 65536)
+
+    # 打开已有的文件时使用文件头中的页面大小
+    result = run_script(["select count(*)", "select where id = 1000", ".exit"], "--page-size 8192")
+    expect(result).to eq([
+      "db > (1000)",
+      "Executed.",
+      "db > (1000, user1000, person1000@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    `rm -f test.db`
+    result = run_script([".exit"], "--page-size 5000")
+    expect(result).to eq(["Page size must be a power of two from 4096 to 65536."])
+  end
+
+  it 'reads back a compressed database and its recovered log' do
+    script = (1..3000).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".exit"
+    run_script(script, "--compress --page-size 16384 --cache-frames 16")
+
+    # 压缩记录在文件头中，不带 --compress 也按压缩的数据库打开；日志中的页面没有压缩
+    script = (3001..3100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    run_script(script, "--wal")
+    result = run_script([
+      "select count(*)",
+      "select where id = 1500",
+      "select where id = 3100",
+      ".exit",
+    ], "--cache-frames 16")
+    expect(result).to eq([
+      "db > (3100)",
+      "Executed.",
+      "db > (1500, user1500, person1500@example.com)",
+      "Executed.",
+      "db > (3100, user3100, person3100@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+
+    result = run_script([".exit"], "--mmap")
+    expect(result).to eq(["Compressed databases cannot be opened in mmap mode."])
+  end
+
+  it 'writes incompressible pages of a compressed database unchanged' do
+    random = Random.new(3)
+    chars = ("a".."z").to_a + ("A".."Z").to_a + ("0".."9").to_a
+    # 短的随机行按顺序插入，叶节点几乎放满，压缩后反而比页面大
+    rows = (1..2000).map do |i|
+      [i, (1..random.rand(1..32)).map { chars.sample(random: random) }.join,
+       (1..random.rand(1..40)).map { chars.sample(random: random) }.join]
+    end
+    ["4096", "8192"].each do |page_size|
+      `rm -f test.db`
+      script = rows.map { |id, username, email| "insert #{id} #{username} #{email}" }
+      script << ".exit"
+      run_script(script, "--compress --page-size #{page_size} --cache-frames 16")
+
+      result = run_script(["select", ".exit"], "--cache-frames 16")
+      expect(result).to eq(
+        rows.each_with_index.map do |(id, username, email), i|
+          "#{i == 0 ? "db > " : ""}(#{id}, #{username}, #{email})"
+        end + ["Executed.", "db > "]
+      )
+    end
+  end
+
+  it 'recovers committed inserts from the write-ahead log after a crash' do
+    script = (1..50).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    # No .exit: the process dies at end of input without flushing pages
+    result = run_script(script, "--wal")
+    expect(result.last).to eq("db > Error reading input")
+    expect(File.exist?("test.db-wal")).to eq(true)
+
+    result = run_script(["select", ".exit"])
+    expect(result.length).to eq(52)
+    expect(result[49]).to eq("(50, user50, person50@example.com)")
+    expect(File.exist?("test.db-wal")).to eq(false)
+  end
+
+  it 'writes committed pages back in the background and empties the log' do
+    IO.popen("./db test.db --wal --checkpoint-rate 1000", "r+") do |pipe|
+      (1..500).each do |i|
+        pipe.puts "insert #{i} user#{i} person#{i}@example.com"
+      end
+      pipe.flush
+      # 等后台检查点写回全部脏页并清空日志：日志保持为空说明已经没有新的提交。
+      # 之后没有 .exit 直接退出
+      deadline = Time.now + 10
+      empty_since = nil
+      until (empty_since && Time.now - empty_since > 0.5) || Time.now > deadline
+        empty = File.size?("test.db") && File.exist?("test.db-wal") && File.size("test.db-wal") == 0
+        empty_since = empty ? (empty_since || Time.now) : nil
+        sleep 0.05
+      end
+      expect(File.size("test.db-wal")).to eq(0)
+      pipe.close_write
+      pipe.read
+    end
+
+    # 不靠日志恢复，数据库文件本身已经包含全部的行
+    `rm -f test.db-wal`
+    result = run_script(["select count(*)", ".exit"])
+    expect(result).to eq(["db > (500)", "Executed.", "db > "])
+  end
+
+  it 'bulk loads unsorted csv input into packed leaves' do
+    ids = (1..14).to_a.reverse + [3]
+    # Padded to full-size rows so that 13 fit in a leaf
+    row = lambda { |i| "#{i},#{"user#{i}".ljust(32, "u")},#{"person#{i}@example.com".ljust(255, "e")}" }
+    File.write("test.csv", ids.map { |i| row.call(i) + "\n" }.join)
+    result = run_script([
+      ".import test.csv",
+      ".btree",
+      "insert 15 user15 person15@example.com",
+      "select",
+      ".exit",
+    ])
+    expect(result[0...21]).to match_array([
+      "db > Skipped duplicate id 3.",
+      "Imported 14 rows.",
+      "db > Tree:",
+      "- internal (size 1)",
+      "  - leaf (size 7)",
+      "    - 1",
+      "    - 2",
+      "    - 3",
+      "    - 4",
+      "    - 5",
+      "    - 6",
+      "    - 7",
+      "  - key 7",
+      "  - leaf (size 7)",
+      "    - 8",
+      "    - 9",
+      "    - 10",
+      "    - 11",
+      "    - 12",
+      "    - 13",
+      "    - 14",
+    ])
+    expect(result[22]).to eq("db > (#{row.call(1).split(",").join(", ")})")
+    expect(result[36]).to eq("(15, user15, person15@example.com)")
+  end
+
+  it 'refuses to import into a non-empty table' do
+    File.write("test.csv", "2,user2,person2@example.com\n")
+    result = run_script([
+      "insert 1 user1 person1@example.com",
+      ".import test.csv",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Table must be empty to import.",
+      "db > ",
+    ])
+  end
+
   it 'allows inserting strings that are the maximum length' do
     long_username = "a"*32
     long_email = "a"*255
@@ -125,16 +447,93 @@ describe 'database' do
 
     expect(result).to match_array([
       "db > Constants:",
-      "ROW_SIZE: 293",
+      "ROW_SIZE: 297",
       "COMMON_NODE_HEADER_SIZE: 6",
-      "LEAF_NODE_HEADER_SIZE: 14",
-      "LEAF_NODE_CELL_SIZE: 297",
-      "LEAF_NODE_SPACE_FOR_CELLS: 4082",
-      "LEAF_NODE_MAX_CELLS: 13",
+      "LEAF_NODE_HEADER_SIZE: 28",
+      "LEAF_NODE_SLOT_SIZE: 8",
+      "LEAF_NODE_MAX_CELL_SIZE: 297",
+      "LEAF_NODE_SPACE_FOR_CELLS: 4068",
+      "LEAF_NODE_MAX_CELLS: 406",
+      "INTERNAL_NODE_MAX_CELLS: 508",
       "db > ",
     ])
   end
 
+  it 'reports benchmark results as json lines' do
+    result = run_script([".bench 500", "select", ".exit"])
+
+    expect(result.length).to eq(7)
+    names = result[0...5].map do |line|
+      line.sub("db > ", "")[/\A\{"benchmark":"(\w+)","rows":500,"cache_frames":\d+,"page_size":4096,"ops":\d+,"ops_per_sec":\d+,"p50_us":[\d.]+,"p99_us":[\d.]+,"p999_us":[\d.]+\}\z/, 1]
+    end
+    expect(names).to eq(["insert_seq", "insert_random", "lookup", "scan_full", "scan_range"])
+    # 在临时文件上运行，当前的表仍然是空的
+    expect(result[5...7]).to eq(["db > Executed.", "db > "])
+  end
+
+  it 'reports pager and tree statistics' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".stats"
+    script << ".exit"
+    # 不启动后台检查点，fsync 只来自提交
+    result = run_script(script, "--wal --checkpoint-rate 0")
+
+    stats = result.drop_while { |line| !line.end_with?("Stats:") }
+    values = stats.map { |line| line.split(": ", 2) }.select { |pair| pair.length == 2 }.to_h
+    expect(values["leaf_splits"]).to eq("1")
+    expect(values["internal_splits"]).to eq("0")
+    expect(values["tree_height"]).to eq("2")
+    expect(values["leaf_pages"]).to eq("2")
+    expect(values["rows"]).to eq("200")
+    # 每次提交一次 fdatasync，再加上打开新数据库时的一次
+    expect(values["fsyncs"]).to eq("201")
+    expect(values["cache_hits"].to_i > 0).to eq(true)
+    expect(stats.any? { |line| line.start_with?("prepare: 200 statements, ") }).to eq(true)
+
+    # 重新打开后页面从文件读入
+    result = run_script(["select id", ".stats", ".exit"])
+    values = result.map { |line| line.split(": ", 2) }.select { |pair| pair.length == 2 }.to_h
+    expect(values["cache_misses"].to_i >= 3).to eq(true)
+    expect(values["bytes_read"].to_i >= 3 * 4096).to eq(true)
+  end
+
+  it 'serves repeated point lookups from the row cache' do
+    script = (1..500).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script += ["select where id = 7"] * 3
+    script << "update set username = renamed where id = 7"
+    script << "select where id = 7"
+    script << "delete where id = 7"
+    script << "select where id = 7"
+    script << "select count(*) where id = 8"
+    script << "select count(*) where id = 8"
+    script << ".stats"
+    script << ".exit"
+    result = run_script(script, "--row-cache 64")
+
+    expect(result[500...512]).to eq([
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > (7, renamed, person7@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1)",
+    ])
+    values = result.map { |line| line.split(": ", 2) }.select { |pair| pair.length == 2 }.to_h
+    # 第一次读入缓存，之后两次命中；修改和删除使它失效，不存在的行不放进缓存
+    expect(values["row_cache_hits"]).to eq("3")
+    expect(values["row_cache_misses"]).to eq("4")
+  end
+
   it 'allows printing out the structure of a one-node btree' do
     script = [3, 1, 2].map do |i|
       "insert #{i} user#{i} person#{i}@example.com"
@@ -156,6 +555,264 @@ describe 'database' do
     ])
   end
 
+  it 'packs short rows into a single leaf' do
+    script = (1..100).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << ".btree"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[100]).to eq("db > Tree:")
+    expect(result[101]).to eq("- leaf (size 100)")
+    expect(result[202]).to eq("db > (1, user1, person1@example.com)")
+    expect(result[301]).to eq("(100, user100, person100@example.com)")
+  end
+
+  it 'selects ranges of ids across leaves' do
+    script = (1..300).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select where id between 100 and 130"
+    script << "select where id = 7"
+    script << "select where id > 298"
+    script << "select where id < 0"
+    script << "select where id = 500"
+    script << "select where name = 7"
+    script << ".exit"
+    result = run_script(script)
+
+    rows = result[300...331].map { |line| line.sub("db > ", "") }
+    expect(rows).to eq((100..130).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+    expect(result[331...(result.length)]).to eq([
+      "Executed.",
+      "db > (7, user7, person7@example.com)",
+      "Executed.",
+      "db > (299, user299, person299@example.com)",
+      "(300, user300, person300@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'projects ids and aggregates without reading whole rows' do
+    script = (1..300).map do |i|
+      "insert #{i} user#{i % 4} person#{i}@example.com"
+    end
+    script << "select id where id > 297"
+    script << "select count(*)"
+    script << "select count(*) where id between 100 and 199"
+    script << "select min(id) where id > 150"
+    script << "select max(id) where username = user2"
+    script << "select count(*) where id > 300"
+    script << "select max(id) where id > 300"
+    script << "select * where id = 5"
+    script << "select sum(id)"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[300...(result.length)]).to eq([
+      "db > (298)",
+      "(299)",
+      "(300)",
+      "Executed.",
+      "db > (300)",
+      "Executed.",
+      "db > (100)",
+      "Executed.",
+      "db > (151)",
+      "Executed.",
+      "db > (298)",
+      "Executed.",
+      "db > (0)",
+      "Executed.",
+      "db > Executed.",
+      "db > (5, user1, person5@example.com)",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'inserts several rows in one statement, all or none' do
+    result = run_script([
+      "insert values (3, user3, person3@example.com), (1, user1, person1@example.com)",
+      "insert values (2, user2, person2@example.com), (3, user3, person3@example.com)",
+      "insert values (4, user4, a@b), (4, user4, a@b)",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Executed.",
+      "db > Error: Duplicate key.",
+      "db > Error: Duplicate key.",
+      "db > (1, user1, person1@example.com)",
+      "(3, user3, person3@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'commits the inserts of a transaction together' do
+    result = run_script([
+      "commit",
+      "begin",
+      "begin",
+      "insert 2 user2 person2@example.com",
+      "insert values (1, user1, person1@example.com)",
+      "select",
+      "commit",
+      ".exit",
+    ], "--wal")
+    expect(result).to match_array([
+      "db > Error: No transaction is open.",
+      "db > Executed.",
+      "db > Error: Transaction already open.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+
+    result = run_script(["select", ".exit"], "--wal")
+    expect(result).to match_array([
+      "db > (1, user1, person1@example.com)",
+      "(2, user2, person2@example.com)",
+      "Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'reads consistent snapshots through the C api while a writer inserts' do
+    `gcc -O2 -DDB_NO_MAIN db.c api_test.c -o api_test -lpthread 2>&1`
+    ["", "--wal --cache-frames 16"].each do |options|
+      result = `./api_test --file test.db #{options}`.split("\n")
+      expect(result).to eq(["ok"])
+    end
+    `rm -f api_test`
+  end
+
+  it 'rejects statements with unbound placeholders' do
+    result = run_script([
+      "insert ? user1 person1@example.com",
+      "select where id = ?",
+      "select",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > Error: Unbound parameter.",
+      "db > Error: Unbound parameter.",
+      "db > Executed.",
+      "db > ",
+    ])
+  end
+
+  it 'updates rows and splits leaves they no longer fit in' do
+    script = (1..15).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "update set username = bob where id between 2 and 3"
+    script << "update set id = 7"
+    script << "update set email = #{"e"*255}, username = #{"u"*32} where id >= 8"
+    script << "update set email = #{"e"*255} where id < 8"
+    script << "select where id <= 2"
+    script << ".btree"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[15...(result.length)]).to match_array([
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > (1, user1, #{"e"*255})",
+      "(2, bob, #{"e"*255})",
+      "Executed.",
+      "db > Tree:",
+      "- internal (size 1)",
+      "  - leaf (size 7)",
+      *(1..7).map { |i| "    - #{i}" },
+      "  - key 7",
+      "  - leaf (size 8)",
+      *(8..15).map { |i| "    - #{i}" },
+      "db > ",
+    ])
+  end
+
+  it 'merges leaves emptied by deletes and reuses their pages' do
+    script = (1..14).map do |i|
+      "insert #{i} #{"u"*32} #{"e"*255}"
+    end
+    script << "delete where id > 10"
+    script << "delete where id = 1"
+    script << ".btree"
+    script << "insert 11 a b"
+    script << "delete"
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    expect(result[14...(result.length)]).to match_array([
+      "db > Executed.",
+      "db > Executed.",
+      "db > Tree:",
+      "- leaf (size 9)",
+      "  - 2",
+      "  - 3",
+      "  - 4",
+      "  - 5",
+      "  - 6",
+      "  - 7",
+      "  - 8",
+      "  - 9",
+      "  - 10",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > ",
+    ])
+    # 文件头、根节点、拆分出的两个叶节点和第一次释放页面时分配的元数据页，
+    # 释放的页面之后被重新使用
+    expect(File.size("test.db")).to eq(5 * 4096)
+  end
+
+  it 'looks up rows through secondary indexes' do
+    script = (1..200).map do |i|
+      "insert #{i} user#{i % 3} person#{i}@example.com"
+    end
+    script << "select where email = person150@example.com"
+    script << "create index on email"
+    script << "create index on username"
+    script << "create index on email"
+    script << "update set email = bob@example.com where id = 150"
+    script << "delete where username = user1"
+    script << ".exit"
+    run_script(script)
+
+    result = run_script([
+      "select where email = bob@example.com",
+      "select where email = person150@example.com",
+      "select where username = user1",
+      "select where username = user2 and",
+      ".exit",
+    ])
+    expect(result).to match_array([
+      "db > (150, user0, bob@example.com)",
+      "Executed.",
+      "db > Executed.",
+      "db > Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
   it 'prints an error message if there is a duplicate id' do
     script = [
       "insert 1 user1 person1@example.com",
@@ -173,19 +830,19 @@ describe 'database' do
     ])
   end
 
-  it 'allows printing out the structure of a 3-leaf-node btree' do
+  it 'keeps the left leaf full when ascending inserts split the right-most leaf' do
     script = (1..14).map do |i|
-      "insert #{i} user#{i} person#{i}@example.com"
+      "insert #{i} #{"u"*32} #{"e"*255}"
     end
     script << ".btree"
-    script << "insert 15 user15 person15@example.com"
+    script << "insert 15 #{"u"*32} #{"e"*255}"
     script << ".exit"
     result = run_script(script)
 
     expect(result[14...(result.length)]).to match_array([
       "db > Tree:",
       "- internal (size 1)",
-      "  - leaf (size 7)",
+      "  - leaf (size 13)",
       "    - 1",
       "    - 2",
       "    - 3",
@@ -193,14 +850,14 @@ describe 'database' do
       "    - 5",
       "    - 6",
       "    - 7",
-      "  - key 7",
-      "  - leaf (size 7)",
       "    - 8",
       "    - 9",
       "    - 10",
       "    - 11",
       "    - 12",
       "    - 13",
+      "  - key 13",
+      "  - leaf (size 1)",
       "    - 14",
       "db > Executed.",
       "db > ",
@@ -236,198 +893,197 @@ describe 'database' do
     ])
   end
 
+  it 'keeps rows in order when internal nodes split' do
+    ids = (1..5000).to_a.shuffle(random: Random.new(42))
+    script = ids.map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    rows = result[5000...(result.length - 2)].map { |line| line.sub("db > ", "") }
+    expect(rows).to eq((1..5000).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+  end
+
+  it 'keeps 64-bit ids in order when they are far apart' do
+    random = Random.new(7)
+    ids = (1..1000).to_a +
+      (1..1000).map { |i| (1 << 40) + i } +
+      (1..1000).map { |i| (1 << 60) + i * 4096 } +
+      (1..1000).map { random.rand(1 << 64) } +
+      [(1 << 64) - 1, 1 << 32, (1 << 32) - 1]
+    ids = ids.uniq.shuffle(random: random)
+    script = ids.map { |i| "insert #{i} u#{i % 100} e#{i % 7}" }
+    script << "select id"
+    script << ".exit"
+    result = run_script(script)
+    rows = result[ids.length...(result.length - 2)].map { |line| line.sub("db > ", "") }
+    expect(rows).to eq(ids.sort.map { |i| "(#{i})" })
+
+    result = run_script([
+      "select where id = 18446744073709551615",
+      "select count(*) where id > 4294967295",
+      "insert 18446744073709551616 a b",
+      ".exit",
+    ])
+    expect(result).to eq([
+      "db > (18446744073709551615, u15, e1)",
+      "Executed.",
+      "db > (#{ids.count { |i| i > 4294967295 }})",
+      "Executed.",
+      "db > Syntax error. Could not parse statement.",
+      "db > ",
+    ])
+  end
+
+  it 'keeps the tree shallow when ids are too sparse for 32-bit key deltas' do
+    random = Random.new(11)
+    patterns = {
+      "stride 2^32" => (1..3000).map { |i| i << 32 },
+      "snowflake" => (1..3000).map { |i| ((1_600_000_000_000 + i * 37) << 22) | ((i % 32) << 12) | (i % 4096) },
+      "random 63-bit" => (1..3000).map { random.rand(1 << 63) }.uniq,
+    }
+    patterns.each do |name, ids|
+      ["", "--page-size 65536"].each do |options|
+        `rm -rf test.db test.db-wal`
+        script = ids.map { |i| "insert #{i} u#{i % 100} e#{i % 7}" }
+        script += ids.each_slice(2).map { |pair| "delete where id = #{pair[0]}" }
+        script << ".stats"
+        script << "select id"
+        script << ".exit"
+        result = run_script(script, options)
+
+        values = result.map { |line| line.split(": ", 2) }.select { |pair| pair.length == 2 }.to_h
+        # 在旧格式中这些 id 每个叶节点只放得下几个，树深过 32 层后退出
+        expect([name, options, values["tree_height"].to_i <= 2]).to eq([name, options, true])
+        kept = ids.each_slice(2).map { |pair| pair[1] }.compact.sort
+        rows = result.select { |line| line =~ /\A(db > )?\(\d+\)\z/ }.map { |line| line.sub("db > ", "") }
+        expect(rows).to eq(kept.map { |i| "(#{i})" })
+      end
+    end
+  end
+
+  it 'keeps rows ordered after many descending inserts' do
+    script = 5000.downto(1).map do |i|
+      "insert #{i} user#{i} person#{i}@example.com"
+    end
+    script << "select"
+    script << ".exit"
+    result = run_script(script)
+
+    rows = result[5000...(result.length - 2)].map { |line| line.sub("db > ", "") }
+    expect(rows).to eq((1..5000).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" })
+  end
+
   it 'allows printing out the structure of a 4-leaf-node btree' do
+    # Full-size rows: exactly 13 fit in a leaf, so splits happen at the same points
     script = [
-      "insert 18 user18 person18@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 23 user23 person23@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 26 user26 person26@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 11 user11 person11@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 3 user3 person3@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 27 user27 person27@example.com",
-      "insert 17 user17 person17@example.com",
-      "insert 16 user16 person16@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 28 user28 person28@example.com",
-      ".btree",
-      ".exit",
-    ]
+      18, 7, 10, 29, 23, 4, 14, 30, 15, 26, 22, 19, 2, 1, 21, 11, 6, 20, 5, 8,
+      9, 3, 12, 27, 17, 16, 13, 24, 25, 28
+    ].map do |i|
+      "insert #{i} #{"u"*32} #{"e"*255}"
+    end
+    script << ".btree"
+    script << ".exit"
     result = run_script(script)
     puts(result)
   end
 
   it 'allows printing out the structure of a 7-leaf-node btree' do
+    # Full-size rows: exactly 13 fit in a leaf, so splits happen at the same points
     script = [
-      "insert 58 user58 person58@example.com",
-      "insert 56 user56 person56@example.com",
-      "insert 8 user8 person8@example.com",
-      "insert 54 user54 person54@example.com",
-      "insert 77 user77 person77@example.com",
-      "insert 7 user7 person7@example.com",
-      "insert 25 user25 person25@example.com",
-      "insert 71 user71 person71@example.com",
-      "insert 13 user13 person13@example.com",
-      "insert 22 user22 person22@example.com",
-      "insert 53 user53 person53@example.com",
-      "insert 51 user51 person51@example.com",
-      "insert 59 user59 person59@example.com",
-      "insert 32 user32 person32@example.com",
-      "insert 36 user36 person36@example.com",
-      "insert 79 user79 person79@example.com",
-      "insert 10 user10 person10@example.com",
-      "insert 33 user33 person33@example.com",
-      "insert 20 user20 person20@example.com",
-      "insert 4 user4 person4@example.com",
-      "insert 35 user35 person35@example.com",
-      "insert 76 user76 person76@example.com",
-      "insert 49 user49 person49@example.com",
-      "insert 24 user24 person24@example.com",
-      "insert 70 user70 person70@example.com",
-      "insert 48 user48 person48@example.com",
-      "insert 39 user39 person39@example.com",
-      "insert 15 user15 person15@example.com",
-      "insert 47 user47 person47@example.com",
-      "insert 30 user30 person30@example.com",
-      "insert 86 user86 person86@example.com",
-      "insert 31 user31 person31@example.com",
-      "insert 68 user68 person68@example.com",
-      "insert 37 user37 person37@example.com",
-      "insert 66 user66 person66@example.com",
-      "insert 63 user63 person63@example.com",
-      "insert 40 user40 person40@example.com",
-      "insert 78 user78 person78@example.com",
-      "insert 19 user19 person19@example.com",
-      "insert 46 user46 person46@example.com",
-      "insert 14 user14 person14@example.com",
-      "insert 81 user81 person81@example.com",
-      "insert 72 user72 person72@example.com",
-      "insert 6 user6 person6@example.com",
-      "insert 50 user50 person50@example.com",
-      "insert 85 user85 person85@example.com",
-      "insert 67 user67 person67@example.com",
-      "insert 2 user2 person2@example.com",
-      "insert 55 user55 person55@example.com",
-      "insert 69 user69 person69@example.com",
-      "insert 5 user5 person5@example.com",
-      "insert 65 user65 person65@example.com",
-      "insert 52 user52 person52@example.com",
-      "insert 1 user1 person1@example.com",
-      "insert 29 user29 person29@example.com",
-      "insert 9 user9 person9@example.com",
-      "insert 43 user43 person43@example.com",
-      "insert 75 user75 person75@example.com",
-      "insert 21 user21 person21@example.com",
-      "insert 82 user82 person82@example.com",
-      "insert 12 user12 person12@example.com",
-      "insert 18 user18 person18@example.com",
-      "insert 60 user60 person60@example.com",
-      "insert 44 user44 person44@example.com",
-      ".btree",
-      ".exit",
-    ]
+      58, 56, 8, 54, 77, 7, 25, 71, 13, 22, 53, 51, 59, 32, 36, 79, 10, 33, 20,
+      4, 35, 76, 49, 24, 70, 48, 39, 15, 47, 30, 86, 31, 68, 37, 66, 63, 40, 78,
+      19, 46, 14, 81, 72, 6, 50, 85, 67, 2, 55, 69, 5, 65, 52, 1, 29, 9, 43, 75,
+      21, 82, 12, 18, 60, 44
+    ].map do |i|
+      "insert #{i} #{"u"*32} #{"e"*255}"
+    end
+    script << ".btree"
+    script << ".exit"
     result = run_script(script)
 
     expect(result[64...(result.length)]).to match_array([
       "db > Tree:",
-      "- internal (size 1)",
-      "  - internal (size 2)",
-      "    - leaf (size 7)",
-      "      - 1",
-      "      - 2",
-      "      - 4",
-      "      - 5",
-      "      - 6",
-      "      - 7",
-      "      - 8",
-      "    - key 8",
-      "    - leaf (size 11)",
-      "      - 9",
-      "      - 10",
-      "      - 12",
-      "      - 13",
-      "      - 14",
-      "      - 15",
-      "      - 18",
-      "      - 19",
-      "      - 20",
-      "      - 21",
-      "      - 22",
-      "    - key 22",
-      "    - leaf (size 8)",
-      "      - 24",
-      "      - 25",
-      "      - 29",
-      "      - 30",
-      "      - 31",
-      "      - 32",
-      "      - 33",
-      "      - 35",
+      "- internal (size 6)",
+      "  - leaf (size 7)",
+      "    - 1",
+      "    - 2",
+      "    - 4",
+      "    - 5",
+      "    - 6",
+      "    - 7",
+      "    - 8",
+      "  - key 8",
+      "  - leaf (size 11)",
+      "    - 9",
+      "    - 10",
+      "    - 12",
+      "    - 13",
+      "    - 14",
+      "    - 15",
+      "    - 18",
+      "    - 19",
+      "    - 20",
+      "    - 21",
+      "    - 22",
+      "  - key 22",
+      "  - leaf (size 8)",
+      "    - 24",
+      "    - 25",
+      "    - 29",
+      "    - 30",
+      "    - 31",
+      "    - 32",
+      "    - 33",
+      "    - 35",
       "  - key 35",
-      "  - internal (size 3)",
-      "    - leaf (size 12)",
-      "      - 36",
-      "      - 37",
-      "      - 39",
-      "      - 40",
-      "      - 43",
-      "      - 44",
-      "      - 46",
-      "      - 47",
-      "      - 48",
-      "      - 49",
-      "      - 50",
-      "      - 51",
-      "    - key 51",
-      "    - leaf (size 11)",
-      "      - 52",
-      "      - 53",
-      "      - 54",
-      "      - 55",
-      "      - 56",
-      "      - 58",
-      "      - 59",
-      "      - 60",
-      "      - 63",
-      "      - 65",
-      "      - 66",
-      "    - key 66",
-      "    - leaf (size 7)",
-      "      - 67",
-      "      - 68",
-      "      - 69",
-      "      - 70",
-      "      - 71",
-      "      - 72",
-      "      - 75",
-      "    - key 75",
-      "    - leaf (size 8)",
-      "      - 76",
-      "      - 77",
-      "      - 78",
-      "      - 79",
-      "      - 81",
-      "      - 82",
-      "      - 85",
-      "      - 86",
+      "  - leaf (size 12)",
+      "    - 36",
+      "    - 37",
+      "    - 39",
+      "    - 40",
+      "    - 43",
+      "    - 44",
+      "    - 46",
+      "    - 47",
+      "    - 48",
+      "    - 49",
+      "    - 50",
+      "    - 51",
+      "  - key 51",
+      "  - leaf (size 11)",
+      "    - 52",
+      "    - 53",
+      "    - 54",
+      "    - 55",
+      "    - 56",
+      "    - 58",
+      "    - 59",
+      "    - 60",
+      "    - 63",
+      "    - 65",
+      "    - 66",
+      "  - key 66",
+      "  - leaf (size 7)",
+      "    - 67",
+      "    - 68",
+      "    - 69",
+      "    - 70",
+      "    - 71",
+      "    - 72",
+      "    - 75",
+      "  - key 75",
+      "  - leaf (size 8)",
+      "    - 76",
+      "    - 77",
+      "    - 78",
+      "    - 79",
+      "    - 81",
+      "    - 82",
+      "    - 85",
+      "    - 86",
       "db > ",
     ])
   end